@@ -0,0 +1,44 @@
+-- per-call overhead of a few bindings, in ns/call.
+-- run it with two builds of mpfr.so to compare them:
+--	lua bench.lua [iterations]
+
+local mpfr = require 'mpfr'
+
+local N = tonumber(arg and arg[1]) or 1000000
+
+local cases = {
+	{"add", function(n, x, y, z)
+		for i = 1, n do z:add(x, y) end
+	end},
+	{"mul", function(n, x, y, z)
+		for i = 1, n do z:mul(x, y) end
+	end},
+	{"fma", function(n, x, y, z)
+		for i = 1, n do z:fma(x, y, x) end
+	end},
+	{"cmp", function(n, x, y, z)
+		for i = 1, n do x:cmp(y) end
+	end},
+}
+
+local function empty(n, x, y, z)
+	for i = 1, n do end
+end
+
+local function time(f, prec)
+	local x, y, z = mpfr.new(prec), mpfr.new(prec), mpfr.new(prec)
+	x:set(1.5)
+	y:set(2.25)
+	local t = os.clock()
+	f(N, x, y, z)
+	return os.clock() - t
+end
+
+for _, prec in ipairs{53, 128, 256} do
+	local base = time(empty, prec)
+	for _, c in ipairs(cases) do
+		local t = time(c[2], prec) - base
+		print(string.format("%-4s %4d bits %8.1f ns/call",
+			c[1], prec, t / N * 1e9))
+	end
+end
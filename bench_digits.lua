@@ -0,0 +1,32 @@
+-- decimal conversion speed of tostring, in digits/s, against the
+-- number of threads:
+--	lua bench_digits.lua [digits] [max threads]
+
+local mpfr = require 'mpfr'
+
+local N = tonumber(arg and arg[1]) or 1000000
+local T = tonumber(arg and arg[2]) or 8
+
+local x = mpfr.new(math.ceil(N * math.log(10, 2)) + 64):const_pi()
+
+-- os.clock adds up all threads, so count whole conversions done
+-- between two ticks of os.time instead
+local function rate(secs)
+	local t = os.time()
+	while os.time() == t do end
+	t = os.time()
+	local k = 0
+	repeat
+		x:tostring(10, N)
+		k = k + 1
+	until os.time() - t >= secs
+	return k * N / (os.time() - t)
+end
+
+local threads = 1
+while threads <= T do
+	mpfr.conv_config{threads = threads, threshold = 0}
+	print(string.format("%3d threads %12.0f digits/s", threads, rate(3)))
+	threads = threads * 2
+end
+mpfr.conv_config{threads = 0, threshold = 100000}
@@ -5,16 +5,96 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <float.h>
 #include <math.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <mpfr.h>
 
 #include <lua.h>
 #include <lauxlib.h>
 
+#define LMPFR_CORE
+#include "lua_mpfr.h"
+
 #define VERSION "mpfr library for " LUA_VERSION \
 		" (2018.10), MPFR " MPFR_VERSION_STRING
 #define MPFR	"mpfr_t"
+#define VECTOR	"mpfr_vector"
+#define EXPR	"mpfr_expr"
+#define INTERVAL	"mpfr_interval"
+#define COMPLEX	"mpfr_complex"
+#define CVECTOR	"mpfr_cvector"
+#define WORKERS_KEY	"mpfr_workers"
+
+/*
+ * Every function of the module carries the metatables of the module's
+ * types as its first upvalues, so an argument is checked by comparing
+ * metatables instead of looking the type name up in the registry.
+ * Upvalues of the generic bindings (function pointers) come after them.
+ */
+#define NUPVAL		6
+#define UV_MPFR		lua_upvalueindex(1)
+#define UV_VECTOR	lua_upvalueindex(2)
+#define UV_EXPR		lua_upvalueindex(3)
+#define UV_INTERVAL	lua_upvalueindex(4)
+#define UV_COMPLEX	lua_upvalueindex(5)
+#define UV_CVECTOR	lua_upvalueindex(6)
+#define UV_FN(n)	lua_upvalueindex(NUPVAL + (n))
+
+static void _push_upvals(lua_State *L)
+{
+	luaL_getmetatable(L, MPFR);
+	luaL_getmetatable(L, VECTOR);
+	luaL_getmetatable(L, EXPR);
+	luaL_getmetatable(L, INTERVAL);
+	luaL_getmetatable(L, COMPLEX);
+	luaL_getmetatable(L, CVECTOR);
+}
+
+/* userdata at index i if its metatable is the one at index mt */
+static void *_test_type(lua_State *L, int i, int mt)
+{
+	void *p;
+
+	p = lua_touserdata(L, i);
+	if (p && lua_getmetatable(L, i)) {
+		if (!lua_rawequal(L, -1, mt))
+			p = NULL;
+		lua_pop(L, 1);
+		return p;
+	}
+	return NULL;
+}
+
+static int _type_error(lua_State *L, int i, const char *tname)
+{
+	return luaL_argerror(L, i, lua_pushfstring(L, "%s expected, got %s",
+		tname, luaL_typename(L, i)));
+}
+
+static mpfr_ptr _test_fr(lua_State *L, int i)
+{
+	return _test_type(L, i, UV_MPFR);
+}
+
+static mpfr_ptr _check_fr(lua_State *L, int i)
+{
+	mpfr_ptr z;
+
+	z = _test_fr(L, i);
+	if (!z)
+		_type_error(L, i, MPFR);
+	return z;
+}
 
 
 /* buffer size for mpfr_get_str. see its doc for the formula. */
@@ -35,270 +115,2444 @@ static int _opt_base(lua_State *L, int i)
 	return b;
 }
 
-static int _opt_rnd(lua_State *L, int i)
+/*
+ * Per thread, as MPFR's own defaults are in a thread-safe build: a Lua
+ * state on another thread neither sees nor overwrites these.
+ */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define THREAD_LOCAL	_Thread_local
+#else
+#define THREAD_LOCAL	__thread
+#endif
+
+/* kept in sync with this thread's MPFR default, to save a call per
+ * binding; a new thread starts from MPFR_RNDN, as MPFR does */
+static THREAD_LOCAL mpfr_rnd_t _default_rnd = MPFR_RNDN;
+
+static int _check_rnd(lua_State *L, int i)
 {
 	lua_Integer r;
 
-	r = luaL_optinteger(L, i, mpfr_get_default_rounding_mode());
+	r = luaL_checkinteger(L, i);
+	luaL_argcheck(L, r == MPFR_RNDN || r == MPFR_RNDZ ||
+		r == MPFR_RNDU || r == MPFR_RNDD || r == MPFR_RNDA,
+		i, "invalid rounding mode");
 	return r;
 }
 
-/* tostring(self, [base], [n], [rnd]) */
-static int fr_tostring(lua_State *L)
+static int _opt_rnd(lua_State *L, int i)
 {
-	luaL_Buffer B;
-	char *s, *p;
-	mpfr_exp_t e;
-	int b;
-	size_t n;
-	mpfr_ptr z;
-	mpfr_rnd_t r;
-	size_t sz, len;
-
-	z = luaL_checkudata(L, 1, MPFR);
-
-	b = _opt_base(L, 2);
-	n = luaL_optinteger(L, 3, 0);
-	r = _opt_rnd(L, 4);
-
-	/* special cases */
-	if (!mpfr_number_p(z)) {
-		char buf[7];
-		mpfr_get_str(buf, &e, b, n, z, r);
-		lua_pushstring(L, buf);
-		return 1;
-	} else if (mpfr_zero_p(z)) {
-		lua_pushstring(L, mpfr_signbit(z) ? "-0" : "0");
-		return 1;
-	}
-
-	sz = _outbufsize(z, b, n) + 1; /* +1 for the decimal point */
-	s = luaL_buffinitsize(L, &B, sz);
-	p = s + 1;
-	mpfr_get_str(p, &e, b, n, z, r);
-
-	len = strlen(p); /* actual length from mpfr_get_str */
-	if (*p == '-')
-		*s++ = *p++; /* skip minus sign */
-
-	/* insert decimal point */
-	s[0] = *p;
-	s[1] = '.';
-	luaL_addsize(&B, len + 1);
+	if (lua_isnoneornil(L, i))
+		return _default_rnd;
+	return _check_rnd(L, i);
+}
 
-	if (--e) { /* append exponent */
-		luaL_addchar(&B, (b > 10) ? '@' : 'e');
-		lua_pushinteger(L, e);
-		luaL_addvalue(&B);
-	}
+/* ternary value of the last rounding binding on this thread, see
+ * last_ternary */
+static THREAD_LOCAL int _ternary = 0;
 
-	luaL_pushresult(&B);
+/* return self, keeping the ternary value t */
+static int _ret(lua_State *L, int t)
+{
+	_ternary = t;
+	lua_settop(L, 1);
 	return 1;
 }
 
 
-/* tonumber(self, [rnd]) */
-static int fr_tonumber(lua_State *L)
+#if MPFR_VERSION >= MPFR_VERSION_NUM(4,0,0)
+static unsigned _flags_save(void)
 {
-	mpfr_ptr z;
-	mpfr_rnd_t r;
+	return mpfr_flags_save();
+}
 
-	z = luaL_checkudata(L, 1, MPFR);
-	r = _opt_rnd(L, 2);
-	if (sizeof (long) <= sizeof (lua_Integer) &&
-			mpfr_integer_p(z) && mpfr_fits_slong_p(z, r))
-		lua_pushinteger(L, mpfr_get_si(z, r));
-	else
-		lua_pushnumber(L, mpfr_get_d(z, r));
-	return 1;
+static void _flags_clear(unsigned mask)
+{
+	mpfr_flags_clear(mask);
 }
 
+static void _flags_set(unsigned mask)
+{
+	mpfr_flags_set(mask);
+}
+#else
+#define MPFR_FLAGS_UNDERFLOW	1
+#define MPFR_FLAGS_OVERFLOW	2
+#define MPFR_FLAGS_NAN		4
+#define MPFR_FLAGS_INEXACT	8
+#define MPFR_FLAGS_ERANGE	16
+#if MPFR_VERSION >= MPFR_VERSION_NUM(3,1,0)
+#define MPFR_FLAGS_DIVBY0	32
+#define MPFR_FLAGS_ALL		63
+#else
+#define MPFR_FLAGS_ALL		31	/* no divide-by-zero flag */
+#endif
+
+static unsigned _flags_save(void)
+{
+	return (mpfr_underflow_p() ? MPFR_FLAGS_UNDERFLOW : 0) |
+		(mpfr_overflow_p() ? MPFR_FLAGS_OVERFLOW : 0) |
+		(mpfr_nanflag_p() ? MPFR_FLAGS_NAN : 0) |
+		(mpfr_inexflag_p() ? MPFR_FLAGS_INEXACT : 0) |
+#ifdef MPFR_FLAGS_DIVBY0
+		(mpfr_divby0_p() ? MPFR_FLAGS_DIVBY0 : 0) |
+#endif
+		(mpfr_erangeflag_p() ? MPFR_FLAGS_ERANGE : 0);
+}
 
-static int fr_gc(lua_State *L)
+static void _flags_clear(unsigned mask)
 {
-	mpfr_ptr z;
+	if (mask & MPFR_FLAGS_UNDERFLOW)
+		mpfr_clear_underflow();
+	if (mask & MPFR_FLAGS_OVERFLOW)
+		mpfr_clear_overflow();
+	if (mask & MPFR_FLAGS_NAN)
+		mpfr_clear_nanflag();
+	if (mask & MPFR_FLAGS_INEXACT)
+		mpfr_clear_inexflag();
+	if (mask & MPFR_FLAGS_ERANGE)
+		mpfr_clear_erangeflag();
+#ifdef MPFR_FLAGS_DIVBY0
+	if (mask & MPFR_FLAGS_DIVBY0)
+		mpfr_clear_divby0();
+#endif
+}
 
-	z = luaL_checkudata(L, 1, MPFR);
-	mpfr_clear(z);
-	return 0;
+static void _flags_set(unsigned mask)
+{
+	if (mask & MPFR_FLAGS_UNDERFLOW)
+		mpfr_set_underflow();
+	if (mask & MPFR_FLAGS_OVERFLOW)
+		mpfr_set_overflow();
+	if (mask & MPFR_FLAGS_NAN)
+		mpfr_set_nanflag();
+	if (mask & MPFR_FLAGS_INEXACT)
+		mpfr_set_inexflag();
+	if (mask & MPFR_FLAGS_ERANGE)
+		mpfr_set_erangeflag();
+#ifdef MPFR_FLAGS_DIVBY0
+	if (mask & MPFR_FLAGS_DIVBY0)
+		mpfr_set_divby0();
+#endif
 }
+#endif
 
 
+/*
+ * Worker threads.  A job calls fn(arg, id) once on each of n threads,
+ * id 0 being the calling thread.  Workers are started on demand and
+ * then stay around, so the caches and constants MPFR keeps per thread
+ * (in a thread-safe build) survive from one job to the next, until the
+ * module's Lua state is closed.  Jobs run one at a time and must not
+ * touch the Lua state or start other jobs.  The MPFR flags the workers
+ * raise are raised again in the calling thread.
+ */
+#define MAX_THREADS 256
+
+static struct {
+	pthread_mutex_t run;	/* held for the whole job */
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	unsigned long seen[MAX_THREADS];	/* last job seen per worker */
+	pthread_t tid[MAX_THREADS];
+	int nthreads;		/* workers started, ids 1..nthreads */
+	int quit;		/* set to stop the workers */
+	unsigned flags;		/* MPFR flags raised by the workers */
+	unsigned long gen;	/* job number */
+	int active;		/* ids below this take part in the job */
+	int pending;		/* workers still running the job */
+	void (*fn)(void *, int);
+	void *arg;
+} _workers = {
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+};
 
-static lua_Integer _check_prec(lua_State *L, int i)
+static void *_worker_main(void *p)
 {
-	lua_Integer prec;
+	int id = (int) (intptr_t) p;
+	int tls = mpfr_buildopt_tls_p();
+	unsigned flags = 0;
+
+	pthread_mutex_lock(&_workers.lock);
+	for (;;) {
+		while (!_workers.quit && _workers.seen[id] == _workers.gen)
+			pthread_cond_wait(&_workers.start, &_workers.lock);
+		if (_workers.quit)
+			break;
+		_workers.seen[id] = _workers.gen;
+		if (id >= _workers.active)
+			continue;
+		pthread_mutex_unlock(&_workers.lock);
+		/* without TLS the flags are the caller's: leave them alone */
+		if (tls)
+			_flags_clear(MPFR_FLAGS_ALL);
+		(*_workers.fn)(_workers.arg, id);
+		if (tls)
+			flags = _flags_save();
+		pthread_mutex_lock(&_workers.lock);
+		_workers.flags |= flags;
+		if (--_workers.pending == 0)
+			pthread_cond_signal(&_workers.done);
+	}
+	pthread_mutex_unlock(&_workers.lock);
+	mpfr_free_cache();
+	return NULL;
+}
 
-	prec = luaL_checkinteger(L, i);
-	if (!(MPFR_PREC_MIN <= prec && prec <= MPFR_PREC_MAX))
-		luaL_argerror(L, i, lua_pushfstring(L,
-			"precision must be between %I and %I",
-			(lua_Integer) MPFR_PREC_MIN,
-			(lua_Integer) MPFR_PREC_MAX));
-	return prec;
+/* run a job on up to n threads; returns the number actually used */
+static int _workers_run(int n, void (*fn)(void *, int), void *arg)
+{
+	int id;
+
+	if (n > MAX_THREADS)
+		n = MAX_THREADS;
+	if (n <= 1) {
+		(*fn)(arg, 0);
+		return 1;
+	}
+	pthread_mutex_lock(&_workers.run);
+	pthread_mutex_lock(&_workers.lock);
+	while (_workers.nthreads < n - 1) {
+		id = _workers.nthreads + 1;
+		_workers.seen[id] = _workers.gen;
+		if (pthread_create(&_workers.tid[id], NULL, _worker_main,
+				(void *) (intptr_t) id) != 0)
+			break;
+		_workers.nthreads = id;
+	}
+	if (n > _workers.nthreads + 1)
+		n = _workers.nthreads + 1;
+	_workers.fn = fn;
+	_workers.arg = arg;
+	_workers.active = n;
+	_workers.pending = n - 1;
+	_workers.flags = 0;
+	_workers.gen++;
+	pthread_cond_broadcast(&_workers.start);
+	pthread_mutex_unlock(&_workers.lock);
+
+	(*fn)(arg, 0);
+
+	pthread_mutex_lock(&_workers.lock);
+	while (_workers.pending)
+		pthread_cond_wait(&_workers.done, &_workers.lock);
+	_flags_set(_workers.flags);
+	pthread_mutex_unlock(&_workers.lock);
+	pthread_mutex_unlock(&_workers.run);
+	return n;
 }
 
-/* new([prec]) : mpfr_t */
-static int fr_new(lua_State *L)
+/* __gc of a sentinel kept in the registry: stop and join the workers
+ * before the Lua state unloads this library; they start again if
+ * another state needs them
+ */
+static int _workers_gc(lua_State *L)
 {
-	mpfr_ptr z;
-	lua_Integer prec = 0;
+	int id;
+
+	pthread_mutex_lock(&_workers.run);
+	pthread_mutex_lock(&_workers.lock);
+	_workers.quit = 1;
+	pthread_cond_broadcast(&_workers.start);
+	pthread_mutex_unlock(&_workers.lock);
+	for (id = 1; id <= _workers.nthreads; id++)
+		pthread_join(_workers.tid[id], NULL);
+	_workers.nthreads = 0;
+	_workers.quit = 0;
+	pthread_mutex_unlock(&_workers.run);
+	return 0;
+}
 
-	if (!lua_isnoneornil(L, 1))
-		prec = _check_prec(L, 1);
+/* opts.threads of the table at index i, else the number of cores */
+static int _opt_nthreads(lua_State *L, int i)
+{
+	lua_Integer n = 0;
+	int isint;
 
-	z = lua_newuserdata(L, sizeof (*z));
-	if (prec)
-		mpfr_init2(z, _check_prec(L, 1));
-	else
-		mpfr_init(z);
-	luaL_setmetatable(L, MPFR);
-	return 1;
+	if (!lua_isnoneornil(L, i)) {
+		luaL_checktype(L, i, LUA_TTABLE);
+		if (lua_getfield(L, i, "threads") != LUA_TNIL) {
+			n = lua_tointegerx(L, -1, &isint);
+			luaL_argcheck(L, isint && n >= 1, i,
+				"threads must be a positive integer");
+		}
+		lua_pop(L, 1);
+	}
+	if (!n)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1)
+		n = 1;
+	return n > MAX_THREADS ? MAX_THREADS : n;
 }
 
-#define V_LONG 0
-#define V_DOUBLE 1
-#define V_MPFR 2
+/* the same, for jobs that call MPFR */
+static int _opt_threads(lua_State *L, int i)
+{
+	int n = _opt_nthreads(L, i);
 
-union value {
-	long i;
-	double d;
-	mpfr_ptr fr;
-};
+	/* MPFR keeps flags and caches in globals unless built with TLS */
+	return mpfr_buildopt_tls_p() ? n : 1;
+}
 
-static int _check_value(lua_State *L, int i, union value *v)
+/* integer option k of the table at index i, at least min; n if absent */
+static lua_Integer _opt_field(lua_State *L, int i, const char *k,
+	lua_Integer n, lua_Integer min)
 {
-	lua_Integer x;
 	int isint;
 
-	if (lua_isnumber(L, i)) {
-		x = lua_tointegerx(L, i, &isint);
-		if (isint && (v->i = x) == x)
-			return V_LONG;
-		v->d = lua_tonumber(L, i);
-		return V_DOUBLE;
+	if (lua_getfield(L, i, k) != LUA_TNIL) {
+		n = lua_tointegerx(L, -1, &isint);
+		if (!isint || n < min)
+			luaL_argerror(L, i, lua_pushfstring(L,
+				"%s must be an integer >= %I", k, min));
 	}
-	v->fr = luaL_checkudata(L, i, MPFR);
-	return V_MPFR;
+	lua_pop(L, 1);
+	return n;
 }
 
-/* set(self, number, [rnd])
- * set(self, string, [base], [rnd])
+static void _job_free_cache(void *arg, int id)
+{
+	mpfr_free_cache();
+}
+
+
+/*
+ * Radix conversion done here rather than by mpfr_get_str, so that the
+ * digits can be produced piecewise: the value is first rounded to an
+ * n-digit integer M with integer arithmetic, then M is split by powers
+ * of the base, high part first.  Digits come out in order, long before
+ * the whole number is converted, and never all at once.
  */
-static int fr_set(lua_State *L)
+#define DIGITS_LEAF	2048	/* convert blocks this small directly */
+
+/* number of digits tostring prints when not told */
+static size_t _ndigits(int b, mpfr_prec_t prec)
 {
-	mpfr_ptr z;
-	union value v;
-	mpfr_rnd_t r;
+#if MPFR_VERSION >= MPFR_VERSION_NUM(4,1,0)
+	return mpfr_get_str_ndigits(b, prec);
+#else
+	return ceil(prec * log(2.0) / log(b)) + 1;
+#endif
+}
 
-	z = luaL_checkudata(L, 1, MPFR);
-	if (lua_isstring(L, 2)) {
-		r = _opt_rnd(L, 4);
-		if (mpfr_set_str(z, lua_tostring(L, 2),
-				_opt_base(L, 3), r) != 0)
-			luaL_argerror(L, 2,
-				"not a valid number in given base");
-	} else {
-		r = _opt_rnd(L, 3);
-		switch (_check_value(L, 2, &v)) {
-		case V_LONG:
-			mpfr_set_si(z, v.i, r);
+/* q = num / den rounded to an integer in direction r (num, den > 0) */
+static void _z_div_round(mpz_t q, mpz_t num, mpz_t den, mpfr_rnd_t r)
+{
+	mpz_t rem;
+	int c;
+
+	mpz_init(rem);
+	mpz_fdiv_qr(q, rem, num, den);
+	if (mpz_sgn(rem)) {
+		switch (r) {
+		case MPFR_RNDZ:
+		case MPFR_RNDD:
 			break;
-		case V_DOUBLE:
-			mpfr_set_d(z, v.d, r);
+		case MPFR_RNDA:
+		case MPFR_RNDU:
+			mpz_add_ui(q, q, 1);
 			break;
-		case V_MPFR:
-			mpfr_set(z, v.fr, r);
+		default:
+			mpz_mul_2exp(rem, rem, 1);
+			c = mpz_cmp(rem, den);
+			if (c > 0 || (c == 0 && mpz_odd_p(q)))
+				mpz_add_ui(q, q, 1);
 			break;
 		}
 	}
-	lua_settop(L, 1);
-	return 1;
+	mpz_clear(rem);
 }
 
-static int fr_set_nan(lua_State *L)
+/* q = num / 2^s rounded like _z_div_round */
+static void _z_shr_round(mpz_t q, mpz_t num, mp_bitcnt_t s, mpfr_rnd_t r)
 {
-	mpfr_set_nan(luaL_checkudata(L, 1, MPFR));
-	lua_settop(L, 1);
-	return 1;
+	mp_bitcnt_t low = mpz_scan1(num, 0);	/* lowest bit set */
+	int half = s && mpz_tstbit(num, s - 1);
+
+	mpz_fdiv_q_2exp(q, num, s);
+	if (low >= s)
+		return;		/* exact */
+	switch (r) {
+	case MPFR_RNDZ:
+	case MPFR_RNDD:
+		break;
+	case MPFR_RNDA:
+	case MPFR_RNDU:
+		mpz_add_ui(q, q, 1);
+		break;
+	default:
+		if (half && (low < s - 1 || mpz_odd_p(q)))
+			mpz_add_ui(q, q, 1);
+		break;
+	}
 }
 
-static int fr_set_inf(lua_State *L)
+/*
+ * M = |z| * b^k rounded to an integer from p bits, as mpfr_get_str
+ * does: returns 0 if two tries cannot tell the rounding, for an exact
+ * computation to settle.  Runs in the widest exponent range, and keeps
+ * the flags.
+ */
+static int _digits_approx(mpz_t M, mpfr_srcptr z, int b, mpfr_exp_t k,
+	mpfr_prec_t p, mpfr_rnd_t r)
 {
-	mpfr_set_inf(luaL_checkudata(L, 1, MPFR), luaL_optinteger(L, 2, 0));
-	lua_settop(L, 1);
-	return 1;
+	mpfr_exp_t emin, emax;
+	unsigned flags;
+	mpfr_t t, u;
+	int tries, tu, tt, ok = 0;
+
+	flags = _flags_save();
+	emin = mpfr_get_emin();
+	emax = mpfr_get_emax();
+	mpfr_set_emin(mpfr_get_emin_min());
+	mpfr_set_emax(mpfr_get_emax_max());
+	for (tries = 0; tries < 2 && !ok; tries++, p *= 2) {
+		mpfr_inits2(p, t, u, (mpfr_ptr) 0);
+		mpfr_set_ui(u, b, MPFR_RNDN);
+		tu = mpfr_pow_si(u, u, k, MPFR_RNDN);
+		tt = mpfr_mul(t, z, u, MPFR_RNDN);
+		mpfr_abs(t, t, MPFR_RNDN);
+		/* two roundings: within 2 ulps; integers need EXP(t) bits */
+		if (mpfr_regular_p(t) && mpfr_get_exp(t) >= 1 &&
+				((!tu && !tt) || mpfr_can_round(t, p - 2,
+				MPFR_RNDN, MPFR_RNDZ,
+				mpfr_get_exp(t) + (r == MPFR_RNDN)))) {
+			mpfr_get_z(M, t, r);
+			ok = 1;
+		}
+		mpfr_clears(t, u, (mpfr_ptr) 0);
+	}
+	mpfr_set_emin(emin);
+	mpfr_set_emax(emax);
+	_flags_clear(MPFR_FLAGS_ALL);
+	_flags_set(flags);
+	return ok;
 }
 
-static int fr_set_zero(lua_State *L)
+/*
+ * M = |z| * b^(n-e) rounded to n digits, with e chosen so that M has
+ * exactly n digits: z is about 0.[M] * b^e, as from mpfr_get_str.
+ * z must be a regular number.  When b^(n-e) or the binary exponent of z
+ * is much longer than n digits, M comes from _digits_approx, so the
+ * cost does not grow with the exponent.
+ */
+static void _digits_round(mpz_t M, mpfr_exp_t *e, mpfr_srcptr z, int b,
+	size_t n, mpfr_rnd_t r)
 {
-	mpfr_set_zero(luaL_checkudata(L, 1, MPFR), luaL_optinteger(L, 2, 0));
-	lua_settop(L, 1);
-	return 1;
+	mpz_t m, num, den, lo, hi;
+	mpfr_exp_t f, k;
+	mpfr_prec_t p;
+	double lb = log2(b);
+
+	/* round the magnitude */
+	if (mpfr_signbit(z)) {
+		if (r == MPFR_RNDU)
+			r = MPFR_RNDZ;
+		else if (r == MPFR_RNDD)
+			r = MPFR_RNDA;
+	}
+	mpz_inits(m, num, den, lo, hi, NULL);
+	f = mpfr_get_z_2exp(m, z);
+	mpz_abs(m, m);
+	mpz_ui_pow_ui(lo, b, n - 1);
+	mpz_mul_ui(hi, lo, b);
+	*e = floor((mpfr_get_exp(z) - 1) * log(2.0) / log(b)) + 1;
+	p = n * lb + 64;
+	for (;;) {
+		k = n - *e;
+		if ((k < 0 ? -k : k) * lb + (f < 0 ? -f : f) > 2 * p &&
+				_digits_approx(M, z, b, k, p, r))
+			;
+		else if (k >= 0) {
+			mpz_ui_pow_ui(num, b, k);
+			mpz_mul(num, num, m);
+			if (f >= 0)
+				mpz_mul_2exp(M, num, f);
+			else	/* the usual case: only a shift */
+				_z_shr_round(M, num, -f, r);
+		} else {
+			mpz_ui_pow_ui(den, b, -k);
+			if (f >= 0)
+				mpz_mul_2exp(num, m, f);
+			else {
+				mpz_set(num, m);
+				mpz_mul_2exp(den, den, -f);
+			}
+			_z_div_round(M, num, den, r);
+		}
+
+		if (mpz_cmp(M, hi) >= 0) {
+			++*e;
+			continue;
+		}
+		if (mpz_cmp(M, lo) < 0) {
+			--*e;
+			continue;
+		}
+		break;
+	}
+	mpz_clears(m, num, den, lo, hi, NULL);
 }
 
+/*
+ * powers of the base used to split, computed once per conversion.  The
+ * pieces of one level of a split of n digits have floor(n/2^d) or
+ * ceil(n/2^d) digits, so each level asks for at most two powers.
+ */
+#define POW_CACHE	(2 * CHAR_BIT * sizeof (size_t))
 
-/* -> fr */
-static int fr_fn0(lua_State *L)
+struct pow_cache {
+	int b;
+	int n;
+	size_t exp[POW_CACHE];
+	mpz_t pow[POW_CACHE];
+};
+
+static mpz_srcptr _pow_get(struct pow_cache *c, size_t k)
 {
-	int (*fn)(mpfr_ptr, mpfr_rnd_t);
+	int i;
+
+	for (i = 0; i < c->n; i++)
+		if (c->exp[i] == k)
+			return c->pow[i];
+	mpz_init(c->pow[i]);
+	mpz_ui_pow_ui(c->pow[i], c->b, k);
+	c->exp[i] = k;
+	c->n++;
+	return c->pow[i];
+}
 
-	fn = lua_touserdata(L, lua_upvalueindex(1));
-	(*fn)(luaL_checkudata(L, 1, MPFR), _opt_rnd(L, 2));
-	lua_settop(L, 1);
-	return 1;
+static void _pow_clear(struct pow_cache *c)
+{
+	while (c->n)
+		mpz_clear(c->pow[--c->n]);
 }
 
-struct fn0_reg {
-	const char *name;
-	int (*fn)(mpfr_ptr, mpfr_rnd_t);
-};
+/*
+ * Parallel conversion of big blocks.  M is split level by level into
+ * the same pieces _dw_convert would make, the divisions of each level
+ * shared among worker threads, and then all pieces are printed side by
+ * side.  Only the first few levels have fewer pieces than threads.
+ * Nothing here touches MPFR, so this works without a TLS build.
+ */
+#define DIGITS_PAR	100000	/* default threshold, in digits */
+#define DIGITS_BLOCK	(1 << 22)	/* most digits held by write_digits */
+#define CONV_PIECES	256
 
-#define FN_(lname, cname) {lname, cname}
-#define FN(name) FN_(#name, mpfr_##name)
+static struct {
+	int threads;		/* 0 for all cores */
+	size_t threshold;	/* fewer digits stay on one thread */
+} _conv = {0, DIGITS_PAR};
 
-static const struct fn0_reg _fn0_reg[] = {
-	FN(const_log2),
-	FN(const_pi),
-	FN(const_euler),
-	FN(const_catalan),
-	{0, 0}
+/* piece i is split into 2i (high digits) and 2i+1 (low digits) */
+struct conv_job {
+	int b;
+	int leaf;
+	size_t next, end;	/* pieces left to do in this step */
+	pthread_mutex_t lock;
+	char *out;
+	mpz_t piece[2 * CONV_PIECES];
+	size_t len[2 * CONV_PIECES], off[2 * CONV_PIECES];
+	mpz_srcptr pow[CONV_PIECES];
 };
 
-static void _reg_fn0(lua_State *L, const struct fn0_reg *r)
+static void _job_conv(void *arg, int id)
 {
-	for (; r->name; r++) {
-		lua_pushlightuserdata(L, r->fn);
-		lua_pushcclosure(L, fr_fn0, 1);
-		lua_setfield(L, -2, r->name);
+	struct conv_job *j = arg;
+	void (*freefunc)(void *, size_t);
+	char *s, *p;
+	size_t i, n;
+
+	mp_get_memory_functions(NULL, NULL, &freefunc);
+	for (;;) {
+		pthread_mutex_lock(&j->lock);
+		i = j->next;
+		if (i < j->end)
+			j->next++;
+		pthread_mutex_unlock(&j->lock);
+		if (i >= j->end)
+			break;
+		if (j->leaf) {
+			s = mpz_get_str(NULL, j->b, j->piece[i]);
+			n = strlen(s);
+			p = j->out + j->off[i];
+			memset(p, '0', j->len[i] - n);
+			memcpy(p + j->len[i] - n, s, n);
+			(*freefunc)(s, n + 1);
+		} else {
+			mpz_inits(j->piece[2 * i], j->piece[2 * i + 1], NULL);
+			mpz_tdiv_qr(j->piece[2 * i], j->piece[2 * i + 1],
+				j->piece[i], j->pow[i]);
+		}
+		mpz_clear(j->piece[i]);
 	}
 }
 
-
-/* fr -> fr */
-static int fr_fn1(lua_State *L)
+static int _conv_threads(void)
 {
-	int (*fn)(mpfr_ptr, mpfr_srcptr, mpfr_rnd_t);
+	long n = _conv.threads;
 
-	fn = lua_touserdata(L, lua_upvalueindex(1));
-	(*fn)(luaL_checkudata(L, 1, MPFR), luaL_checkudata(L, 2, MPFR),
-		_opt_rnd(L, 3));
-	lua_settop(L, 1);
-	return 1;
+	if (!n)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1)
+		n = 1;
+	return n > MAX_THREADS ? MAX_THREADS : n;
 }
 
-struct fn1_reg {
-	const char *name;
-	int (*fn)(mpfr_ptr, mpfr_srcptr, mpfr_rnd_t);
+/* write M as exactly n digits to out, using up to nthreads threads */
+static void _digits_par(char *out, mpz_t M, size_t n, struct pow_cache *pc,
+	int nthreads)
+{
+	struct conv_job j;
+	size_t k, i;
+
+	k = 1;
+	while (k < CONV_PIECES && k < 4 * (size_t) nthreads &&
+			n / (2 * k) >= DIGITS_LEAF)
+		k *= 2;
+	j.b = pc->b;
+	j.out = out;
+	pthread_mutex_init(&j.lock, NULL);
+	mpz_init_set(j.piece[1], M);
+	j.len[1] = n;
+	j.off[1] = 0;
+	j.leaf = 0;
+	for (j.next = 1; j.next < k; j.next = j.end) {
+		j.end = 2 * j.next;
+		for (i = j.next; i < j.end; i++) {
+			j.len[2 * i] = j.len[i] - j.len[i] / 2;
+			j.len[2 * i + 1] = j.len[i] / 2;
+			j.off[2 * i] = j.off[i];
+			j.off[2 * i + 1] = j.off[i] + j.len[2 * i];
+			j.pow[i] = _pow_get(pc, j.len[i] / 2);
+		}
+		i = j.end - j.next;
+		_workers_run(i < nthreads ? i : nthreads, _job_conv, &j);
+	}
+	j.leaf = 1;
+	j.end = 2 * k;
+	_workers_run(k < nthreads ? k : nthreads, _job_conv, &j);
+	pthread_mutex_destroy(&j.lock);
+}
+
+/*
+ * buffered output of write_digits, to a FILE or a Lua callback.  A
+ * failure sets err; a callback's error message is left on the stack.
+ */
+struct digit_writer {
+	lua_State *L;
+	int fn;		/* stack index of the callback, if f is NULL */
+	FILE *f;
+	char *buf;
+	size_t len, size;
+	int point;	/* decimal point still to be written */
+	int err;
+	char *leaf;	/* DIGITS_LEAF + 2 bytes for mpz_get_str */
+	char *block;	/* for _digits_par, or NULL */
+	int threads;
+	struct pow_cache pc;
 };
 
-static const struct fn1_reg _fn1_reg[] = {
-	FN(sqr),
-	FN(rec_sqrt),
-	FN(cbrt),
-	FN(abs),
-	FN(neg),
-	FN(log),
+/*
+ * callback(chunk), run protected: making the string can raise too, and
+ * the digits being converted are not collectable.
+ */
+static int _dw_call(lua_State *L)
+{
+	struct digit_writer *w = lua_touserdata(L, 2);
+
+	lua_pushlstring(L, w->buf, w->len);
+	lua_replace(L, 2);
+	lua_call(L, 1, 0);
+	return 0;
+}
+
+static void _dw_flush(struct digit_writer *w)
+{
+	if (!w->len || w->err)
+		return;
+	if (w->f) {
+		if (fwrite(w->buf, 1, w->len, w->f) != w->len)
+			w->err = 1;
+	} else {
+		/* none of these allocate */
+		lua_pushcfunction(w->L, _dw_call);
+		lua_pushvalue(w->L, w->fn);
+		lua_pushlightuserdata(w->L, w);
+		if (lua_pcall(w->L, 2, 0, 0) != LUA_OK)
+			w->err = 1;
+	}
+	w->len = 0;
+}
+
+static void _dw_write(struct digit_writer *w, const char *s, size_t n)
+{
+	size_t k;
+
+	while (n && !w->err) {
+		k = w->size - w->len;
+		if (k > n)
+			k = n;
+		memcpy(w->buf + w->len, s, k);
+		w->len += k;
+		s += k;
+		n -= k;
+		if (w->len == w->size)
+			_dw_flush(w);
+	}
+}
+
+static void _dw_digits(struct digit_writer *w, const char *s, size_t n)
+{
+	if (w->point && n) {
+		_dw_write(w, s, 1);
+		_dw_write(w, ".", 1);
+		s++;
+		n--;
+		w->point = 0;
+	}
+	_dw_write(w, s, n);
+}
+
+/* write M as exactly n digits, leading zeros included */
+static void _dw_convert(struct digit_writer *w, mpz_t M, size_t n)
+{
+	mpz_t q, r;
+	size_t lo, len;
+
+	if (w->err)
+		return;
+	if (w->block && n <= DIGITS_BLOCK && n >= _conv.threshold) {
+		_digits_par(w->block, M, n, &w->pc, w->threads);
+		_dw_digits(w, w->block, n);
+		return;
+	}
+	if (n <= DIGITS_LEAF) {
+		mpz_get_str(w->leaf, w->pc.b, M);
+		len = strlen(w->leaf);
+		while (len < n) {
+			_dw_digits(w, "0", 1);
+			n--;
+		}
+		_dw_digits(w, w->leaf, len);
+		return;
+	}
+	lo = n / 2;
+	mpz_inits(q, r, NULL);
+	mpz_tdiv_qr(q, r, M, _pow_get(&w->pc, lo));
+	_dw_convert(w, q, n - lo);
+	mpz_clear(q);
+	_dw_convert(w, r, lo);
+	mpz_clear(r);
+}
+
+/* tostring(self, [base], [n], [rnd]) */
+static int fr_tostring(lua_State *L)
+{
+	luaL_Buffer B;
+	char *s, *p;
+	mpfr_exp_t e;
+	int b;
+	size_t n, nd;
+	mpfr_ptr z;
+	mpfr_rnd_t r;
+	size_t sz, len;
+	int nthreads;
+	struct pow_cache pc;
+	mpz_t M;
+
+	z = _check_fr(L, 1);
+
+	b = _opt_base(L, 2);
+	n = luaL_optinteger(L, 3, 0);
+	r = _opt_rnd(L, 4);
+
+	/* special cases */
+	if (!mpfr_number_p(z)) {
+		char buf[7];
+		mpfr_get_str(buf, &e, b, n, z, r);
+		lua_pushstring(L, buf);
+		return 1;
+	} else if (mpfr_zero_p(z)) {
+		lua_pushstring(L, mpfr_signbit(z) ? "-0" : "0");
+		return 1;
+	}
+
+	nd = n ? n : _ndigits(b, mpfr_get_prec(z));
+	nthreads = _conv_threads();
+	if (nthreads > 1 && nd >= _conv.threshold) {
+		/* same digits, split among threads */
+		s = luaL_buffinitsize(L, &B, nd + 2);
+		p = s;
+		if (mpfr_signbit(z))
+			*p++ = '-';
+		mpz_init(M);
+		_digits_round(M, &e, z, b, nd, r);
+		pc.b = b;
+		pc.n = 0;
+		_digits_par(p + 1, M, nd, &pc, nthreads);
+		_pow_clear(&pc);
+		mpz_clear(M);
+		p[0] = p[1];
+		p[1] = '.';
+		luaL_addsize(&B, p - s + nd + 1);
+	} else {
+		sz = _outbufsize(z, b, n) + 1; /* +1 for the decimal point */
+		s = luaL_buffinitsize(L, &B, sz);
+		p = s + 1;
+		mpfr_get_str(p, &e, b, n, z, r);
+
+		len = strlen(p); /* actual length from mpfr_get_str */
+		if (*p == '-')
+			*s++ = *p++; /* skip minus sign */
+
+		/* insert decimal point */
+		s[0] = *p;
+		s[1] = '.';
+		luaL_addsize(&B, len + 1);
+	}
+
+	if (--e) { /* append exponent */
+		luaL_addchar(&B, (b > 10) ? '@' : 'e');
+		lua_pushinteger(L, e);
+		luaL_addvalue(&B);
+	}
+
+	luaL_pushresult(&B);
+	return 1;
+}
+
+/* write_digits(self, file|function, [base], [n], [rnd], [{chunk=...}]) */
+static int fr_write_digits(lua_State *L)
+{
+	struct digit_writer w;
+	luaL_Stream *stream;
+	mpfr_ptr z;
+	mpfr_exp_t e;
+	mpz_t M;
+	int b;
+	size_t n;
+	mpfr_rnd_t r;
+	lua_Integer chunk = 65536;
+	char buf[32];
+
+	z = _check_fr(L, 1);
+	b = _opt_base(L, 3);
+	n = luaL_optinteger(L, 4, 0);
+	r = _opt_rnd(L, 5);
+	if (!lua_isnoneornil(L, 6)) {
+		luaL_checktype(L, 6, LUA_TTABLE);
+		lua_getfield(L, 6, "chunk");
+		chunk = luaL_optinteger(L, -1, chunk);
+		luaL_argcheck(L, chunk > 0, 6, "chunk must be positive");
+		lua_pop(L, 1);
+	}
+	w.L = L;
+	w.fn = 2;
+	w.f = NULL;
+	stream = luaL_testudata(L, 2, LUA_FILEHANDLE);
+	if (stream) {
+		luaL_argcheck(L, stream->closef, 2, "attempt to use a closed file");
+		w.f = stream->f;
+	} else {
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+	}
+	lua_settop(L, 6);
+	w.size = chunk;
+	w.buf = lua_newuserdata(L, w.size);
+	w.leaf = lua_newuserdata(L, DIGITS_LEAF + 2);
+	w.len = 0;
+	w.point = 0;
+	w.err = 0;
+	w.block = NULL;
+	w.threads = _conv_threads();
+	w.pc.b = b;
+	w.pc.n = 0;
+
+	if (!mpfr_regular_p(z)) {
+		if (mpfr_zero_p(z)) {
+			strcpy(buf, mpfr_signbit(z) ? "-0" : "0");
+		} else {
+			mpfr_get_str(buf, &e, b, 0, z, r);
+		}
+		_dw_write(&w, buf, strlen(buf));
+	} else {
+		if (!n)
+			n = _ndigits(b, mpfr_get_prec(z));
+		if (w.threads > 1 && n >= _conv.threshold)
+			w.block = lua_newuserdata(L,
+				n < DIGITS_BLOCK ? n : DIGITS_BLOCK);
+		mpz_init(M);
+		_digits_round(M, &e, z, b, n, r);
+		if (mpfr_signbit(z))
+			_dw_write(&w, "-", 1);
+		w.point = 1;
+		_dw_convert(&w, M, n);
+		mpz_clear(M);
+		_pow_clear(&w.pc);
+		if (--e) {	/* append exponent */
+			sprintf(buf, "%c%ld", (b > 10) ? '@' : 'e', (long) e);
+			_dw_write(&w, buf, strlen(buf));
+		}
+	}
+	_dw_flush(&w);
+	if (w.err) {
+		if (!w.f)
+			return lua_error(L);
+		return luaL_fileresult(L, 0, NULL);
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+
+
+/* conv_config{[threads], [threshold]} : for tostring and write_digits */
+static int fr_conv_config(lua_State *L)
+{
+	lua_Integer n;
+	int isint;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	if (lua_getfield(L, 1, "threads") != LUA_TNIL) {
+		n = lua_tointegerx(L, -1, &isint);
+		luaL_argcheck(L, isint && n >= 0, 1,
+			"threads must be a non-negative integer");
+		_conv.threads = n > MAX_THREADS ? MAX_THREADS : n;
+	}
+	if (lua_getfield(L, 1, "threshold") != LUA_TNIL) {
+		n = lua_tointegerx(L, -1, &isint);
+		luaL_argcheck(L, isint && n >= 0, 1,
+			"threshold must be a non-negative integer");
+		_conv.threshold = n;
+	}
+	return 0;
+}
+
+
+/*
+ * tohex and tobin: the significand's bits, 4 or 1 to a digit, after a
+ * leading 1 as in C's %a, and a binary exponent.  set() reads them back
+ * exactly with base "hex" or "bin".
+ */
+static int _tobits(lua_State *L, int shift, const char *prefix)
+{
+	static const char digits[] = "0123456789abcdef";
+	const mp_limb_t *d;
+	luaL_Buffer B;
+	mpfr_ptr z;
+	mpfr_prec_t prec, i, j, nl;
+	size_t len;
+	char *s, *p;
+	int c;
+
+	z = _check_fr(L, 1);
+	if (!mpfr_regular_p(z)) {
+		if (mpfr_nan_p(z))
+			lua_pushliteral(L, "@NaN@");
+		else if (mpfr_inf_p(z))
+			lua_pushstring(L, mpfr_signbit(z) ? "-@Inf@" : "@Inf@");
+		else
+			lua_pushfstring(L, "%s%s0p+0", mpfr_signbit(z) ? "-" :
+				"", prefix);
+		return 1;
+	}
+	prec = mpfr_get_prec(z);
+	d = mpfr_custom_get_significand(z);
+	nl = mpfr_custom_get_size(prec) / sizeof (mp_limb_t);
+	len = 4 + (prec - 1 + shift - 1) / shift + 4 + 3 * sizeof (long);
+	s = p = luaL_buffinitsize(L, &B, len);
+	if (mpfr_signbit(z))
+		*p++ = '-';
+	p += sprintf(p, "%s1.", prefix);
+	/* bit i counts from the top of d, which is the leading 1 */
+	for (i = 1; i < prec; i += shift) {
+		for (c = 0, j = i; j < i + shift; j++) {
+			c <<= 1;
+			if (j < prec)
+				c |= (d[nl - 1 - j / mp_bits_per_limb] >>
+					(mp_bits_per_limb - 1 -
+					j % mp_bits_per_limb)) & 1;
+		}
+		*p++ = digits[c];
+	}
+	while (p[-1] == '0')
+		p--;
+	if (p[-1] == '.')
+		p--;
+	p += sprintf(p, "p%+ld", (long) (mpfr_get_exp(z) - 1));
+	luaL_pushresultsize(&B, p - s);
+	return 1;
+}
+
+/* tohex(self) : string */
+static int fr_tohex(lua_State *L)
+{
+	return _tobits(L, 4, "0x");
+}
+
+/* tobin(self) : string */
+static int fr_tobin(lua_State *L)
+{
+	return _tobits(L, 1, "0b");
+}
+
+/* tonumber(self, [rnd]) */
+static int fr_tonumber(lua_State *L)
+{
+	mpfr_ptr z;
+	mpfr_rnd_t r;
+
+	z = _check_fr(L, 1);
+	r = _opt_rnd(L, 2);
+	if (sizeof (long) <= sizeof (lua_Integer) &&
+			mpfr_integer_p(z) && mpfr_fits_slong_p(z, r))
+		lua_pushinteger(L, mpfr_get_si(z, r));
+	else
+		lua_pushnumber(L, mpfr_get_d(z, r));
+	return 1;
+}
+
+
+/*
+ * Values use MPFR's custom interface: the limbs are stored right after
+ * the header in the same userdata, so creating a value takes a single
+ * Lua allocation and needs no finalizer.  If set_prec asks for more
+ * than the inline space can hold, the limbs move to a plain userdata
+ * anchored in the value's user value, which Lua collects along with it.
+ *
+ * mpfr_set_prec, mpfr_clear and growing mpfr_prec_round must never be
+ * called on such values.
+ */
+struct fr {
+	__mpfr_struct z;	/* must come first */
+	mpfr_prec_t cap;	/* precision the current limbs can hold */
+};
+
+static void _fr_init(mpfr_ptr z, mpfr_prec_t prec, void *limbs)
+{
+	mpfr_custom_init(limbs, prec);
+	mpfr_custom_init_set(z, MPFR_NAN_KIND, 0, prec, limbs);
+}
+
+/* push a new NaN of precision prec, without a metatable */
+static mpfr_ptr _fr_new(lua_State *L, mpfr_prec_t prec)
+{
+	struct fr *x;
+	size_t sz;
+
+	sz = mpfr_custom_get_size(prec);
+	x = lua_newuserdata(L, sizeof (*x) + sz);
+	x->cap = sz * CHAR_BIT;
+	_fr_init(&x->z, prec, x + 1);
+	return &x->z;
+}
+
+static mpfr_ptr _fr_push(lua_State *L, mpfr_prec_t prec)
+{
+	mpfr_ptr z;
+
+	z = _fr_new(L, prec);
+	lua_pushvalue(L, UV_MPFR);
+	lua_setmetatable(L, -2);
+	return z;
+}
+
+/* set the precision of z (at stack index i) to prec, making it NaN */
+static void _fr_resize(lua_State *L, int i, mpfr_ptr z, mpfr_prec_t prec)
+{
+	struct fr *x = (struct fr *) z;
+	void *limbs;
+
+	if (prec <= x->cap) {
+		limbs = mpfr_custom_get_significand(z);
+	} else {
+		size_t sz = mpfr_custom_get_size(prec);
+
+		limbs = lua_newuserdata(L, sz);
+		lua_setuservalue(L, i);
+		x->cap = sz * CHAR_BIT;
+	}
+	_fr_init(z, prec, limbs);
+}
+
+/*
+ * Temporaries used inside the bindings draw their limbs from a pool of
+ * free lists, one per significand size, so that a loop doing the same
+ * operation at the same precision doesn't malloc and free every time.
+ * Lua values don't go through here: they already carry their limbs.
+ * The pool is shared by all Lua states (and threads) of the process.
+ */
+#define POOL_NBUCKET 32
+
+struct pool_bucket {
+	size_t size;	/* bytes per buffer, 0 if the bucket is unused */
+	size_t count;	/* buffers on the free list */
+	void *head;	/* free list, linked through the first word */
+};
+
+static struct {
+	pthread_mutex_t lock;	/* held for any of the below */
+	struct pool_bucket b[POOL_NBUCKET];
+	size_t bytes;		/* bytes held by all free lists */
+	size_t max_bytes;
+	size_t max_per_prec;
+	size_t hits, misses;
+} _pool = {PTHREAD_MUTEX_INITIALIZER, {{0, 0, 0}}, 0, 1 << 24, 16, 0, 0};
+
+static struct pool_bucket *_pool_bucket(size_t sz)
+{
+	struct pool_bucket *b, *unused = NULL;
+
+	for (b = _pool.b; b < _pool.b + POOL_NBUCKET; b++) {
+		if (b->size == sz)
+			return b;
+		if (!b->size && !unused)
+			unused = b;
+	}
+	if (unused)
+		unused->size = sz;
+	return unused;
+}
+
+/* initialize t as a NaN of precision prec with pooled limbs */
+static void _pool_get(lua_State *L, mpfr_ptr t, mpfr_prec_t prec)
+{
+	struct pool_bucket *b;
+	size_t sz;
+	void *p;
+
+	sz = mpfr_custom_get_size(prec);
+	pthread_mutex_lock(&_pool.lock);
+	b = _pool_bucket(sz);
+	p = b ? b->head : NULL;
+	if (p) {
+		b->head = *(void **) p;
+		b->count--;
+		_pool.bytes -= sz;
+		_pool.hits++;
+	} else {
+		_pool.misses++;
+	}
+	pthread_mutex_unlock(&_pool.lock);
+	if (!p) {
+		p = malloc(sz);
+		if (!p)
+			luaL_error(L, "not enough memory");
+	}
+	_fr_init(t, prec, p);
+}
+
+/* give the limbs of t back; t must not have changed precision */
+static void _pool_put(mpfr_ptr t)
+{
+	struct pool_bucket *b;
+	size_t sz;
+	void *p;
+
+	sz = mpfr_custom_get_size(mpfr_get_prec(t));
+	p = mpfr_custom_get_significand(t);
+	pthread_mutex_lock(&_pool.lock);
+	b = _pool_bucket(sz);
+	if (b && b->count < _pool.max_per_prec &&
+			_pool.bytes + sz <= _pool.max_bytes) {
+		*(void **) p = b->head;
+		b->head = p;
+		b->count++;
+		_pool.bytes += sz;
+		p = NULL;
+	}
+	pthread_mutex_unlock(&_pool.lock);
+	free(p);
+}
+
+/* with the lock held */
+static void _pool_drain(void)
+{
+	struct pool_bucket *b;
+	void *p;
+
+	for (b = _pool.b; b < _pool.b + POOL_NBUCKET; b++) {
+		while ((p = b->head) != NULL) {
+			b->head = *(void **) p;
+			free(p);
+		}
+		b->size = b->count = 0;
+	}
+	_pool.bytes = 0;
+}
+
+/* pool_config{[max_bytes], [max_per_prec]} */
+static int fr_pool_config(lua_State *L)
+{
+	lua_Integer n;
+	int isint;
+
+	lua_Integer max_bytes, max_per_prec;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	max_bytes = max_per_prec = -1;
+	if (lua_getfield(L, 1, "max_bytes") != LUA_TNIL) {
+		n = lua_tointegerx(L, -1, &isint);
+		luaL_argcheck(L, isint && n >= 0, 1,
+			"max_bytes must be a non-negative integer");
+		max_bytes = n;
+	}
+	if (lua_getfield(L, 1, "max_per_prec") != LUA_TNIL) {
+		n = lua_tointegerx(L, -1, &isint);
+		luaL_argcheck(L, isint && n >= 0, 1,
+			"max_per_prec must be a non-negative integer");
+		max_per_prec = n;
+	}
+	pthread_mutex_lock(&_pool.lock);
+	if (max_bytes >= 0)
+		_pool.max_bytes = max_bytes;
+	if (max_per_prec >= 0)
+		_pool.max_per_prec = max_per_prec;
+	/* simplest way to honor lowered limits */
+	_pool_drain();
+	pthread_mutex_unlock(&_pool.lock);
+	return 0;
+}
+
+/* pool_stats() : {hits, misses, bytes, buffers} */
+static int fr_pool_stats(lua_State *L)
+{
+	struct pool_bucket *b;
+	size_t count = 0, hits, misses, bytes;
+
+	pthread_mutex_lock(&_pool.lock);
+	for (b = _pool.b; b < _pool.b + POOL_NBUCKET; b++)
+		count += b->count;
+	hits = _pool.hits;
+	misses = _pool.misses;
+	bytes = _pool.bytes;
+	pthread_mutex_unlock(&_pool.lock);
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushinteger(L, bytes);
+	lua_setfield(L, -2, "bytes");
+	lua_pushinteger(L, count);
+	lua_setfield(L, -2, "buffers");
+	return 1;
+}
+
+
+/*
+ * Memo of results of constants and one-argument functions, keyed by
+ * the function, the exact input (value and precision), the output
+ * precision and the rounding mode, and kept within a byte budget by
+ * dropping the least recently used.  Off until memo_config sets a
+ * budget, so that the bindings only pay one test.  Shared by all Lua
+ * states of the process: the bindings test max_bytes without the lock,
+ * as a hint, and everything else holds it.
+ */
+struct memo_entry {
+	struct memo_entry *chain;	/* next in the hash bucket */
+	struct memo_entry *prev, *next;	/* most recently used first */
+	size_t hash, bytes;
+	void *fn;
+	unsigned long ui;
+	mpfr_prec_t prec, xprec;
+	mpfr_exp_t exp, xexp;
+	int rnd, kind, xkind, ternary;
+	unsigned flags;		/* raised by the computation */
+	mp_limb_t limbs[];	/* result, then input */
+};
+
+/* what a memo entry is looked up by */
+struct memo_key {
+	void *fn;
+	mpfr_srcptr x;		/* input, or NULL */
+	unsigned long ui;	/* integer input, when x is NULL */
+	mpfr_prec_t prec;
+	mpfr_rnd_t rnd;
+	size_t hash;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct memo_entry **bucket;
+	size_t nbucket;		/* a power of 2 */
+	size_t count;
+	struct memo_entry *head, *tail;
+	size_t bytes;
+	size_t max_bytes;
+	size_t hits, misses;
+} _memo = {PTHREAD_MUTEX_INITIALIZER};
+
+static size_t _memo_mix(size_t h, const void *p, size_t n)
+{
+	const unsigned char *s = p;
+
+	while (n--)
+		h = (h ^ *s++) * 0x100000001b3ULL;
+	return h;
+}
+
+static size_t _memo_limbs(mpfr_srcptr x)
+{
+	return mpfr_regular_p(x) ? mpfr_custom_get_size(mpfr_get_prec(x)) : 0;
+}
+
+static void _memo_key(struct memo_key *k, void *fn, mpfr_srcptr x,
+	unsigned long ui, mpfr_prec_t prec, mpfr_rnd_t rnd)
+{
+	size_t h = 0xcbf29ce484222325ULL;
+	int kind;
+	mpfr_exp_t exp;
+
+	k->fn = fn;
+	k->x = x;
+	k->ui = ui;
+	k->prec = prec;
+	k->rnd = rnd;
+	h = _memo_mix(h, &fn, sizeof fn);
+	h = _memo_mix(h, &prec, sizeof prec);
+	h = _memo_mix(h, &rnd, sizeof rnd);
+	if (x) {
+		kind = mpfr_custom_get_kind(x);
+		h = _memo_mix(h, &kind, sizeof kind);
+		if (mpfr_regular_p(x)) {
+			exp = mpfr_get_exp(x);
+			h = _memo_mix(h, &exp, sizeof exp);
+			h = _memo_mix(h, mpfr_custom_get_significand(x),
+				_memo_limbs(x));
+		}
+	} else {
+		h = _memo_mix(h, &ui, sizeof ui);
+	}
+	k->hash = h;
+}
+
+static int _memo_match(const struct memo_entry *e, const struct memo_key *k)
+{
+	const mpfr_srcptr x = k->x;
+
+	if (e->hash != k->hash || e->fn != k->fn || e->prec != k->prec ||
+			e->rnd != k->rnd)
+		return 0;
+	if (!x)
+		return e->xkind == 0 && e->ui == k->ui;
+	if (e->xkind != mpfr_custom_get_kind(x))
+		return 0;
+	if (!mpfr_regular_p(x))
+		return 1;
+	return e->xprec == mpfr_get_prec(x) && e->xexp == mpfr_get_exp(x) &&
+		memcmp((char *) e->limbs + mpfr_custom_get_size(e->prec),
+			mpfr_custom_get_significand(x), _memo_limbs(x)) == 0;
+}
+
+static void _memo_unlink(struct memo_entry *e)
+{
+	*(e->prev ? &e->prev->next : &_memo.head) = e->next;
+	*(e->next ? &e->next->prev : &_memo.tail) = e->prev;
+}
+
+static void _memo_push(struct memo_entry *e)
+{
+	e->prev = NULL;
+	e->next = _memo.head;
+	*(_memo.head ? &_memo.head->prev : &_memo.tail) = e;
+	_memo.head = e;
+}
+
+static void _memo_drop(struct memo_entry *e)
+{
+	struct memo_entry **p;
+
+	p = &_memo.bucket[e->hash & (_memo.nbucket - 1)];
+	while (*p != e)
+		p = &(*p)->chain;
+	*p = e->chain;
+	_memo_unlink(e);
+	_memo.bytes -= e->bytes;
+	_memo.count--;
+	free(e);
+}
+
+/* drop least recently used entries until bytes fit */
+static void _memo_trim(size_t max)
+{
+	while (_memo.tail && _memo.bytes > max)
+		_memo_drop(_memo.tail);
+}
+
+/* z = the memoized result for k, if any, and *t its ternary value; the
+ * flags it raised are raised again */
+static int _memo_get(const struct memo_key *k, mpfr_ptr z, int *t)
+{
+	struct memo_entry *e = NULL;
+	__mpfr_struct v;
+
+	pthread_mutex_lock(&_memo.lock);
+	if (_memo.nbucket)
+		for (e = _memo.bucket[k->hash & (_memo.nbucket - 1)]; e;
+				e = e->chain)
+			if (_memo_match(e, k))
+				break;
+	if (!e) {
+		_memo.misses++;
+		pthread_mutex_unlock(&_memo.lock);
+		return 0;
+	}
+	_memo.hits++;
+	_memo_unlink(e);
+	_memo_push(e);
+	mpfr_custom_init_set(&v, e->kind, e->exp, e->prec, e->limbs);
+	mpfr_set(z, &v, MPFR_RNDN);	/* same precision: exact */
+	*t = e->ternary;
+	_flags_set(e->flags);
+	pthread_mutex_unlock(&_memo.lock);
+	return 1;
+}
+
+static void _memo_grow(void)
+{
+	struct memo_entry **b, *e, *next;
+	size_t i, n;
+
+	n = _memo.nbucket ? 2 * _memo.nbucket : 64;
+	b = calloc(n, sizeof *b);
+	if (!b)
+		return;		/* keep the long chains */
+	for (i = 0; i < _memo.nbucket; i++) {
+		for (e = _memo.bucket[i]; e; e = next) {
+			next = e->chain;
+			e->chain = b[e->hash & (n - 1)];
+			b[e->hash & (n - 1)] = e;
+		}
+	}
+	free(_memo.bucket);
+	_memo.bucket = b;
+	_memo.nbucket = n;
+}
+
+/*
+ * a new entry for k, holding a copy of its input, to be given its
+ * result by _memo_put.  Taken after computing, so that nothing leaks if
+ * that raises an error, unless z is the input.
+ */
+static struct memo_entry *_memo_new(const struct memo_key *k)
+{
+	struct memo_entry *e;
+	size_t zsz, xsz, max;
+
+	zsz = mpfr_custom_get_size(k->prec);
+	xsz = k->x ? _memo_limbs(k->x) : 0;
+	pthread_mutex_lock(&_memo.lock);
+	max = _memo.max_bytes;
+	pthread_mutex_unlock(&_memo.lock);
+	if (sizeof *e + zsz + xsz > max)
+		return NULL;
+	e = malloc(sizeof *e + zsz + xsz);
+	if (!e)
+		return NULL;
+	e->bytes = sizeof *e + zsz + xsz;
+	e->hash = k->hash;
+	e->fn = k->fn;
+	e->ui = k->ui;
+	e->prec = k->prec;
+	e->rnd = k->rnd;
+	e->xkind = 0;
+	if (k->x) {
+		e->xkind = mpfr_custom_get_kind(k->x);
+		e->xprec = mpfr_get_prec(k->x);
+		if (xsz) {
+			e->xexp = mpfr_get_exp(k->x);
+			memcpy((char *) e->limbs + zsz,
+				mpfr_custom_get_significand(k->x), xsz);
+		}
+	}
+	return e;
+}
+
+static void _memo_put(struct memo_entry *e, mpfr_srcptr z, int ternary,
+	unsigned flags)
+{
+	size_t i;
+
+	if (!e)
+		return;
+	e->kind = mpfr_custom_get_kind(z);
+	e->exp = mpfr_regular_p(z) ? mpfr_get_exp(z) : 0;
+	e->ternary = ternary;
+	e->flags = flags;
+	memcpy(e->limbs, mpfr_custom_get_significand(z),
+		mpfr_custom_get_size(e->prec));
+	pthread_mutex_lock(&_memo.lock);
+	/* the budget may have shrunk since _memo_new */
+	if (e->bytes <= _memo.max_bytes) {
+		_memo_trim(_memo.max_bytes - e->bytes);
+		if (_memo.count >= _memo.nbucket)
+			_memo_grow();
+	}
+	if (e->bytes > _memo.max_bytes || !_memo.nbucket) {
+		pthread_mutex_unlock(&_memo.lock);
+		free(e);
+		return;
+	}
+	i = e->hash & (_memo.nbucket - 1);
+	e->chain = _memo.bucket[i];
+	_memo.bucket[i] = e;
+	_memo_push(e);
+	_memo.bytes += e->bytes;
+	_memo.count++;
+	pthread_mutex_unlock(&_memo.lock);
+}
+
+/* memo_config{max_bytes}: 0 turns the memo off and empties it */
+static int fr_memo_config(lua_State *L)
+{
+	lua_Integer n = -1;
+	int isint;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	if (lua_getfield(L, 1, "max_bytes") != LUA_TNIL) {
+		n = lua_tointegerx(L, -1, &isint);
+		luaL_argcheck(L, isint && n >= 0, 1,
+			"max_bytes must be a non-negative integer");
+	}
+	pthread_mutex_lock(&_memo.lock);
+	if (n >= 0)
+		_memo.max_bytes = n;
+	_memo_trim(_memo.max_bytes);
+	if (!_memo.max_bytes) {
+		free(_memo.bucket);
+		_memo.bucket = NULL;
+		_memo.nbucket = 0;
+	}
+	pthread_mutex_unlock(&_memo.lock);
+	return 0;
+}
+
+/* memo_stats() : {hits, misses, bytes, entries} */
+static int fr_memo_stats(lua_State *L)
+{
+	size_t hits, misses, bytes, count;
+
+	pthread_mutex_lock(&_memo.lock);
+	hits = _memo.hits;
+	misses = _memo.misses;
+	bytes = _memo.bytes;
+	count = _memo.count;
+	pthread_mutex_unlock(&_memo.lock);
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushinteger(L, bytes);
+	lua_setfield(L, -2, "bytes");
+	lua_pushinteger(L, count);
+	lua_setfield(L, -2, "entries");
+	return 1;
+}
+
+/* z = fn(x), through the memo */
+static int _memo_fn1(int (*fn)(mpfr_ptr, mpfr_srcptr, mpfr_rnd_t),
+	mpfr_ptr z, mpfr_srcptr x, mpfr_rnd_t r)
+{
+	struct memo_key k;
+	struct memo_entry *e;
+	unsigned old, flags;
+	int t;
+
+	_memo_key(&k, (void *) fn, x, 0, mpfr_get_prec(z), r);
+	if (!_memo_get(&k, z, &t)) {
+		/* MPFR functions never raise, so the early entry is safe */
+		e = z == x ? _memo_new(&k) : NULL;
+		old = _flags_save();
+		_flags_clear(MPFR_FLAGS_ALL);
+		t = (*fn)(z, x, r);
+		flags = _flags_save();
+		_flags_set(old);
+		if (z != x)
+			e = _memo_new(&k);
+		_memo_put(e, z, t, flags);
+	}
+	return t;
+}
+
+
+static lua_Integer _check_prec(lua_State *L, int i)
+{
+	lua_Integer prec;
+
+	prec = luaL_checkinteger(L, i);
+	if (!(MPFR_PREC_MIN <= prec && prec <= MPFR_PREC_MAX))
+		luaL_argerror(L, i, lua_pushfstring(L,
+			"precision must be between %I and %I",
+			(lua_Integer) MPFR_PREC_MIN,
+			(lua_Integer) MPFR_PREC_MAX));
+	return prec;
+}
+
+/* new([prec]) : mpfr_t */
+static int fr_new(lua_State *L)
+{
+	lua_Integer prec;
+
+	if (lua_isnoneornil(L, 1))
+		prec = mpfr_get_default_prec();
+	else
+		prec = _check_prec(L, 1);
+	_fr_push(L, prec);
+	return 1;
+}
+
+#define V_LONG 0
+#define V_DOUBLE 1
+#define V_MPFR 2
+
+union value {
+	long i;
+	double d;
+	mpfr_ptr fr;
+};
+
+static int _check_value(lua_State *L, int i, union value *v)
+{
+	lua_Integer x;
+	int isint;
+
+	if (lua_isnumber(L, i)) {
+		x = lua_tointegerx(L, i, &isint);
+		if (isint && (v->i = x) == x)
+			return V_LONG;
+		v->d = lua_tonumber(L, i);
+		return V_DOUBLE;
+	}
+	v->fr = _check_fr(L, i);
+	return V_MPFR;
+}
+
+static const char *const _pow2_bases[] = {"hex", "bin", NULL};
+
+/* set(self, number, [rnd])
+ * set(self, string, [base], [rnd])
+ * base may also be "hex" or "bin", reading what tohex and tobin write.
+ */
+static int fr_set(lua_State *L)
+{
+	mpfr_ptr z;
+	union value v;
+	mpfr_rnd_t r;
+	const char *s;
+	char *end;
+	int b, t = 0;
+
+	z = _check_fr(L, 1);
+	if (lua_isstring(L, 2)) {
+		r = _opt_rnd(L, 4);
+		s = lua_tostring(L, 2);
+		/* power-of-2 bases are read without radix conversion */
+		if (lua_type(L, 3) == LUA_TSTRING)
+			b = luaL_checkoption(L, 3, NULL, _pow2_bases) ?
+				2 : 16;
+		else
+			b = _opt_base(L, 3);
+		/* mpfr_set_str, but keeping the ternary value */
+		t = mpfr_strtofr(z, s, &end, b, r);
+		if (end == s || *end != '\0')
+			luaL_argerror(L, 2,
+				"not a valid number in given base");
+	} else {
+		r = _opt_rnd(L, 3);
+		switch (_check_value(L, 2, &v)) {
+		case V_LONG:
+			t = mpfr_set_si(z, v.i, r);
+			break;
+		case V_DOUBLE:
+			t = mpfr_set_d(z, v.d, r);
+			break;
+		case V_MPFR:
+			t = mpfr_set(z, v.fr, r);
+			break;
+		}
+	}
+	return _ret(L, t);
+}
+
+static int fr_set_nan(lua_State *L)
+{
+	mpfr_set_nan(_check_fr(L, 1));
+	return _ret(L, 0);
+}
+
+static int fr_set_inf(lua_State *L)
+{
+	mpfr_set_inf(_check_fr(L, 1), luaL_optinteger(L, 2, 0));
+	return _ret(L, 0);
+}
+
+static int fr_set_zero(lua_State *L)
+{
+	mpfr_set_zero(_check_fr(L, 1), luaL_optinteger(L, 2, 0));
+	return _ret(L, 0);
+}
+
+
+/*
+ * Binary splitting.  A series sum(a(n) * prod(p(j) / q(j), j = 1..n),
+ * n = 0..N-1) with polynomials p, q and a is summed exactly as T/Q.
+ * For a range [n1, n2) of terms
+ *	P = prod p(j), Q = prod q(j), T = Q * (sum of the range),
+ * and adjacent ranges merge as P1 P2, Q1 Q2, T1 Q2 + P1 T2.  Chunks of
+ * the range go to the worker threads, biggest first, then the chunks
+ * are merged level by level with the products of each merge done side
+ * by side.  The workers only use GMP.
+ */
+#define BS_MAXCOEF	16
+#define BS_CHUNKS	256
+
+struct bs_poly {
+	int n;			/* number of coefficients */
+	mpz_t c[BS_MAXCOEF];	/* highest degree first */
+};
+
+struct bs_series {
+	struct bs_poly p, q, a;
+};
+
+struct bs_node {
+	mpz_t P, Q, T;
+};
+
+/* coefficients from a string of integers, like "-72 108 -46 5" */
+static void _bs_poly_str(struct bs_poly *f, const char *s)
+{
+	char buf[32];
+	size_t len;
+
+	for (f->n = 0; *s; f->n++) {
+		len = strcspn(s, " ");
+		memcpy(buf, s, len);
+		buf[len] = '\0';
+		mpz_init_set_str(f->c[f->n], buf, 10);
+		s += len + (s[len] == ' ');
+	}
+}
+
+static void _bs_poly_clear(struct bs_poly *f)
+{
+	while (f->n)
+		mpz_clear(f->c[--f->n]);
+}
+
+static void _bs_series_clear(struct bs_series *s)
+{
+	_bs_poly_clear(&s->p);
+	_bs_poly_clear(&s->q);
+	_bs_poly_clear(&s->a);
+}
+
+static void _bs_eval(mpz_t v, const struct bs_poly *f, unsigned long n)
+{
+	int i;
+
+	mpz_set(v, f->c[0]);
+	for (i = 1; i < f->n; i++) {
+		mpz_mul_ui(v, v, n);
+		mpz_add(v, v, f->c[i]);
+	}
+}
+
+static void _bs_node_init(struct bs_node *x)
+{
+	mpz_inits(x->P, x->Q, x->T, NULL);
+}
+
+static void _bs_node_clear(struct bs_node *x)
+{
+	mpz_clears(x->P, x->Q, x->T, NULL);
+}
+
+/* x = the terms [n1, n2) */
+static void _bs_range(const struct bs_series *s, unsigned long n1,
+	unsigned long n2, struct bs_node *x)
+{
+	struct bs_node y;
+
+	if (n2 - n1 == 1) {
+		_bs_eval(x->T, &s->a, n1);
+		if (n1 == 0) {
+			mpz_set_ui(x->P, 1);
+			mpz_set_ui(x->Q, 1);
+		} else {
+			_bs_eval(x->P, &s->p, n1);
+			_bs_eval(x->Q, &s->q, n1);
+			mpz_mul(x->T, x->T, x->P);
+		}
+		return;
+	}
+	_bs_range(s, n1, n1 + (n2 - n1) / 2, x);
+	_bs_node_init(&y);
+	_bs_range(s, n1 + (n2 - n1) / 2, n2, &y);
+	mpz_mul(x->T, x->T, y.Q);
+	mpz_addmul(x->T, x->P, y.T);
+	mpz_mul(x->P, x->P, y.P);
+	mpz_mul(x->Q, x->Q, y.Q);
+	_bs_node_clear(&y);
+}
+
+/* node i is the merge of 2i and 2i+1; chunks are k..2k-1 */
+struct bs_job {
+	const struct bs_series *s;
+	unsigned long nterms;
+	size_t k;
+	size_t lo;		/* level being merged, 0 for the chunks */
+	size_t next, end;	/* tasks left in this step */
+	pthread_mutex_t lock;
+	struct bs_node node[2 * BS_CHUNKS];
+	mpz_t tmp[BS_CHUNKS];
+};
+
+static void _job_bs(void *arg, int id)
+{
+	struct bs_job *j = arg;
+	struct bs_node *x, *y, *z;
+	unsigned long n1, n2, q, r;
+	size_t t, c, i;
+
+	q = j->nterms / j->k;
+	r = j->nterms % j->k;
+	for (;;) {
+		pthread_mutex_lock(&j->lock);
+		t = j->next;
+		if (t < j->end)
+			j->next++;
+		pthread_mutex_unlock(&j->lock);
+		if (t >= j->end)
+			break;
+		if (!j->lo) {
+			c = j->k - 1 - t;	/* last terms cost the most */
+			n1 = q * c + (c < r ? c : r);
+			n2 = n1 + q + (c < r);
+			_bs_range(j->s, n1, n2, &j->node[j->k + c]);
+			continue;
+		}
+		i = j->lo + t / 4;
+		z = &j->node[i];
+		x = &j->node[2 * i];
+		y = &j->node[2 * i + 1];
+		switch (t % 4) {
+		case 0:
+			if (i > 1)	/* the final P is not needed */
+				mpz_mul(z->P, x->P, y->P);
+			break;
+		case 1:
+			mpz_mul(z->Q, x->Q, y->Q);
+			break;
+		case 2:
+			mpz_mul(j->tmp[i], x->T, y->Q);
+			break;
+		case 3:
+			mpz_mul(z->T, x->P, y->T);
+			break;
+		}
+	}
+}
+
+/* T/Q = the first nterms terms of s, using up to nthreads threads */
+static void _bs_sum(mpz_t Q, mpz_t T, const struct bs_series *s,
+	unsigned long nterms, int nthreads)
+{
+	struct bs_job job, *j = &job;
+	size_t i, n;
+
+	j->s = s;
+	j->nterms = nterms;
+	j->k = 1;
+	while (j->k < BS_CHUNKS && j->k < 4 * (size_t) nthreads &&
+			2 * j->k <= nterms && nthreads > 1)
+		j->k *= 2;
+	for (i = 1; i < 2 * j->k; i++)
+		_bs_node_init(&j->node[i]);
+	for (i = 0; i < j->k; i++)
+		mpz_init(j->tmp[i]);
+	pthread_mutex_init(&j->lock, NULL);
+
+	j->lo = 0;
+	j->next = 0;
+	j->end = j->k;
+	_workers_run(nthreads < j->k ? nthreads : j->k, _job_bs, j);
+	for (j->lo = j->k / 2; j->lo; j->lo /= 2) {
+		j->next = 0;
+		j->end = 4 * j->lo;
+		n = j->end;
+		_workers_run(nthreads < n ? nthreads : n, _job_bs, j);
+		for (i = j->lo; i < 2 * j->lo; i++) {
+			mpz_add(j->node[i].T, j->node[i].T, j->tmp[i]);
+			/* done with the halves: free them early */
+			_bs_node_clear(&j->node[2 * i]);
+			_bs_node_clear(&j->node[2 * i + 1]);
+			_bs_node_init(&j->node[2 * i]);
+			_bs_node_init(&j->node[2 * i + 1]);
+		}
+	}
+	mpz_swap(Q, j->node[1].Q);
+	mpz_swap(T, j->node[1].T);
+
+	pthread_mutex_destroy(&j->lock);
+	for (i = 0; i < j->k; i++)
+		mpz_clear(j->tmp[i]);
+	for (i = 1; i < 2 * j->k; i++)
+		_bs_node_clear(&j->node[i]);
+}
+
+/* T/Q for the series given as coefficient strings */
+static void _bs_sum_str(mpz_t Q, mpz_t T, const char *p, const char *q,
+	const char *a, unsigned long nterms, int nthreads)
+{
+	struct bs_series s;
+
+	_bs_poly_str(&s.p, p);
+	_bs_poly_str(&s.q, q);
+	_bs_poly_str(&s.a, a);
+	_bs_sum(Q, T, &s, nterms, nthreads);
+	_bs_series_clear(&s);
+}
+
+/*
+ * The constants, each at the precision of y and within 32 ulps.  The
+ * series are cut where the tail falls well below that.
+ */
+
+/* Chudnovsky: pi = 426880 sqrt(10005) Q/T */
+static void _bs_pi(lua_State *L, mpfr_ptr y, int nthreads)
+{
+	mpz_t Q, T;
+
+	mpz_inits(Q, T, NULL);
+	_bs_sum_str(Q, T, "-72 108 -46 5", "10939058860032000 0 0 0",
+		"545140134 13591409", mpfr_get_prec(y) / 47 + 2, nthreads);
+	mpfr_sqrt_ui(y, 10005, MPFR_RNDN);
+	mpfr_mul_ui(y, y, 426880, MPFR_RNDN);
+	mpfr_mul_z(y, y, Q, MPFR_RNDN);
+	mpfr_div_z(y, y, T, MPFR_RNDN);
+	mpz_clears(Q, T, NULL);
+}
+
+/* e = sum 1/n! */
+static void _bs_e(lua_State *L, mpfr_ptr y, int nthreads)
+{
+	mpz_t Q, T;
+	unsigned long n;
+	double bits = 0;
+
+	for (n = 1; bits < mpfr_get_prec(y) + 8; n++)
+		bits += log2(n);
+	mpz_inits(Q, T, NULL);
+	_bs_sum_str(Q, T, "1", "1 0", "1", n, nthreads);
+	mpfr_set_z(y, T, MPFR_RNDN);
+	mpfr_div_z(y, y, Q, MPFR_RNDN);
+	mpz_clears(Q, T, NULL);
+}
+
+/* log 2 = 3/4 sum (-1)^n n!^2 / (2^n (2n+1)!) */
+static void _bs_log2(lua_State *L, mpfr_ptr y, int nthreads)
+{
+	mpz_t Q, T;
+
+	mpz_inits(Q, T, NULL);
+	_bs_sum_str(Q, T, "-1 0", "8 4", "1",
+		mpfr_get_prec(y) / 3 + 4, nthreads);
+	mpfr_set_z(y, T, MPFR_RNDN);
+	mpfr_mul_ui(y, y, 3, MPFR_RNDN);
+	mpfr_div_z(y, y, Q, MPFR_RNDN);
+	mpfr_div_2ui(y, y, 2, MPFR_RNDN);
+	mpz_clears(Q, T, NULL);
+}
+
+/*
+ * Catalan's constant
+ *	G = 3/8 sum n!^2 / ((2n)! (2n+1)^2) + pi/8 log(2 + sqrt(3))
+ */
+static void _bs_catalan(lua_State *L, mpfr_ptr y, int nthreads)
+{
+	mpz_t Q, T;
+	mpfr_t t, u;
+	mpfr_prec_t prec = mpfr_get_prec(y);
+
+	mpz_inits(Q, T, NULL);
+	_bs_sum_str(Q, T, "2 -1 0", "8 8 2", "1", prec / 2 + 4, nthreads);
+	mpfr_set_z(y, T, MPFR_RNDN);
+	mpfr_mul_ui(y, y, 3, MPFR_RNDN);
+	mpfr_div_z(y, y, Q, MPFR_RNDN);
+	mpz_clears(Q, T, NULL);
+
+	_pool_get(L, t, prec);
+	_pool_get(L, u, prec);
+	_bs_pi(L, t, nthreads);
+	mpfr_sqrt_ui(u, 3, MPFR_RNDN);
+	mpfr_add_ui(u, u, 2, MPFR_RNDN);
+	mpfr_log(u, u, MPFR_RNDN);
+	mpfr_mul(t, t, u, MPFR_RNDN);
+	mpfr_add(y, y, t, MPFR_RNDN);
+	mpfr_div_2ui(y, y, 3, MPFR_RNDN);
+	_pool_put(u);
+	_pool_put(t);
+}
+
+static int _const_e(mpfr_ptr z, mpfr_rnd_t r)
+{
+	mpfr_set_ui(z, 1, MPFR_RNDN);
+	return mpfr_exp(z, z, r);
+}
+
+/* z = the constant computed by f, correctly rounded (Ziv's loop) */
+static int _bs_const(lua_State *L, mpfr_ptr z, mpfr_rnd_t r, int nthreads,
+	void (*f)(lua_State *, mpfr_ptr, int))
+{
+	mpfr_t y;
+	mpfr_prec_t prec, w;
+	int t;
+
+	prec = mpfr_get_prec(z);
+	for (w = prec + 32; prec; prec >>= 1)
+		w++;
+	prec = mpfr_get_prec(z);
+	for (;;) {
+		_pool_get(L, y, w);
+		(*f)(L, y, nthreads);
+		if (mpfr_can_round(y, w - 6, MPFR_RNDN, MPFR_RNDZ,
+				prec + (r == MPFR_RNDN)))
+			break;
+		_pool_put(y);
+		w += w / 2;
+	}
+	t = mpfr_set(z, y, r);	/* y can round, so t is right for pi too */
+	_pool_put(y);
+	return t;
+}
+
+/* check that field k of the table at index i is a list of integers */
+static void _bs_check_poly(lua_State *L, int i, const char *k)
+{
+	lua_Integer n, c;
+	mpfr_ptr z;
+	mpz_t t;
+	int isint, ok;
+
+	lua_getfield(L, i, k);
+	if (!lua_istable(L, -1))
+		luaL_error(L, "series: %s must be a list of coefficients", k);
+	n = lua_rawlen(L, -1);
+	if (n < 1 || n > BS_MAXCOEF)
+		luaL_error(L, "series: %s must have 1 to %d coefficients",
+			k, BS_MAXCOEF);
+	for (c = 1; c <= n; c++) {
+		lua_rawgeti(L, -1, c);
+		if (lua_type(L, -1) == LUA_TSTRING) {
+			mpz_init(t);
+			ok = mpz_set_str(t, lua_tostring(L, -1), 0) == 0;
+			mpz_clear(t);
+		} else if ((z = _test_fr(L, -1)) != NULL) {
+			ok = mpfr_integer_p(z);
+		} else {
+			lua_tointegerx(L, -1, &isint);
+			ok = isint;
+		}
+		if (!ok)
+			luaL_error(L, "series: %s[%d] is not an integer",
+				k, (int) c);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+}
+
+/* field k of the table at index i, checked by _bs_check_poly */
+static void _bs_get_poly(lua_State *L, int i, const char *k,
+	struct bs_poly *f)
+{
+	mpfr_ptr z;
+	lua_Integer x;
+
+	lua_getfield(L, i, k);
+	f->n = lua_rawlen(L, -1);
+	for (x = 0; x < f->n; x++) {
+		lua_rawgeti(L, -1, x + 1);
+		mpz_init(f->c[x]);
+		if (lua_type(L, -1) == LUA_TSTRING)
+			mpz_set_str(f->c[x], lua_tostring(L, -1), 0);
+		else if ((z = _test_fr(L, -1)) != NULL)
+			mpfr_get_z(f->c[x], z, MPFR_RNDN);
+		else
+			mpz_set_si(f->c[x], lua_tointeger(L, -1));
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+}
+
+/*
+ * series_sum(dst, {p=, q=, a=}, nterms, [rnd], [opts]):
+ * dst = sum(a(n) * prod(p(j) / q(j), j = 1..n), n = 0..nterms-1),
+ * with polynomials given by their integer coefficients, highest degree
+ * first.  The sum is exact until one division at the end.  As for the
+ * constants, threads are used only when opts is given.
+ */
+static int fr_series_sum(lua_State *L)
+{
+	struct bs_series s;
+	mpfr_ptr z;
+	mpfr_t y, t;
+	mpfr_rnd_t r;
+	lua_Integer nterms;
+	mpfr_prec_t prec, w, big;
+	mpz_t Q, T;
+	int nthreads = 0, inex = 0;
+
+	z = _check_fr(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	nterms = luaL_checkinteger(L, 3);
+	luaL_argcheck(L, nterms >= 0, 3, "must be non-negative");
+	r = _opt_rnd(L, 4);
+	if (!lua_isnoneornil(L, 5))
+		nthreads = _opt_nthreads(L, 5);
+	_bs_check_poly(L, 2, "p");
+	_bs_check_poly(L, 2, "q");
+	_bs_check_poly(L, 2, "a");
+	lua_settop(L, 2);
+
+	_bs_get_poly(L, 2, "p", &s.p);
+	_bs_get_poly(L, 2, "q", &s.q);
+	_bs_get_poly(L, 2, "a", &s.a);
+	mpz_inits(Q, T, NULL);
+	if (nterms)
+		_bs_sum(Q, T, &s, nterms, nthreads);
+	else
+		mpz_set_ui(Q, 1);
+	_bs_series_clear(&s);
+	if (!mpz_sgn(Q)) {
+		mpz_clears(Q, T, NULL);
+		return luaL_argerror(L, 2, "q is zero at some term");
+	}
+
+	prec = mpfr_get_prec(z);
+	big = MPFR_PREC_MIN;
+	if (big < mpz_sizeinbase(T, 2))
+		big = mpz_sizeinbase(T, 2);
+	if (big < mpz_sizeinbase(Q, 2))
+		big = mpz_sizeinbase(Q, 2);
+	for (w = prec + 32; w < big; w += w / 2) {
+		_pool_get(L, y, w);
+		_pool_get(L, t, w);
+		mpfr_set_z(y, T, MPFR_RNDN);
+		mpfr_set_z(t, Q, MPFR_RNDN);
+		mpfr_div(y, y, t, MPFR_RNDN);
+		_pool_put(t);
+		if (mpfr_zero_p(y) || mpfr_can_round(y, w - 3, MPFR_RNDN,
+				MPFR_RNDZ, prec + (r == MPFR_RNDN))) {
+			inex = mpfr_set(z, y, r);
+			_pool_put(y);
+			break;
+		}
+		_pool_put(y);
+	}
+	if (w >= big) {
+		/* T and Q fit: an exact division is no dearer */
+		_pool_get(L, y, big);
+		_pool_get(L, t, big);
+		mpfr_set_z(y, T, MPFR_RNDN);
+		mpfr_set_z(t, Q, MPFR_RNDN);
+		inex = mpfr_div(z, y, t, r);
+		_pool_put(t);
+		_pool_put(y);
+	}
+	mpz_clears(Q, T, NULL);
+	return _ret(L, inex);
+}
+
+/*
+ * On-disk cache of constants.  Each file holds one constant rounded
+ * toward zero at some precision, for one MPFR version, and answers
+ * any request it can round correctly.  Files are written under a
+ * temporary name and renamed into place, so readers never see a
+ * partial file and concurrent writers simply race to replace it.
+ */
+#define CACHE_KEY	"mpfr.constant_cache"
+#define CACHE_MAGIC	"lmpfrc1"
+
+struct cache_header {
+	char magic[8];
+	char version[24];	/* mpfr_get_version() */
+	uint32_t order;		/* 0x01020304, native byte order */
+	uint32_t limb_bits;
+	int64_t prec;
+	int64_t exp;
+	int32_t sign;
+	char pad[4];		/* limbs follow, 64 bytes in */
+};
+
+/*
+ * z = an irrational x, rounded in direction r from v, its rounding
+ * toward zero with err correct bits; 0 if that isn't possible.  The
+ * ternary value goes to *t: when z = v, x is still further from zero.
+ */
+static int _round_truncated(mpfr_ptr z, mpfr_srcptr v, mpfr_prec_t err,
+	mpfr_rnd_t r, int *t)
+{
+	mpfr_prec_t prec = mpfr_get_prec(z);
+
+	if (!mpfr_can_round(v, err, MPFR_RNDZ, MPFR_RNDZ,
+			prec + (r == MPFR_RNDN)))
+		return 0;
+	*t = mpfr_set(z, v, r);
+	if (!*t) {
+		*t = -mpfr_sgn(v);
+		mpfr_set_inexflag();
+	}
+	return 1;
+}
+
+/*
+ * whether the limbs x of a regular value read from a file are valid:
+ * normalized, with the bits below the precision clear
+ */
+static int _limbs_ok(const mp_limb_t *x, mpfr_prec_t prec)
+{
+	size_t nl;
+	mpfr_prec_t unused;
+
+	nl = mpfr_custom_get_size(prec) / sizeof (mp_limb_t);
+	unused = nl * mp_bits_per_limb - prec;
+	return (x[nl - 1] >> (mp_bits_per_limb - 1)) &&
+		!(unused && (x[0] << (mp_bits_per_limb - unused)));
+}
+
+/*
+ * z = the constant in file path, rounded in direction r, if the file
+ * has enough precision, with *t its ternary value.  *have is set to
+ * the precision in the file, or 0.
+ */
+static int _cache_load(const char *path, mpfr_ptr z, mpfr_rnd_t r,
+	mpfr_prec_t *have, int *t)
+{
+	const struct cache_header *h;
+	__mpfr_struct v;
+	struct stat st;
+	void *p;
+	int fd, ok = 0;
+	mpfr_prec_t prec = mpfr_get_prec(z);
+
+	*have = 0;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof *h) {
+		close(fd);
+		return 0;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return 0;
+	h = p;
+	if (memcmp(h->magic, CACHE_MAGIC, sizeof h->magic) == 0 &&
+			strncmp(h->version, mpfr_get_version(),
+				sizeof h->version) == 0 &&
+			h->order == 0x01020304 &&
+			h->limb_bits == mp_bits_per_limb &&
+			MPFR_PREC_MIN <= h->prec && h->prec <= MPFR_PREC_MAX &&
+			st.st_size == (off_t) (sizeof *h +
+				mpfr_custom_get_size(h->prec)) &&
+			(h->sign == 1 || h->sign == -1) &&
+			mpfr_get_emin() <= h->exp && h->exp <= mpfr_get_emax() &&
+			_limbs_ok((const mp_limb_t *) (h + 1), h->prec)) {
+		*have = h->prec;
+		mpfr_custom_init_set(&v,
+			h->sign < 0 ? -MPFR_REGULAR_KIND : MPFR_REGULAR_KIND,
+			h->exp, h->prec, (char *) p + sizeof *h);
+		ok = prec <= h->prec &&
+			_round_truncated(z, &v, h->prec, r, t);
+	}
+	munmap(p, st.st_size);
+	return ok;
+}
+
+/*
+ * save v, a regular number rounded toward zero, to path.  tmp is a
+ * writable copy of path with "XXXXXX" appended.  Errors are ignored:
+ * the cache is only a cache.
+ */
+static void _cache_store(const char *path, char *tmp, mpfr_srcptr v)
+{
+	struct cache_header h;
+	size_t sz;
+	int fd, ok;
+
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, CACHE_MAGIC, sizeof h.magic);
+	sz = strlen(mpfr_get_version());
+	memcpy(h.version, mpfr_get_version(),
+		sz < sizeof h.version ? sz : sizeof h.version);
+	h.order = 0x01020304;
+	h.limb_bits = mp_bits_per_limb;
+	h.prec = mpfr_get_prec(v);
+	h.exp = mpfr_get_exp(v);
+	h.sign = mpfr_sgn(v);
+	sz = mpfr_custom_get_size(h.prec);
+
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return;
+	ok = write(fd, &h, sizeof h) == sizeof h &&
+		write(fd, mpfr_custom_get_significand(v), sz) == (ssize_t) sz;
+	fchmod(fd, 0644);
+	if (close(fd) < 0 || !ok || rename(tmp, path) < 0)
+		unlink(tmp);
+}
+
+/* constant_cache([dir]): cache constants in dir, or stop if nil */
+static int fr_constant_cache(lua_State *L)
+{
+	if (!lua_isnoneornil(L, 1))
+		luaL_checkstring(L, 1);
+	lua_settop(L, 1);
+	lua_setfield(L, LUA_REGISTRYINDEX, CACHE_KEY);
+	return 0;
+}
+
+struct fn0_reg {
+	const char *name;
+	int (*fn)(mpfr_ptr, mpfr_rnd_t);
+	void (*bs)(lua_State *, mpfr_ptr, int);	/* parallel version */
+};
+
+/* binary splitting on nthreads threads if nonzero, else MPFR's way */
+static int _fn0_eval(lua_State *L, const struct fn0_reg *f, mpfr_ptr z,
+	mpfr_rnd_t r, int nthreads)
+{
+	if (nthreads)
+		return _bs_const(L, z, r, nthreads, f->bs);
+	return (*f->fn)(z, r);
+}
+
+/*
+ * _fn0_eval through the cache in directory dir.  A miss computes 64
+ * more bits than asked, so that the next request of the same size can
+ * be rounded from the file.
+ */
+static int _fn0_cached(lua_State *L, const struct fn0_reg *f,
+	const char *dir, mpfr_ptr z, mpfr_rnd_t r, int nthreads)
+{
+	const char *path;
+	char *tmp;
+	size_t len;
+	mpfr_t v;
+	mpfr_prec_t have, prec;
+	int t;
+
+	path = lua_pushfstring(L, "%s/%s-%s.bin", dir, f->name,
+		mpfr_get_version());
+	if (_cache_load(path, z, r, &have, &t))
+		return t;
+	len = strlen(path);
+	tmp = lua_newuserdata(L, len + 8);
+	memcpy(tmp, path, len);
+	strcpy(tmp + len, ".XXXXXX");
+
+	prec = mpfr_get_prec(z);
+	_pool_get(L, v, prec + 64);
+	_fn0_eval(L, f, v, MPFR_RNDZ, nthreads);
+	if (prec + 64 > have && mpfr_regular_p(v))
+		_cache_store(path, tmp, v);
+	if (!_round_truncated(z, v, prec + 64, r, &t))
+		t = _fn0_eval(L, f, z, r, nthreads);
+	_pool_put(v);
+	return t;
+}
+
+/*
+ * [rnd], [opts] -> fr.  opts selects the parallel version if any.  If
+ * constant_cache is set, the value comes from there when possible.
+ */
+static int fr_fn0(lua_State *L)
+{
+	const struct fn0_reg *f;
+	mpfr_ptr z;
+	mpfr_rnd_t r;
+	int nthreads = 0, t;
+	struct memo_key k;
+
+	f = lua_touserdata(L, UV_FN(1));
+	z = _check_fr(L, 1);
+	r = _opt_rnd(L, 2);
+	if (f->bs && !lua_isnoneornil(L, 3))
+		nthreads = _opt_nthreads(L, 3);
+	if (_memo.max_bytes) {
+		_memo_key(&k, (void *) f, NULL, 0, mpfr_get_prec(z), r);
+		if (_memo_get(&k, z, &t))
+			return _ret(L, t);
+	}
+	lua_getfield(L, LUA_REGISTRYINDEX, CACHE_KEY);
+	if (lua_isstring(L, -1))
+		t = _fn0_cached(L, f, lua_tostring(L, -1), z, r, nthreads);
+	else
+		t = _fn0_eval(L, f, z, r, nthreads);
+	/* a constant has no input, so the entry can wait for the result,
+	 * and nothing leaks if the computation raises; it can only be
+	 * inexact */
+	if (_memo.max_bytes)
+		_memo_put(_memo_new(&k), z, t, t ? MPFR_FLAGS_INEXACT : 0);
+	return _ret(L, t);
+}
+
+#define FN_(lname, cname) {lname, cname}
+#define FN(name) FN_(#name, mpfr_##name)
+
+static const struct fn0_reg _fn0_reg[] = {
+	{"const_log2", mpfr_const_log2, _bs_log2},
+	{"const_pi", mpfr_const_pi, _bs_pi},
+	FN(const_euler),
+	{"const_catalan", mpfr_const_catalan, _bs_catalan},
+	{"const_e", _const_e, _bs_e},
+	{0, 0}
+};
+
+static void _reg_fn0(lua_State *L, const struct fn0_reg *r)
+{
+	for (; r->name; r++) {
+		_push_upvals(L);
+		lua_pushlightuserdata(L, (void *) r);
+		lua_pushcclosure(L, fr_fn0, NUPVAL + 1);
+		lua_setfield(L, -2, r->name);
+	}
+}
+
+
+/* fr -> fr */
+static int fr_fn1(lua_State *L)
+{
+	int (*fn)(mpfr_ptr, mpfr_srcptr, mpfr_rnd_t);
+	mpfr_ptr z, x;
+	mpfr_rnd_t r;
+
+	fn = lua_touserdata(L, UV_FN(1));
+	z = _check_fr(L, 1);
+	x = _check_fr(L, 2);
+	r = _opt_rnd(L, 3);
+	if (_memo.max_bytes)
+		return _ret(L, _memo_fn1(fn, z, x, r));
+	return _ret(L, (*fn)(z, x, r));
+}
+
+struct fn1_reg {
+	const char *name;
+	int (*fn)(mpfr_ptr, mpfr_srcptr, mpfr_rnd_t);
+};
+
+static const struct fn1_reg _fn1_reg[] = {
+	FN(sqr),
+	FN(rec_sqrt),
+	FN(cbrt),
+	FN(abs),
+	FN(neg),
+	FN(log),
 	FN(log2),
 	FN(log10),
 	FN(log1p),
@@ -345,603 +2599,4965 @@ static const struct fn1_reg _fn1_reg[] = {
 	{0, 0}
 };
 
-static void _reg_fn1(lua_State *L, const struct fn1_reg *r)
+static void _reg_fn1(lua_State *L, const struct fn1_reg *r, lua_CFunction f)
+{
+	for (; r->name; r++) {
+		_push_upvals(L);
+		lua_pushlightuserdata(L, r->fn);
+		lua_pushcclosure(L, f, NUPVAL + 1);
+		lua_setfield(L, -2, r->name);
+	}
+}
+
+
+/* fr|ui -> fr */
+static int fr_fn1u(lua_State *L)
+{
+	mpfr_ptr z;
+	mpfr_rnd_t r;
+	int t;
+
+	z = _check_fr(L, 1);
+	r = _opt_rnd(L, 3);
+	if (lua_isinteger(L, 2)) {
+		lua_Integer i;
+		int (*fn)(mpfr_ptr, unsigned long, mpfr_rnd_t);
+
+		i = lua_tointeger(L, 2);
+		luaL_argcheck(L, 0 <= i && i <= ULONG_MAX, 2,
+			"out of range of unsigned long");
+		fn = lua_touserdata(L, UV_FN(2));
+		if (_memo.max_bytes) {
+			struct memo_key k;
+			struct memo_entry *e;
+			unsigned old, flags;
+
+			_memo_key(&k, (void *) fn, NULL, i, mpfr_get_prec(z), r);
+			if (!_memo_get(&k, z, &t)) {
+				e = _memo_new(&k);
+				old = _flags_save();
+				_flags_clear(MPFR_FLAGS_ALL);
+				t = (*fn)(z, i, r);
+				flags = _flags_save();
+				_flags_set(old);
+				_memo_put(e, z, t, flags);
+			}
+		} else {
+			t = (*fn)(z, i, r);
+		}
+	} else {
+		int (*fn)(mpfr_ptr, mpfr_srcptr, mpfr_rnd_t);
+
+		fn = lua_touserdata(L, UV_FN(1));
+		if (_memo.max_bytes)
+			t = _memo_fn1(fn, z, _check_fr(L, 2), r);
+		else
+			t = (*fn)(z, _check_fr(L, 2), r);
+	}
+	return _ret(L, t);
+}
+
+struct fn1u_reg {
+	const char *name;
+	int (*fr)(mpfr_ptr, mpfr_srcptr, mpfr_rnd_t);
+	int (*ui)(mpfr_ptr, unsigned long, mpfr_rnd_t);
+};
+
+#define FN2(name) {#name, mpfr_##name, mpfr_##name##_ui}
+static const struct fn1u_reg _fn1u_reg[] = {
+	FN2(sqrt),
+	FN2(zeta),
+	{0, 0}
+};
+
+static void _reg_fn1u(lua_State *L, const struct fn1u_reg *r)
+{
+	for (; r->name; r++) {
+		_push_upvals(L);
+		lua_pushlightuserdata(L, r->fr);
+		lua_pushlightuserdata(L, r->ui);
+		lua_pushcclosure(L, fr_fn1u, NUPVAL + 2);
+		lua_setfield(L, -2, r->name);
+	}
+}
+
+
+/* fr -> fr, fr */
+static int fr_fn12(lua_State *L)
+{
+	int (*fn)(mpfr_ptr, mpfr_ptr, mpfr_srcptr, mpfr_rnd_t);
+	mpfr_ptr x, y, z;
+	mpfr_rnd_t r;
+
+	x = _check_fr(L, 1);
+	y = _check_fr(L, 2);
+	z = _check_fr(L, 3);
+	r = _opt_rnd(L, 4);
+	fn = lua_touserdata(L, UV_FN(1));
+	_ternary = (*fn)(x, y, z, r);	/* both results, as MPFR encodes them */
+	lua_settop(L, 2);
+	return 2;
+}
+
+struct fn12_reg {
+	const char *name;
+	int (*fn)(mpfr_ptr, mpfr_ptr, mpfr_srcptr, mpfr_rnd_t);
+};
+
+static const struct fn12_reg _fn12_reg[] = {
+	FN(modf),
+	FN(sin_cos),
+	FN(sinh_cosh),
+	{0, 0}
+};
+
+static void _reg_fn12(lua_State *L, const struct fn12_reg *r)
+{
+	for (; r->name; r++) {
+		_push_upvals(L);
+		lua_pushlightuserdata(L, r->fn);
+		lua_pushcclosure(L, fr_fn12, NUPVAL + 1);
+		lua_setfield(L, -2, r->name);
+	}
+}
+
+
+static int fr_fac(lua_State *L)
+{
+	mpfr_ptr z;
+	lua_Integer i;
+	mpfr_rnd_t r;
+
+	z = _check_fr(L, 1);
+	i = lua_tointeger(L, 2);
+	luaL_argcheck(L, 0 <= i && i <= ULONG_MAX, 2,
+		"out of range of unsigned long");
+	r = _opt_rnd(L, 3);
+	return _ret(L, mpfr_fac_ui(z, i, r));
+}
+
+
+static int fr_sgn(lua_State *L)
+{
+	mpfr_ptr z;
+
+	z = _check_fr(L, 1);
+	lua_pushinteger(L, mpfr_sgn(z));
+	return 1;
+}
+
+
+/* fr -> bool */
+static int fr_fn1p(lua_State *L)
+{
+	int (*fn)(mpfr_srcptr);
+
+	fn = lua_touserdata(L, UV_FN(1));
+	lua_pushboolean(L, (*fn)(_check_fr(L, 1)));
+	return 1;
+}
+
+struct fn1p_reg {
+	const char *name;
+	int (*fn)(mpfr_srcptr);
+};
+
+static const struct fn1p_reg _fn1p_reg[] = {
+	FN(nan_p),
+	FN(inf_p),
+	FN(number_p),
+	FN(zero_p),
+	FN(regular_p),
+	FN(integer_p),
+	{0, 0}
+};
+
+static void _reg_fn1p(lua_State *L, const struct fn1p_reg *r)
+{
+	for (; r->name; r++) {
+		_push_upvals(L);
+		lua_pushlightuserdata(L, r->fn);
+		lua_pushcclosure(L, fr_fn1p, NUPVAL + 1);
+		lua_setfield(L, -2, r->name);
+	}
+}
+
+
+
+/* fr,fr|fr,si|fr,d|si,fr|d,fr -> fr */
+static int fr_fn2(lua_State *L)
+{
+	union {
+		int (*fr_fr)(mpfr_ptr, mpfr_srcptr, mpfr_srcptr, mpfr_rnd_t);
+		int (*fr_si)(mpfr_ptr, mpfr_srcptr, long, mpfr_rnd_t);
+		int (*fr_d)(mpfr_ptr, mpfr_srcptr, double, mpfr_rnd_t);
+		int (*si_fr)(mpfr_ptr, long, mpfr_srcptr, mpfr_rnd_t);
+		int (*d_fr)(mpfr_ptr, double, mpfr_srcptr, mpfr_rnd_t);
+	} fn;
+	mpfr_ptr z;
+	mpfr_rnd_t r;
+	int xtype, t = 0;
+	union value x, y;
+
+	z = _check_fr(L, 1);
+	xtype = _check_value(L, 2, &x);
+	r = _opt_rnd(L, 4);
+
+	if (xtype == V_MPFR) {
+		switch(_check_value(L, 3, &y)) {
+		case V_LONG:
+			fn.fr_si = lua_touserdata(L, UV_FN(2));
+			t = (*fn.fr_si)(z, x.fr, y.i, r);
+			break;
+		case V_DOUBLE:
+			fn.fr_d = lua_touserdata(L, UV_FN(3));
+			t = (*fn.fr_d)(z, x.fr, y.d, r);
+			break;
+		case V_MPFR:
+			fn.fr_fr = lua_touserdata(L, UV_FN(1));
+			t = (*fn.fr_fr)(z, x.fr, y.fr, r);
+			break;
+		}
+	} else {
+		y.fr = _check_fr(L, 3);
+		switch (xtype) {
+		case V_LONG:
+			fn.si_fr = lua_touserdata(L, UV_FN(4));
+			if (fn.si_fr) {
+				t = (*fn.si_fr)(z, x.i, y.fr, r);
+			} else {
+				fn.fr_si = lua_touserdata(L,
+					UV_FN(2));
+				t = (*fn.fr_si)(z, y.fr, x.i, r);
+			}
+			break;
+		case V_DOUBLE:
+			fn.d_fr = lua_touserdata(L, UV_FN(5));
+			if (fn.d_fr) {
+				t = (*fn.d_fr)(z, x.d, y.fr, r);
+			} else {
+				fn.fr_d = lua_touserdata(L,
+					UV_FN(3));
+				t = (*fn.fr_d)(z, y.fr, x.d, r);
+			}
+			break;
+		}
+	}
+	return _ret(L, t);
+}
+
+
+struct fn2_reg {
+	const char *name;
+	int (*fr_fr)(mpfr_ptr, mpfr_srcptr, mpfr_srcptr, mpfr_rnd_t);
+	int (*fr_si)(mpfr_ptr, mpfr_srcptr, long, mpfr_rnd_t);
+	int (*fr_d)(mpfr_ptr, mpfr_srcptr, double, mpfr_rnd_t);
+	int (*si_fr)(mpfr_ptr, long, mpfr_srcptr, mpfr_rnd_t);
+	int (*d_fr)(mpfr_ptr, double, mpfr_srcptr, mpfr_rnd_t);
+};
+
+#define FN3(name) {#name, mpfr_##name, mpfr_##name##_si, mpfr_##name##_d}
+#define FN5(name) {#name, mpfr_##name, mpfr_##name##_si, mpfr_##name##_d, \
+	mpfr_si_##name, mpfr_d_##name}
+
+static const struct fn2_reg _fn2_reg[] = {
+	FN3(add),
+	FN5(sub),
+	FN3(mul),
+	FN5(div),
+	{0, 0}
+};
+
+static void _push_fn2(lua_State *L, const struct fn2_reg *r,
+	lua_CFunction f)
+{
+	_push_upvals(L);
+	lua_pushlightuserdata(L, r->fr_fr);
+	lua_pushlightuserdata(L, r->fr_si);
+	lua_pushlightuserdata(L, r->fr_d);
+	if (r->si_fr) {
+		lua_pushlightuserdata(L, r->si_fr);
+		lua_pushlightuserdata(L, r->d_fr);
+		lua_pushcclosure(L, f, NUPVAL + 5);
+	} else {
+		lua_pushcclosure(L, f, NUPVAL + 3);
+	}
+}
+
+static void _reg_fn2(lua_State *L, const struct fn2_reg *r, lua_CFunction f)
+{
+	for (; r->name; r++) {
+		_push_fn2(L, r, f);
+		lua_setfield(L, -2, r->name);
+	}
+}
+
+
+static int fr_pow(lua_State *L)
+{
+	mpfr_ptr x, y, z;
+	mpfr_rnd_t r;
+	lua_Integer i1, i2;
+	int isint1, isint2, t;
+
+	z = _check_fr(L, 1);
+	i1 = lua_tointegerx(L, 2, &isint1);
+	i2 = lua_tointegerx(L, 3, &isint2);
+	r = _opt_rnd(L, 4);
+	if (isint1) {
+		luaL_argcheck(L, 0 <= i1 && i1 <= ULONG_MAX, 2,
+			"out of range of unsigned long");
+		if (isint2) {
+			luaL_argcheck(L, 0 <= i2 && i2 <= ULONG_MAX, 2,
+				"out of range of unsigned long");
+			t = mpfr_ui_pow_ui(z, i1, i2, r);
+		} else {
+			y = _check_fr(L, 3);
+			t = mpfr_ui_pow(z, i1, y, r);
+		}
+	} else {
+		x = _check_fr(L, 2);
+		if (isint2) {
+			if (i2 < 0) {
+				luaL_argcheck(L, i2 >= LONG_MIN, 2,
+					"out of range of long");
+				t = mpfr_pow_si(z, x, i2, r);
+			} else {
+				luaL_argcheck(L, i2 <= ULONG_MAX, 2,
+					"out of range of unsigned long");
+				t = mpfr_pow_ui(z, x, i2, r);
+			}
+		} else {
+			y = _check_fr(L, 3);
+			t = mpfr_pow(z, x, y, r);
+		}
+	}
+	return _ret(L, t);
+}
+
+static int fr_root(lua_State *L)
+{
+	mpfr_ptr x, z;
+	mpfr_rnd_t r;
+	lua_Integer k;
+
+	z = _check_fr(L, 1);
+	x = _check_fr(L, 2);
+	k = luaL_checkinteger(L, 3);
+	luaL_argcheck(L, 0 <= k && k <= ULONG_MAX, 3,
+		"out of range of unsigned long");
+	r = _opt_rnd(L, 4);
+
+	return _ret(L, mpfr_rootn_ui(z, x, k, r));
+}
+
+
+/* fr,fr -> fr */
+static int fr_fn2f(lua_State *L)
+{
+	int (*fn)(mpfr_ptr, mpfr_srcptr, mpfr_srcptr, mpfr_rnd_t);
+
+	fn = lua_touserdata(L, UV_FN(1));
+	return _ret(L, (*fn)(_check_fr(L, 1), _check_fr(L, 2),
+		_check_fr(L, 3), _opt_rnd(L, 4)));
+}
+
+struct fn2f_reg {
+	const char *name;
+	int (*fn)(mpfr_ptr, mpfr_srcptr, mpfr_srcptr, mpfr_rnd_t);
+};
+
+static const struct fn2f_reg _fn2f_reg[] = {
+	FN(fmod),
+	FN(remainder),
+	FN(atan2),
+	FN(agm),
+	FN(hypot),
+	FN(min),
+	FN(max),
+	{0, 0}
+};
+
+static void _reg_fn2f(lua_State *L, const struct fn2f_reg *r)
+{
+	for (; r->name; r++) {
+		_push_upvals(L);
+		lua_pushlightuserdata(L, r->fn);
+		lua_pushcclosure(L, fr_fn2f, NUPVAL + 1);
+		lua_setfield(L, -2, r->name);
+	}
+}
+
+
+/* si,fr -> fr */
+static int fr_fn2n(lua_State *L)
+{
+	int (*fn)(mpfr_ptr, long, mpfr_srcptr, mpfr_rnd_t);
+	mpfr_ptr x, z;
+	lua_Integer n;
+	mpfr_rnd_t r;
+
+	z = _check_fr(L, 1);
+	n = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, LONG_MIN <= n && n <= LONG_MAX, 2,
+		"out of range of long");
+	x = _check_fr(L, 3);
+	r = _opt_rnd(L, 4);
+	fn = lua_touserdata(L, UV_FN(1));
+
+	return _ret(L, (*fn)(z, n, x, r));
+}
+
+struct fn2n_reg {
+	const char *name;
+	int (*fn)(mpfr_ptr, long, mpfr_srcptr, mpfr_rnd_t);
+};
+
+static const struct fn2n_reg _fn2n_reg[] = {
+	FN(jn),
+	FN(yn),
+	{0, 0}
+};
+
+static void _reg_fn2n(lua_State *L, const struct fn2n_reg *r)
+{
+	for (; r->name; r++) {
+		_push_upvals(L);
+		lua_pushlightuserdata(L, r->fn);
+		lua_pushcclosure(L, fr_fn2n, NUPVAL + 1);
+		lua_setfield(L, -2, r->name);
+	}
+}
+
+
+/* compare x with the value at index i; *unordered is set if NaN is involved */
+static int _cmp_value(lua_State *L, mpfr_srcptr x, int i, int *unordered)
+{
+	union value y;
+	int result = 0;
+
+	switch (_check_value(L, i, &y)) {
+	case V_LONG:
+		*unordered = mpfr_nan_p(x);
+		result = mpfr_cmp_si(x, y.i);
+		break;
+	case V_DOUBLE:
+		*unordered = mpfr_nan_p(x) || isnan(y.d);
+		result = mpfr_cmp_d(x, y.d);
+		break;
+	case V_MPFR:
+		*unordered = mpfr_unordered_p(x, y.fr);
+		result = mpfr_cmp(x, y.fr);
+		break;
+	}
+	return result;
+}
+
+static int fr_cmp(lua_State *L)
+{
+	mpfr_ptr x;
+	int unordered;
+
+	x = _check_fr(L, 1);
+	lua_pushinteger(L, _cmp_value(L, x, 2, &unordered));
+	return 1;
+}
+
+static int fr_cmpabs(lua_State *L)
+{
+	mpfr_ptr x, y;
+
+	x = _check_fr(L, 1);
+	y = _check_fr(L, 2);
+	lua_pushinteger(L, mpfr_cmpabs(x, y));
+	return 1;
+}
+
+
+/* fr,fr -> bool */
+static int fr_fn2p(lua_State *L)
+{
+	int (*fn)(mpfr_srcptr, mpfr_srcptr);
+
+	fn = lua_touserdata(L, UV_FN(1));
+	lua_pushboolean(L, (*fn)(_check_fr(L, 1),
+		_check_fr(L, 2)));
+	return 1;
+}
+
+struct fn2p_reg {
+	const char *name;
+	int (*fn)(mpfr_srcptr, mpfr_srcptr);
+};
+
+static const struct fn2p_reg _fn2p_reg[] = {
+	FN(greater_p),
+	FN(greaterequal_p),
+	FN(less_p),
+	FN(lessequal_p),
+	FN(equal_p),
+	FN(lessgreater_p),
+	FN(unordered_p),
+	{0, 0}
+};
+
+static void _reg_fn2p(lua_State *L, const struct fn2p_reg *r)
+{
+	for (; r->name; r++) {
+		_push_upvals(L);
+		lua_pushlightuserdata(L, r->fn);
+		lua_pushcclosure(L, fr_fn2p, NUPVAL + 1);
+		lua_setfield(L, -2, r->name);
+	}
+}
+
+
+static int fr_fma(lua_State *L)
+{
+	return _ret(L, mpfr_fma(_check_fr(L, 1),
+		_check_fr(L, 2),
+		_check_fr(L, 3),
+		_check_fr(L, 4),
+		_opt_rnd(L, 5)));
+}
+
+static int fr_fms(lua_State *L)
+{
+	return _ret(L, mpfr_fms(_check_fr(L, 1),
+		_check_fr(L, 2),
+		_check_fr(L, 3),
+		_check_fr(L, 4),
+		_opt_rnd(L, 5)));
+}
+
+
+/*
+ * Metamethods.  The result is a new value whose precision is the largest
+ * precision among the mpfr_t operands (plain Lua numbers don't count),
+ * rounded with the default rounding mode.  They share the dispatch of
+ * the named methods, so mixed integer/double operands take the same
+ * mpfr_*_si / mpfr_*_d fast paths.
+ */
+static mpfr_prec_t _arith_prec(lua_State *L)
+{
+	mpfr_ptr x;
+	mpfr_prec_t prec = 0;
+	int i;
+
+	for (i = 1; i <= 2; i++) {
+		x = _test_fr(L, i);
+		if (x && mpfr_get_prec(x) > prec)
+			prec = mpfr_get_prec(x);
+	}
+	return prec;
+}
+
+/* replace the Lua number at index i by an mpfr_t holding it exactly */
+static void _arith_tofr(lua_State *L, int i)
+{
+	union value v;
+
+	switch (_check_value(L, i, &v)) {
+	case V_LONG:
+		mpfr_set_si(_fr_push(L, sizeof (long) * CHAR_BIT),
+			v.i, MPFR_RNDN);
+		break;
+	case V_DOUBLE:
+		mpfr_set_d(_fr_push(L, DBL_MANT_DIG), v.d, MPFR_RNDN);
+		break;
+	case V_MPFR:
+		return;
+	}
+	lua_replace(L, i);
+}
+
+/*
+ * Lua takes the metamethod of the first operand that has one, so that of
+ * mpfr_t also runs for an mpfr_t and an interval or a complex.  Those
+ * take mpfr_t operands: hand the call to their metamethod __name, and
+ * return whether there was one, its result being left at the top.  A
+ * NULL name is that of the _fn2_reg entry in the upvalues, looked up
+ * only here, off the common path.
+ */
+static int _arith_defer(lua_State *L, const char *name)
+{
+	const struct fn2_reg *r;
+	void *fn;
+	int mt;
+
+	if (lua_type(L, 2) != LUA_TUSERDATA || _test_fr(L, 2))
+		return 0;
+	if (_test_type(L, 2, UV_INTERVAL))
+		mt = UV_INTERVAL;
+	else if (_test_type(L, 2, UV_COMPLEX))
+		mt = UV_COMPLEX;
+	else
+		return 0;
+	if (!name) {
+		fn = lua_touserdata(L, UV_FN(1));
+		for (r = _fn2_reg; (void *) r->fr_fr != fn; r++)
+			;
+		name = r->name;
+	}
+	lua_pushfstring(L, "__%s", name);
+	if (lua_rawget(L, mt) == LUA_TNIL) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	lua_pushvalue(L, 1);
+	lua_pushvalue(L, 2);
+	lua_call(L, 2, 1);
+	return 1;
+}
+
+/* __add, __sub, __mul, __div: upvalues as in fr_fn2 */
+static int fr_arith2(lua_State *L)
+{
+	lua_settop(L, 2);
+	if (_arith_defer(L, NULL))
+		return 1;
+	_fr_push(L, _arith_prec(L));
+	lua_insert(L, 1);
+	return fr_fn2(L);
+}
+
+/* __idiv: upvalues of div */
+static int fr_arith_idiv(lua_State *L)
+{
+	mpfr_ptr z;
+
+	lua_settop(L, 2);
+	z = _fr_push(L, _arith_prec(L));
+	lua_insert(L, 1);
+	lua_pushinteger(L, MPFR_RNDD);
+	fr_fn2(L);
+	mpfr_rint_floor(z, z, MPFR_RNDD);
+	return 1;
+}
+
+static int fr_arith_pow(lua_State *L)
+{
+	mpfr_prec_t prec;
+	lua_Integer i;
+	int isint;
+
+	lua_settop(L, 2);
+	if (_arith_defer(L, "pow"))
+		return 1;
+	prec = _arith_prec(L);
+	/* fr_pow takes unsigned integer bases and integer exponents */
+	i = lua_tointegerx(L, 1, &isint);
+	if (isint ? i < 0 : !lua_isuserdata(L, 1))
+		_arith_tofr(L, 1);
+	lua_tointegerx(L, 2, &isint);
+	if (!isint)
+		_arith_tofr(L, 2);
+	_fr_push(L, prec);
+	lua_insert(L, 1);
+	return fr_pow(L);
+}
+
+/* __mod: like Lua, the result takes the sign of the divisor */
+static int fr_arith_mod(lua_State *L)
+{
+	mpfr_ptr x, y, z;
+	mpfr_rnd_t r;
+
+	lua_settop(L, 2);
+	z = _fr_push(L, _arith_prec(L));
+	_arith_tofr(L, 1);
+	_arith_tofr(L, 2);
+	x = _check_fr(L, 1);
+	y = _check_fr(L, 2);
+	r = _default_rnd;
+	mpfr_fmod(z, x, y, r);
+	if (mpfr_regular_p(z) && mpfr_signbit(z) != mpfr_signbit(y))
+		mpfr_add(z, z, y, r);
+	lua_settop(L, 3);
+	return 1;
+}
+
+static int fr_arith_unm(lua_State *L)
+{
+	mpfr_ptr x;
+
+	x = _check_fr(L, 1);
+	mpfr_neg(_fr_push(L, mpfr_get_prec(x)), x,
+		_default_rnd);
+	return 1;
+}
+
+/* Lua also calls __eq for another userdata on either side */
+static int fr_arith_eq(lua_State *L)
+{
+	mpfr_ptr x, y;
+
+	x = _test_fr(L, 1);
+	y = _test_fr(L, 2);
+	lua_pushboolean(L, x && y && mpfr_equal_p(x, y));
+	return 1;
+}
+
+/* compare the operands of __lt/__le, either of which may be a number */
+static int _arith_cmp(lua_State *L, int *unordered)
+{
+	mpfr_ptr x;
+
+	x = _test_fr(L, 1);
+	if (x)
+		return _cmp_value(L, x, 2, unordered);
+	x = _check_fr(L, 2);
+	return -_cmp_value(L, x, 1, unordered);
+}
+
+static int fr_arith_lt(lua_State *L)
+{
+	int c, unordered;
+
+	c = _arith_cmp(L, &unordered);
+	lua_pushboolean(L, !unordered && c < 0);
+	return 1;
+}
+
+static int fr_arith_le(lua_State *L)
+{
+	int c, unordered;
+
+	c = _arith_cmp(L, &unordered);
+	lua_pushboolean(L, !unordered && c <= 0);
+	return 1;
+}
+
+/* metamethods sharing the upvalues of a _fn2_reg entry */
+static const struct {
+	const char *meta;
+	const char *name;
+	lua_CFunction fn;
+} _meta2_reg[] = {
+	{"__add", "add", fr_arith2},
+	{"__sub", "sub", fr_arith2},
+	{"__mul", "mul", fr_arith2},
+	{"__div", "div", fr_arith2},
+	{"__idiv", "div", fr_arith_idiv},
+	{0, 0, 0}
+};
+
+static void _reg_meta2(lua_State *L, const struct fn2_reg *reg)
+{
+	const struct fn2_reg *r;
+	int i;
+
+	for (i = 0; _meta2_reg[i].meta; i++) {
+		for (r = reg; strcmp(r->name, _meta2_reg[i].name); r++)
+			;
+		_push_fn2(L, r, _meta2_reg[i].fn);
+		lua_setfield(L, -2, _meta2_reg[i].meta);
+	}
+}
+
+
+static int fr_prec_round(lua_State *L)
+{
+	mpfr_ptr z;
+	mpfr_prec_t prec, oldprec;
+	mpfr_rnd_t r;
+	int inex = 0;
+
+	z = _check_fr(L, 1);
+	prec = _check_prec(L, 2);
+	r = _opt_rnd(L, 3);
+	oldprec = mpfr_get_prec(z);
+	if (mpfr_custom_get_size(prec) <= mpfr_custom_get_size(oldprec)) {
+		/* no more limbs needed, so mpfr_prec_round won't realloc */
+		inex = mpfr_prec_round(z, prec, r);
+	} else if (prec <= ((struct fr *) z)->cap) {
+		mpfr_t t;
+
+		_pool_get(L, t, oldprec);
+		mpfr_set(t, z, MPFR_RNDN);
+		_fr_resize(L, 1, z, prec);	/* in place: doesn't raise */
+		mpfr_set(z, t, r);	/* exact: more precision */
+		_pool_put(t);
+	} else {
+		size_t sz = mpfr_custom_get_size(prec);
+		mpfr_t t;
+
+		/* new limbs first, as allocating may raise */
+		_fr_init(t, prec, lua_newuserdata(L, sz));
+		mpfr_set(t, z, r);	/* exact: more precision */
+		mpfr_swap(z, t);
+		lua_setuservalue(L, 1);
+		((struct fr *) z)->cap = sz * CHAR_BIT;
+	}
+	return _ret(L, inex);
+}
+
+static int fr_can_round(lua_State *L)
+{
+	lua_pushboolean(L, mpfr_can_round(
+		_check_fr(L, 1),	/* z */
+		luaL_checkinteger(L, 2),	/* err */
+		luaL_checkinteger(L, 3),	/* r1 */
+		luaL_checkinteger(L, 4),	/* r2 */
+		_check_prec(L, 5)));		/* prec */
+	return 1;
+}
+
+
+static int fr_set_prec(lua_State *L)
+{
+	_fr_resize(L, 1, _check_fr(L, 1), _check_prec(L, 2));
+	return 0;
+}
+
+static int fr_get_prec(lua_State *L)
+{
+	mpfr_ptr z;
+
+	z = _check_fr(L, 1);
+	lua_pushinteger(L, mpfr_get_prec(z));
+	return 1;
+}
+
+static int fr_min_prec(lua_State *L)
+{
+	lua_pushinteger(L, mpfr_min_prec(_check_fr(L, 1)));
+	return 1;
+}
+
+static int fr_copysign(lua_State *L)
+{
+	mpfr_ptr x, y, z;
+	mpfr_rnd_t r;
+
+	z = _check_fr(L, 1);
+	x = _check_fr(L, 2);
+	y = _check_fr(L, 3);
+	r = _opt_rnd(L, 4);
+
+	return _ret(L, mpfr_copysign(z, x, y, r));
+}
+
+
+static int fr_free_cache(lua_State *L)
+{
+	mpfr_free_cache();
+	if (_workers.nthreads)
+		_workers_run(_workers.nthreads + 1, _job_free_cache, NULL);
+	pthread_mutex_lock(&_pool.lock);
+	_pool_drain();
+	pthread_mutex_unlock(&_pool.lock);
+	return 0;
+}
+
+static int fr_set_default_prec(lua_State *L)
+{
+	mpfr_set_default_prec(_check_prec(L, 1));
+	return 0;
+}
+
+static int fr_get_default_prec(lua_State *L)
+{
+	lua_pushinteger(L, mpfr_get_default_prec());
+	return 1;
+}
+
+static int fr_set_default_rounding_mode(lua_State *L)
+{
+	mpfr_rnd_t r;
+
+	/* checked first: MPFR ignores an invalid mode without telling */
+	r = _check_rnd(L, 1);
+	mpfr_set_default_rounding_mode(r);
+	_default_rnd = r;
+	return 0;
+}
+
+static int fr_get_default_rounding_mode(lua_State *L)
+{
+	lua_pushinteger(L, mpfr_get_default_rounding_mode());
+	return 1;
+}
+
+/*
+ * last_ternary() : integer.  The ternary value of the last binding that
+ * rounded a result on this thread: a query rather than an extra result,
+ * so that a call passed as the last argument of another never fills in
+ * its options.
+ */
+static int fr_last_ternary(lua_State *L)
+{
+	lua_pushinteger(L, _ternary);
+	return 1;
+}
+
+/* flags([mask]) : the exception flags raised, of those in mask */
+static int fr_flags(lua_State *L)
+{
+	lua_pushinteger(L, _flags_save() &
+		luaL_optinteger(L, 1, MPFR_FLAGS_ALL));
+	return 1;
+}
+
+/* clear_flags([mask]) */
+static int fr_clear_flags(lua_State *L)
+{
+	_flags_clear(luaL_optinteger(L, 1, MPFR_FLAGS_ALL));
+	return 0;
+}
+
+/*
+ * Vectors hold n values of the same precision in one userdata: the n
+ * headers, then one slab with the limbs of all of them.  The methods
+ * work elementwise in a single call; an operand may be a vector of the
+ * same length, or a scalar (mpfr_t or number) used for every element.
+ */
+struct vec {
+	size_t n;
+	mpfr_prec_t prec;
+	__mpfr_struct x[];	/* limbs follow */
+};
+
+static struct vec *_check_vec(lua_State *L, int i)
+{
+	struct vec *v;
+
+	v = _test_type(L, i, UV_VECTOR);
+	if (!v)
+		_type_error(L, i, VECTOR);
+	return v;
+}
+
+static struct vec *_vec_new(lua_State *L, size_t n, mpfr_prec_t prec)
+{
+	struct vec *v;
+	size_t sz, k;
+	char *limbs;
+
+	sz = mpfr_custom_get_size(prec);
+	if (n > (((size_t) -1) - sizeof (*v)) / (sizeof (v->x[0]) + sz))
+		luaL_error(L, "vector too large");
+	v = lua_newuserdata(L, sizeof (*v) + n * (sizeof (v->x[0]) + sz));
+	v->n = n;
+	v->prec = prec;
+	limbs = (char *) (v->x + n);
+	for (k = 0; k < n; k++)
+		_fr_init(&v->x[k], prec, limbs + k * sz);
+	return v;
+}
+
+static struct vec *_vec_push(lua_State *L, size_t n, mpfr_prec_t prec)
+{
+	struct vec *v;
+
+	v = _vec_new(L, n, prec);
+	lua_pushvalue(L, UV_VECTOR);
+	lua_setmetatable(L, -2);
+	return v;
+}
+
+/* vector(n, [prec]) : mpfr_vector */
+static int vec_new(lua_State *L)
+{
+	lua_Integer n;
+	mpfr_prec_t prec;
+
+	n = luaL_checkinteger(L, 1);
+	luaL_argcheck(L, n >= 0, 1, "size must be non-negative");
+	if (lua_isnoneornil(L, 2))
+		prec = mpfr_get_default_prec();
+	else
+		prec = _check_prec(L, 2);
+	_vec_push(L, n, prec);
+	return 1;
+}
+
+/*
+ * operand i of an elementwise operation on n elements: a number, or
+ * element k is (v->fr + k * *stride), stride being 0 for a scalar.
+ */
+static int _vec_value(lua_State *L, int i, size_t n, union value *v,
+	size_t *stride)
+{
+	struct vec *x;
+
+	*stride = 0;
+	if (!lua_isnumber(L, i) && (x = _test_type(L, i, UV_VECTOR))) {
+		luaL_argcheck(L, x->n == n, i, "vector sizes differ");
+		v->fr = x->x;
+		*stride = 1;
+		return V_MPFR;
+	}
+	return _check_value(L, i, v);
+}
+
+static mpfr_ptr _vec_check_fr(lua_State *L, int i, size_t n, size_t *stride)
+{
+	union value v;
+
+	if (_vec_value(L, i, n, &v, stride) != V_MPFR)
+		_type_error(L, i, VECTOR);
+	return v.fr;
+}
+
+static size_t _vec_index(lua_State *L, struct vec *v, int i)
+{
+	lua_Integer k;
+
+	k = luaL_checkinteger(L, i);
+	luaL_argcheck(L, 1 <= k && (lua_Unsigned) k <= v->n, i,
+		"index out of range");
+	return k - 1;
+}
+
+/* get(self, i) : mpfr_t
+ * get(self, i, z, [rnd]) : z
+ */
+static int vec_get(lua_State *L)
+{
+	struct vec *v;
+	mpfr_ptr x;
+
+	v = _check_vec(L, 1);
+	x = &v->x[_vec_index(L, v, 2)];
+	if (lua_isnoneornil(L, 3)) {
+		mpfr_set(_fr_push(L, v->prec), x, MPFR_RNDN);
+	} else {
+		mpfr_set(_check_fr(L, 3), x, _opt_rnd(L, 4));
+		lua_settop(L, 3);
+	}
+	return 1;
+}
+
+/* set(self, i, number|mpfr_t, [rnd]) */
+static int vec_set(lua_State *L)
+{
+	struct vec *v;
+	mpfr_ptr z;
+	union value x;
+	mpfr_rnd_t r;
+
+	v = _check_vec(L, 1);
+	z = &v->x[_vec_index(L, v, 2)];
+	r = _opt_rnd(L, 4);
+	switch (_check_value(L, 3, &x)) {
+	case V_LONG:
+		mpfr_set_si(z, x.i, r);
+		break;
+	case V_DOUBLE:
+		mpfr_set_d(z, x.d, r);
+		break;
+	case V_MPFR:
+		mpfr_set(z, x.fr, r);
+		break;
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int vec_len(lua_State *L)
+{
+	lua_pushinteger(L, _check_vec(L, 1)->n);
+	return 1;
+}
+
+static int vec_get_prec(lua_State *L)
+{
+	lua_pushinteger(L, _check_vec(L, 1)->prec);
+	return 1;
+}
+
+static int vec_tostring(lua_State *L)
+{
+	struct vec *v;
+
+	v = _check_vec(L, 1);
+	lua_pushfstring(L, "%s(%I, %I)", VECTOR,
+		(lua_Integer) v->n, (lua_Integer) v->prec);
+	return 1;
+}
+
+/* fn1 elementwise: self[k] = fn(x[k]) */
+static int vec_fn1(lua_State *L)
+{
+	int (*fn)(mpfr_ptr, mpfr_srcptr, mpfr_rnd_t);
+	struct vec *z;
+	mpfr_ptr x;
+	size_t xs, k;
+	mpfr_rnd_t r;
+
+	fn = lua_touserdata(L, UV_FN(1));
+	z = _check_vec(L, 1);
+	x = _vec_check_fr(L, 2, z->n, &xs);
+	r = _opt_rnd(L, 3);
+	for (k = 0; k < z->n; k++)
+		(*fn)(&z->x[k], x + k * xs, r);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* fn2 elementwise, upvalues as in fr_fn2 */
+static int vec_fn2(lua_State *L)
+{
+	union {
+		int (*fr_fr)(mpfr_ptr, mpfr_srcptr, mpfr_srcptr, mpfr_rnd_t);
+		int (*fr_si)(mpfr_ptr, mpfr_srcptr, long, mpfr_rnd_t);
+		int (*fr_d)(mpfr_ptr, mpfr_srcptr, double, mpfr_rnd_t);
+		int (*si_fr)(mpfr_ptr, long, mpfr_srcptr, mpfr_rnd_t);
+		int (*d_fr)(mpfr_ptr, double, mpfr_srcptr, mpfr_rnd_t);
+	} fn;
+	struct vec *v;
+	mpfr_ptr z;
+	mpfr_rnd_t r;
+	int xtype, ytype;
+	union value x, y;
+	size_t xs, ys, k, n;
+
+	v = _check_vec(L, 1);
+	z = v->x;
+	n = v->n;
+	xtype = _vec_value(L, 2, n, &x, &xs);
+	ytype = _vec_value(L, 3, n, &y, &ys);
+	r = _opt_rnd(L, 4);
+
+	if (xtype == V_MPFR) {
+		switch (ytype) {
+		case V_LONG:
+			fn.fr_si = lua_touserdata(L, UV_FN(2));
+			for (k = 0; k < n; k++)
+				(*fn.fr_si)(z + k, x.fr + k * xs, y.i, r);
+			break;
+		case V_DOUBLE:
+			fn.fr_d = lua_touserdata(L, UV_FN(3));
+			for (k = 0; k < n; k++)
+				(*fn.fr_d)(z + k, x.fr + k * xs, y.d, r);
+			break;
+		case V_MPFR:
+			fn.fr_fr = lua_touserdata(L, UV_FN(1));
+			for (k = 0; k < n; k++)
+				(*fn.fr_fr)(z + k, x.fr + k * xs,
+					y.fr + k * ys, r);
+			break;
+		}
+	} else {
+		if (ytype != V_MPFR)
+			_type_error(L, 3, VECTOR);
+		switch (xtype) {
+		case V_LONG:
+			fn.si_fr = lua_touserdata(L, UV_FN(4));
+			if (fn.si_fr) {
+				for (k = 0; k < n; k++)
+					(*fn.si_fr)(z + k, x.i,
+						y.fr + k * ys, r);
+			} else {
+				fn.fr_si = lua_touserdata(L, UV_FN(2));
+				for (k = 0; k < n; k++)
+					(*fn.fr_si)(z + k, y.fr + k * ys,
+						x.i, r);
+			}
+			break;
+		case V_DOUBLE:
+			fn.d_fr = lua_touserdata(L, UV_FN(5));
+			if (fn.d_fr) {
+				for (k = 0; k < n; k++)
+					(*fn.d_fr)(z + k, x.d,
+						y.fr + k * ys, r);
+			} else {
+				fn.fr_d = lua_touserdata(L, UV_FN(3));
+				for (k = 0; k < n; k++)
+					(*fn.fr_d)(z + k, y.fr + k * ys,
+						x.d, r);
+			}
+			break;
+		}
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* fma(self, a, b, c, [rnd]): self[k] = a[k] * b[k] + c[k] */
+static int vec_fma(lua_State *L)
+{
+	struct vec *v;
+	mpfr_ptr a, b, c;
+	size_t as, bs, cs, k;
+	mpfr_rnd_t r;
+
+	v = _check_vec(L, 1);
+	a = _vec_check_fr(L, 2, v->n, &as);
+	b = _vec_check_fr(L, 3, v->n, &bs);
+	c = _vec_check_fr(L, 4, v->n, &cs);
+	r = _opt_rnd(L, 5);
+	for (k = 0; k < v->n; k++)
+		mpfr_fma(&v->x[k], a + k * as, b + k * bs, c + k * cs, r);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/*
+ * parallel_map(fname, dst, src, [rnd], [opts]): dst[k] = fname(src[k])
+ * for a function of _fn1_reg, split across worker threads.  Elements
+ * are handed out in small chunks, since the cost of special functions
+ * varies a lot with the argument.
+ */
+struct map_job {
+	int (*fn)(mpfr_ptr, mpfr_srcptr, mpfr_rnd_t);
+	mpfr_ptr z, x;
+	size_t xs, n, chunk;
+	size_t next;		/* first element not handed out yet */
+	pthread_mutex_t lock;
+	mpfr_rnd_t r;
+};
+
+static void _job_map(void *arg, int id)
+{
+	struct map_job *j = arg;
+	size_t k, end;
+
+	for (;;) {
+		pthread_mutex_lock(&j->lock);
+		k = j->next;
+		end = (j->n - k > j->chunk) ? k + j->chunk : j->n;
+		j->next = end;
+		pthread_mutex_unlock(&j->lock);
+		if (k == end)
+			break;
+		for (; k < end; k++)
+			(*j->fn)(j->z + k, j->x + k * j->xs, j->r);
+	}
+}
+
+static int vec_parallel_map(lua_State *L)
+{
+	const struct fn1_reg *f;
+	const char *name;
+	struct vec *v;
+	struct map_job j;
+	int nthreads;
+
+	name = luaL_checkstring(L, 1);
+	for (f = _fn1_reg; f->name && strcmp(f->name, name); f++)
+		;
+	luaL_argcheck(L, f->name, 1, "not a one-argument function");
+	v = _check_vec(L, 2);
+	j.fn = f->fn;
+	j.z = v->x;
+	j.n = v->n;
+	j.x = _vec_check_fr(L, 3, v->n, &j.xs);
+	j.r = _opt_rnd(L, 4);
+	nthreads = _opt_threads(L, 5);
+	j.next = 0;
+	j.chunk = j.n / ((size_t) nthreads * 16) + 1;
+	pthread_mutex_init(&j.lock, NULL);
+	_workers_run(nthreads, _job_map, &j);
+	pthread_mutex_destroy(&j.lock);
+	lua_settop(L, 2);
+	return 1;
+}
+
+/*
+ * elements of the table of mpfr_t or vector at index i, as an array of
+ * pointers held in a new userdata on the stack
+ */
+static mpfr_ptr *_check_elts(lua_State *L, int i, size_t *n)
+{
+	struct vec *v;
+	mpfr_ptr *p;
+	size_t k;
+
+	v = _test_type(L, i, UV_VECTOR);
+	if (v) {
+		*n = v->n;
+		p = lua_newuserdata(L, *n * sizeof (*p));
+		for (k = 0; k < *n; k++)
+			p[k] = &v->x[k];
+		return p;
+	}
+	if (!lua_istable(L, i))
+		_type_error(L, i, VECTOR);
+	*n = lua_rawlen(L, i);
+	if (*n > SIZE_MAX / sizeof (*p))
+		luaL_error(L, "not enough memory");
+	p = lua_newuserdata(L, *n * sizeof (*p));
+	for (k = 0; k < *n; k++) {
+		lua_rawgeti(L, i, k + 1);
+		p[k] = _test_fr(L, -1);
+		if (!p[k])
+			luaL_argerror(L, i, lua_pushfstring(L,
+				"%s expected at index %I", MPFR,
+				(lua_Integer) k + 1));
+		lua_pop(L, 1);	/* still referenced by the table */
+	}
+	return p;
+}
+
+/* sum(dst, list, [rnd]): correctly rounded sum of all elements */
+static int fr_sum(lua_State *L)
+{
+	mpfr_ptr z, *x;
+	mpfr_rnd_t r;
+	size_t n;
+
+	z = _check_fr(L, 1);
+	x = _check_elts(L, 2, &n);
+	r = _opt_rnd(L, 3);
+	return _ret(L, mpfr_sum(z, x, n, r));
+}
+
+/* dot(dst, a, b, [rnd]): correctly rounded sum of a[k] * b[k] */
+static int fr_dot(lua_State *L)
+{
+	mpfr_ptr z, *a, *b;
+	mpfr_rnd_t r;
+	size_t n, nb;
+	int t;
+
+	z = _check_fr(L, 1);
+	a = _check_elts(L, 2, &n);
+	b = _check_elts(L, 3, &nb);
+	luaL_argcheck(L, n == nb, 3, "sizes differ");
+	r = _opt_rnd(L, 4);
+#if MPFR_VERSION >= MPFR_VERSION_NUM(4,1,0)
+	t = mpfr_dot(z, a, b, n, r);
+#else
+	{
+		/* exact products in one slab, then mpfr_sum, all in the
+		 * widest exponent range so that no product overflows */
+		mpfr_ptr prod;
+		mpfr_prec_t prec;
+		mpfr_exp_t emin, emax;
+		size_t k, sz, total = 0;
+		char *limbs;
+
+		for (k = 0; k < n; k++) {
+			if (mpfr_get_prec(a[k]) > MPFR_PREC_MAX -
+					mpfr_get_prec(b[k]))
+				return luaL_error(L, "dot: product too wide");
+			sz = mpfr_custom_get_size(mpfr_get_prec(a[k]) +
+				mpfr_get_prec(b[k]));
+			if (sz > SIZE_MAX - total)
+				return luaL_error(L, "not enough memory");
+			total += sz;
+		}
+		if (n > (SIZE_MAX - total) / sizeof (*prod))
+			return luaL_error(L, "not enough memory");
+		prod = lua_newuserdata(L, n * sizeof (*prod) + total);
+		limbs = (char *) (prod + n);
+		emin = mpfr_get_emin();
+		emax = mpfr_get_emax();
+		mpfr_set_emin(mpfr_get_emin_min());
+		mpfr_set_emax(mpfr_get_emax_max());
+		for (k = 0; k < n; k++) {
+			prec = mpfr_get_prec(a[k]) + mpfr_get_prec(b[k]);
+			_fr_init(&prod[k], prec, limbs);
+			limbs += mpfr_custom_get_size(prec);
+			mpfr_mul(&prod[k], a[k], b[k], MPFR_RNDN);
+			a[k] = &prod[k];	/* reuse a as the pointer array */
+		}
+		t = mpfr_sum(z, a, n, r);
+		mpfr_set_emin(emin);
+		mpfr_set_emax(emax);
+		t = mpfr_check_range(z, t, r);
+	}
+#endif
+	return _ret(L, t);
+}
+
+/*
+ * format and write.  Elements are formatted in rounds; each round is
+ * cut into slices formatted by the worker threads into buffers kept for
+ * the next round, then copied out in order, so no Lua string is made
+ * per element.
+ */
+#define FMT_ROUND	4096	/* elements per slice and round */
+
+struct fmt_out {
+	char *buf;
+	size_t len, cap;
+};
+
+struct fmt_job {
+	struct vec *v;
+	int b;
+	size_t n;		/* digits, 0 for enough */
+	mpfr_rnd_t r;
+	const char *fmt;	/* mpfr_snprintf format, or NULL */
+	const char *sep;
+	size_t seplen;
+	size_t lo, hi;		/* the round */
+	int nslices, next, failed;
+	pthread_mutex_t lock;
+	struct fmt_out out[MAX_THREADS];
+};
+
+/* z as tostring() writes it, into s of at least _fmt_size() bytes */
+static size_t _fmt_fr(char *s, mpfr_ptr z, int b, size_t n, mpfr_rnd_t r)
+{
+	char *p, *q;
+	mpfr_exp_t e;
+	size_t len;
+
+	if (!mpfr_number_p(z)) {
+		mpfr_get_str(s, &e, b, n, z, r);
+		return strlen(s);
+	}
+	if (mpfr_zero_p(z)) {
+		strcpy(s, mpfr_signbit(z) ? "-0" : "0");
+		return strlen(s);
+	}
+	q = s;
+	p = s + 1;
+	mpfr_get_str(p, &e, b, n, z, r);
+	len = strlen(p) + 1;
+	if (*p == '-')
+		*q++ = *p++;
+	q[0] = *p;
+	q[1] = '.';
+	if (--e)
+		len += sprintf(s + len, "%c%ld", b > 10 ? '@' : 'e', (long) e);
+	return len;
+}
+
+static size_t _fmt_size(mpfr_ptr z, int b, size_t n)
+{
+	return _outbufsize(z, b, n) + 1 + 2 + 3 * sizeof (long);
+}
+
+/* whether f has exactly one conversion, and that for an mpfr_t */
+static int _check_fmt(const char *f)
+{
+	int n = 0;
+
+	while ((f = strchr(f, '%')) != NULL) {
+		f++;
+		if (*f == '%') {
+			f++;
+			continue;
+		}
+		f += strspn(f, "-+ #0'");
+		f += strspn(f, "0123456789");
+		if (*f == '.') {
+			f++;
+			f += strspn(f, "0123456789");
+		}
+		if (*f++ != 'R')
+			return 0;
+		if (*f && strchr("NZUDY", *f))
+			f++;
+		if (!*f || !strchr("aAbeEfFgG", *f))
+			return 0;
+		f++;
+		n++;
+	}
+	return n == 1;
+}
+
+static int _fmt_reserve(struct fmt_out *o, size_t sz)
+{
+	char *p;
+	size_t cap;
+
+	if (o->len + sz <= o->cap)
+		return 1;
+	cap = o->cap ? o->cap : 4096;
+	while (cap < o->len + sz)
+		cap *= 2;
+	p = realloc(o->buf, cap);
+	if (!p)
+		return 0;
+	o->buf = p;
+	o->cap = cap;
+	return 1;
+}
+
+static void _fmt_slice(struct fmt_job *j, int s)
+{
+	struct fmt_out *o = &j->out[s];
+	size_t k, lo, hi, sz;
+	mpfr_ptr z;
+	int len;
+
+	lo = j->lo + (j->hi - j->lo) * s / j->nslices;
+	hi = j->lo + (j->hi - j->lo) * (s + 1) / j->nslices;
+	o->len = 0;
+	for (k = lo; k < hi; k++) {
+		z = &j->v->x[k];
+		sz = j->seplen + (j->fmt ? (size_t) mpfr_snprintf(NULL, 0,
+			j->fmt, z) + 1 : _fmt_size(z, j->b, j->n));
+		if (!_fmt_reserve(o, sz)) {
+			j->failed = 1;
+			return;
+		}
+		if (k) {
+			memcpy(o->buf + o->len, j->sep, j->seplen);
+			o->len += j->seplen;
+		}
+		if (j->fmt) {
+			len = mpfr_snprintf(o->buf + o->len, sz, j->fmt, z);
+			o->len += len;
+		} else {
+			o->len += _fmt_fr(o->buf + o->len, z, j->b, j->n, j->r);
+		}
+	}
+}
+
+static void _job_fmt(void *arg, int id)
+{
+	struct fmt_job *j = arg;
+	int s;
+
+	for (;;) {
+		pthread_mutex_lock(&j->lock);
+		s = j->next++;
+		pthread_mutex_unlock(&j->lock);
+		if (s >= j->nslices)
+			break;
+		_fmt_slice(j, s);
+	}
+}
+
+/* options at index i; the job lives in a userdata left on the stack */
+static struct fmt_job *_fmt_begin(lua_State *L, int i, int *nthreads)
+{
+	struct fmt_job *j;
+
+	j = lua_newuserdata(L, sizeof (*j));
+	memset(j, 0, sizeof (*j));
+	j->v = _check_vec(L, 1);
+	j->b = 10;
+	j->r = _default_rnd;
+	j->sep = "\n";
+	j->seplen = 1;
+	if (!lua_isnoneornil(L, i)) {
+		luaL_checktype(L, i, LUA_TTABLE);
+		if (lua_getfield(L, i, "base") != LUA_TNIL)
+			j->b = _opt_base(L, -1);
+		if (lua_getfield(L, i, "sep") != LUA_TNIL)
+			j->sep = luaL_checklstring(L, -1, &j->seplen);
+		if (lua_getfield(L, i, "fmt") != LUA_TNIL) {
+			j->fmt = luaL_checkstring(L, -1);
+			luaL_argcheck(L, _check_fmt(j->fmt), i,
+				"fmt must have one conversion such as %.20Rg");
+		}
+		if (lua_getfield(L, i, "rnd") != LUA_TNIL)
+			j->r = _opt_rnd(L, -1);
+		lua_pop(L, 4);	/* the strings are still in the table */
+		j->n = _opt_field(L, i, "digits", 0, 0);
+	}
+	*nthreads = _opt_threads(L, i);
+	if ((size_t) *nthreads > j->v->n / FMT_ROUND + 1)
+		*nthreads = j->v->n / FMT_ROUND + 1;
+	pthread_mutex_init(&j->lock, NULL);
+	return j;
+}
+
+/* format the next round; false when done */
+static int _fmt_round(lua_State *L, struct fmt_job *j, int nthreads)
+{
+	int s;
+
+	j->lo = j->hi;
+	if (j->lo == j->v->n)
+		return 0;
+	j->hi = j->v->n - j->lo > (size_t) nthreads * FMT_ROUND ?
+		j->lo + (size_t) nthreads * FMT_ROUND : j->v->n;
+	j->nslices = nthreads;
+	j->next = 0;
+	_workers_run(nthreads, _job_fmt, j);
+	if (j->failed) {
+		for (s = 0; s < nthreads; s++)
+			free(j->out[s].buf);
+		pthread_mutex_destroy(&j->lock);
+		luaL_error(L, "not enough memory");
+	}
+	return 1;
+}
+
+static void _fmt_end(struct fmt_job *j, int nthreads)
+{
+	int s;
+
+	for (s = 0; s < nthreads; s++)
+		free(j->out[s].buf);
+	pthread_mutex_destroy(&j->lock);
+}
+
+/* format(self, [opts]) : string
+ * opts are base, digits, sep (default "\n"), fmt (an mpfr_printf format
+ * used instead), rnd and threads
+ */
+static int vec_format(lua_State *L)
+{
+	struct fmt_job *j;
+	luaL_Buffer B;
+	int nthreads, s;
+
+	j = _fmt_begin(L, 2, &nthreads);
+	luaL_buffinit(L, &B);
+	while (_fmt_round(L, j, nthreads))
+		for (s = 0; s < j->nslices; s++)
+			luaL_addlstring(&B, j->out[s].buf, j->out[s].len);
+	_fmt_end(j, nthreads);
+	luaL_pushresult(&B);
+	return 1;
+}
+
+/* write(self, file, [opts]) : self, with the options of format */
+static int vec_write(lua_State *L)
+{
+	struct fmt_job *j;
+	luaL_Stream *f;
+	int nthreads, s, err = 0;
+
+	f = luaL_checkudata(L, 2, LUA_FILEHANDLE);
+	luaL_argcheck(L, f->closef, 2, "attempt to use a closed file");
+	j = _fmt_begin(L, 3, &nthreads);
+	while (!err && _fmt_round(L, j, nthreads))
+		for (s = 0; s < j->nslices && !err; s++)
+			err = fwrite(j->out[s].buf, 1, j->out[s].len, f->f) !=
+				j->out[s].len;
+	_fmt_end(j, nthreads);
+	if (err)
+		return luaL_error(L, "%s", strerror(errno));
+	lua_settop(L, 1);
+	return 1;
+}
+
+static const luaL_Reg _vec_reg[] =
+{
+	{"__len", vec_len},
+	{"__tostring", vec_tostring},
+	{"get", vec_get},
+	{"set", vec_set},
+	{"get_prec", vec_get_prec},
+	{"fma", vec_fma},
+	{"format", vec_format},
+	{"write", vec_write},
+	{0, 0},
+};
+
+static void _open_vector(lua_State *L)
+{
+	luaL_getmetatable(L, VECTOR);
+	_push_upvals(L);
+	luaL_setfuncs(L, _vec_reg, NUPVAL);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	_reg_fn1(L, _fn1_reg, vec_fn1);
+	_reg_fn2(L, _fn2_reg, vec_fn2);
+	lua_pop(L, 1);
+}
+
+
+/*
+ * parse_many.  The text is cut into chunks at separators, the tokens of
+ * each chunk are counted, and then each chunk is parsed straight into
+ * its slice of the vector; both passes run on the worker threads.
+ */
+#define PARSE_CHUNKS	256
+#define PARSE_MIN	65536	/* bytes per chunk worth a thread */
+
+struct parse_job {
+	const char *s;
+	unsigned char sep[256];
+	int base;
+	mpfr_rnd_t r;
+	mpfr_ptr x;
+	int pass;		/* 0 to count, 1 to parse */
+	int nchunks, next;
+	pthread_mutex_t lock;
+	size_t start[PARSE_CHUNKS + 1];
+	size_t count[PARSE_CHUNKS];	/* tokens in a chunk */
+	size_t first[PARSE_CHUNKS + 1];	/* index of its first token */
+	size_t bad[PARSE_CHUNKS];	/* offset of its first bad token */
+};
+
+static void _parse_chunk(struct parse_job *j, int c)
+{
+	const char *s = j->s, *end, *tok;
+	size_t i = j->start[c], e = j->start[c + 1];
+	size_t k = j->pass ? j->first[c] : 0;
+	char *stop;
+
+	for (;;) {
+		while (i < e && j->sep[(unsigned char) s[i]])
+			i++;
+		if (i == e)
+			break;
+		tok = s + i;
+		while (i < e && !j->sep[(unsigned char) s[i]])
+			i++;
+		if (j->pass == 0) {
+			k++;
+			continue;
+		}
+		end = s + i;
+		mpfr_strtofr(&j->x[k++], tok, &stop, j->base, j->r);
+		if (stop != end) {
+			j->bad[c] = tok - s;
+			break;
+		}
+	}
+	if (j->pass == 0)
+		j->count[c] = k;
+}
+
+static void _job_parse(void *arg, int id)
+{
+	struct parse_job *j = arg;
+	int c;
+
+	for (;;) {
+		pthread_mutex_lock(&j->lock);
+		c = j->next++;
+		pthread_mutex_unlock(&j->lock);
+		if (c >= j->nchunks)
+			break;
+		_parse_chunk(j, c);
+	}
+}
+
+/* the text to parse at index i: a string, or all that is left of a file
+ * read into a string left on the stack
+ */
+static const char *_parse_text(lua_State *L, int i, size_t *len)
+{
+	luaL_Stream *f;
+	luaL_Buffer B;
+	size_t n;
+
+	if (lua_type(L, i) == LUA_TSTRING)
+		return lua_tolstring(L, i, len);
+	f = luaL_testudata(L, i, LUA_FILEHANDLE);
+	luaL_argcheck(L, f && f->closef, i, "string or open file expected");
+	luaL_buffinit(L, &B);
+	do {
+		n = fread(luaL_prepbuffer(&B), 1, LUAL_BUFFERSIZE, f->f);
+		luaL_addsize(&B, n);
+	} while (n == LUAL_BUFFERSIZE);
+	if (ferror(f->f))
+		luaL_error(L, "%s", strerror(errno));
+	luaL_pushresult(&B);
+	return lua_tolstring(L, -1, len);
+}
+
+/* parse_many(text, [opts]) : vector
+ * or nil, message and the offset of the first bad token.  text is a
+ * string or a file; opts are base, sep (characters separating numbers
+ * besides white space), prec, rnd and threads.
+ */
+static int fr_parse_many(lua_State *L)
+{
+	struct parse_job *j;
+	struct vec *v;
+	const char *s, *sep = "";
+	size_t len, k, bad;
+	mpfr_prec_t prec;
+	int nthreads, c;
+
+	lua_settop(L, 2);
+	j = lua_newuserdata(L, sizeof (*j));	/* 3 */
+	j->base = 10;
+	j->r = _default_rnd;
+	prec = mpfr_get_default_prec();
+	if (!lua_isnil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		if (lua_getfield(L, 2, "base") != LUA_TNIL)
+			j->base = _opt_base(L, -1);
+		if (lua_getfield(L, 2, "sep") != LUA_TNIL)
+			sep = luaL_checkstring(L, -1);
+		if (lua_getfield(L, 2, "prec") != LUA_TNIL)
+			prec = _check_prec(L, -1);
+		if (lua_getfield(L, 2, "rnd") != LUA_TNIL)
+			j->r = _opt_rnd(L, -1);
+		lua_pop(L, 4);	/* sep is still referenced by opts */
+	}
+	nthreads = _opt_threads(L, 2);
+	lua_settop(L, 3);
+	s = _parse_text(L, 1, &len);	/* maybe 4 */
+	j->s = s;
+	memset(j->sep, 0, sizeof j->sep);
+	for (; *sep; sep++)
+		j->sep[(unsigned char) *sep] = 1;
+	j->sep[' '] = j->sep['\t'] = j->sep['\n'] = 1;
+	j->sep['\r'] = j->sep['\f'] = j->sep['\v'] = j->sep[0] = 1;
+
+	j->nchunks = len / PARSE_MIN + 1;
+	if (j->nchunks > PARSE_CHUNKS)
+		j->nchunks = PARSE_CHUNKS;
+	if (nthreads > j->nchunks)
+		nthreads = j->nchunks;
+	/* cut at separators, so no token straddles two chunks */
+	j->start[0] = 0;
+	for (c = 1; c <= j->nchunks; c++) {
+		k = c == j->nchunks ? len : len / j->nchunks * c;
+		if (k < j->start[c - 1])
+			k = j->start[c - 1];
+		while (k < len && !j->sep[(unsigned char) s[k]])
+			k++;
+		j->start[c] = k;
+		j->bad[c - 1] = (size_t) -1;
+	}
+	pthread_mutex_init(&j->lock, NULL);
+	for (j->pass = 0; j->pass < 2; j->pass++) {
+		if (j->pass == 1) {
+			j->first[0] = 0;
+			for (c = 0; c < j->nchunks; c++)
+				j->first[c + 1] = j->first[c] + j->count[c];
+			v = _vec_push(L, j->first[j->nchunks], prec);
+			j->x = v->x;
+		}
+		j->next = 0;
+		_workers_run(nthreads, _job_parse, j);
+	}
+	pthread_mutex_destroy(&j->lock);
+	for (c = 0, bad = (size_t) -1; c < j->nchunks && bad == (size_t) -1; c++)
+		bad = j->bad[c];
+	if (bad != (size_t) -1) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "malformed number");
+		lua_pushinteger(L, bad + 1);
+		return 3;
+	}
+	return 1;
+}
+
+
+/*
+ * Binary dumps.  A dump is a header and one record per value: the
+ * fields of the custom interface and the raw limbs, in native byte order
+ * and limb size, which load() checks.  Both ways are a copy, with no
+ * radix conversion.
+ */
+#define DUMP_MAGIC	"lmpf"
+#define DUMP_VALUE	1
+#define DUMP_TABLE	2
+#define DUMP_VECTOR	3
+
+struct dump_header {
+	char magic[4];
+	uint32_t order;		/* 0x01020304, native byte order */
+	uint32_t limb_bits;
+	uint32_t type;		/* DUMP_* */
+	int64_t count;
+	int64_t prec;		/* of a vector, else 0 */
+};
+
+struct dump_record {
+	int64_t prec;
+	int64_t exp;
+	int32_t kind;		/* mpfr_custom_get_kind() */
+	char pad[4];		/* the limbs of a regular number follow */
+};
+
+static size_t _dump_size(mpfr_srcptr x)
+{
+	return sizeof (struct dump_record) +
+		(mpfr_regular_p(x) ? mpfr_custom_get_size(
+			mpfr_get_prec(x)) : 0);
+}
+
+static char *_dump_record(char *p, mpfr_srcptr x)
+{
+	struct dump_record d;
+	size_t sz;
+
+	memset(&d, 0, sizeof d);
+	d.prec = mpfr_get_prec(x);
+	d.kind = mpfr_custom_get_kind(x);
+	if (mpfr_regular_p(x))
+		d.exp = mpfr_custom_get_exp(x);
+	memcpy(p, &d, sizeof d);
+	p += sizeof d;
+	if (mpfr_regular_p(x)) {
+		sz = mpfr_custom_get_size(d.prec);
+		memcpy(p, mpfr_custom_get_significand(x), sz);
+		p += sz;
+	}
+	return p;
+}
+
+/* the values at index i: a vector, a table of mpfr_t or an mpfr_t */
+static void _dump(lua_State *L, int i, int type)
+{
+	struct dump_header h;
+	struct vec *v = NULL;
+	luaL_Buffer B;
+	size_t sz, k, n;
+	char *p;
+
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, DUMP_MAGIC, sizeof h.magic);
+	h.order = 0x01020304;
+	h.limb_bits = mp_bits_per_limb;
+	h.type = type;
+	sz = sizeof h;
+	if (type == DUMP_VECTOR) {
+		v = _check_vec(L, i);
+		n = v->n;
+		h.prec = v->prec;
+		for (k = 0; k < n; k++)
+			sz += _dump_size(&v->x[k]);
+	} else if (type == DUMP_TABLE) {
+		n = lua_rawlen(L, i);
+		for (k = 0; k < n; k++) {
+			lua_rawgeti(L, i, k + 1);
+			if (!_test_fr(L, -1))
+				luaL_argerror(L, i, "table of mpfr_t expected");
+			sz += _dump_size(lua_touserdata(L, -1));
+			lua_pop(L, 1);
+		}
+	} else {
+		n = 1;
+		sz += _dump_size(_check_fr(L, i));
+	}
+	h.count = n;
+	p = luaL_buffinitsize(L, &B, sz);
+	memcpy(p, &h, sizeof h);
+	p += sizeof h;
+	for (k = 0; k < n; k++) {
+		if (v) {
+			p = _dump_record(p, &v->x[k]);
+		} else if (type == DUMP_TABLE) {
+			lua_rawgeti(L, i, k + 1);
+			p = _dump_record(p, lua_touserdata(L, -1));
+			lua_pop(L, 1);
+		} else {
+			p = _dump_record(p, lua_touserdata(L, i));
+		}
+	}
+	luaL_pushresultsize(&B, sz);
+}
+
+/* dump(self) : string */
+static int fr_dump(lua_State *L)
+{
+	_dump(L, 1, DUMP_VALUE);
+	return 1;
+}
+
+/* dump_many(t) : string, t a vector or a table of mpfr_t */
+static int fr_dump_many(lua_State *L)
+{
+	if (_test_type(L, 1, UV_VECTOR)) {
+		_dump(L, 1, DUMP_VECTOR);
+	} else {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		_dump(L, 1, DUMP_TABLE);
+	}
+	return 1;
+}
+
+static void _load_error(lua_State *L)
+{
+	luaL_argerror(L, 1, "not a dump of this build");
+}
+
+/* check the header at *p, and return the number of records */
+static size_t _load_header(lua_State *L, const char **p, const char *end,
+	struct dump_header *h)
+{
+	if ((size_t) (end - *p) < sizeof *h)
+		_load_error(L);
+	memcpy(h, *p, sizeof *h);
+	*p += sizeof *h;
+	if (memcmp(h->magic, DUMP_MAGIC, sizeof h->magic) != 0 ||
+			h->order != 0x01020304 ||
+			h->limb_bits != (uint32_t) mp_bits_per_limb ||
+			h->count < 0)
+		_load_error(L);
+	return h->count;
+}
+
+/*
+ * read the record at *p into z if it has z's precision, or into a new
+ * value pushed on the stack if z is NULL
+ */
+static void _load_record(lua_State *L, const char **p, const char *end,
+	mpfr_ptr z)
+{
+	struct dump_record d;
+	const mp_limb_t *x;
+	size_t sz;
+
+	if ((size_t) (end - *p) < sizeof d)
+		_load_error(L);
+	memcpy(&d, *p, sizeof d);
+	*p += sizeof d;
+	if (!(MPFR_PREC_MIN <= d.prec && d.prec <= MPFR_PREC_MAX) ||
+			(z && d.prec != mpfr_get_prec(z)) ||
+			d.kind < -MPFR_REGULAR_KIND ||
+			d.kind > MPFR_REGULAR_KIND)
+		_load_error(L);
+	if (!z)
+		z = _fr_push(L, d.prec);
+	if (d.kind != MPFR_REGULAR_KIND && d.kind != -MPFR_REGULAR_KIND) {
+		mpfr_custom_init_set(z, d.kind, 0, d.prec,
+			mpfr_custom_get_significand(z));
+		return;
+	}
+	sz = mpfr_custom_get_size(d.prec);
+	if ((size_t) (end - *p) < sz ||
+			d.exp < mpfr_get_emin() || d.exp > mpfr_get_emax())
+		_load_error(L);
+	x = mpfr_custom_get_significand(z);
+	memcpy((void *) x, *p, sz);
+	*p += sz;
+	if (!_limbs_ok(x, d.prec))
+		_load_error(L);
+	mpfr_custom_init_set(z, d.kind, d.exp, d.prec, (void *) x);
+}
+
+/* load(s) : mpfr_t, from a string made by dump() */
+static int fr_load(lua_State *L)
+{
+	struct dump_header h;
+	const char *p, *end;
+	size_t len;
+
+	p = luaL_checklstring(L, 1, &len);
+	end = p + len;
+	if (_load_header(L, &p, end, &h) != 1 || h.type != DUMP_VALUE)
+		_load_error(L);
+	_load_record(L, &p, end, NULL);
+	if (p != end)
+		_load_error(L);
+	return 1;
+}
+
+/* load_many(s) : vector or table, from a string made by dump_many() */
+static int fr_load_many(lua_State *L)
+{
+	struct dump_header h;
+	const char *p, *end;
+	struct vec *v;
+	size_t len, n, k;
+
+	p = luaL_checklstring(L, 1, &len);
+	end = p + len;
+	n = _load_header(L, &p, end, &h);
+	/* every record takes at least its fixed part */
+	if (n > (size_t) (end - p) / sizeof (struct dump_record))
+		_load_error(L);
+	if (h.type == DUMP_VECTOR) {
+		if (!(MPFR_PREC_MIN <= h.prec && h.prec <= MPFR_PREC_MAX))
+			_load_error(L);
+		v = _vec_push(L, n, h.prec);
+		for (k = 0; k < n; k++)
+			_load_record(L, &p, end, &v->x[k]);
+	} else if (h.type == DUMP_TABLE) {
+		lua_createtable(L, n > INT_MAX ? INT_MAX : (int) n, 0);
+		for (k = 0; k < n; k++) {
+			_load_record(L, &p, end, NULL);
+			lua_rawseti(L, -2, k + 1);
+		}
+	} else {
+		_load_error(L);
+	}
+	if (p != end)
+		_load_error(L);
+	return 1;
+}
+
+
+/*
+ * Array files.  A header, a column of exponents and kinds, then a column
+ * of fixed-size significands, page aligned.  open_array() maps the file
+ * and returns a vector whose elements point into the map, so elements
+ * are read, and in "rw" or "w" mode written, in place; only the small
+ * column is read when opening.  The exponent column is written back by
+ * sync_array() and when the vector is collected.  In "r" mode the map
+ * is private: writes to the vector stay in memory.
+ */
+#define ARRAY_MAGIC	"lmpfarr1"
+#define MAPPING		"mpfr_mapping"
+
+struct array_header {
+	char magic[8];
+	uint32_t order;		/* 0x01020304, native byte order */
+	uint32_t limb_bits;
+	int64_t count;
+	int64_t prec;
+	int64_t meta_off;	/* of the array_meta column */
+	int64_t limb_off;	/* of the significands */
+	char pad[16];
+};
+
+struct array_meta {
+	int64_t exp;
+	int32_t kind;		/* mpfr_custom_get_kind(), 0 is NaN */
+	char pad[4];
+};
+
+/* the owner of a map, and the uservalue of the vector viewing it */
+struct array_map {
+	char *p;
+	size_t len;
+	int writable;
+	struct vec *v;
+};
+
+static void _array_sync(struct array_map *m)
+{
+	struct array_header *h = (struct array_header *) m->p;
+	struct array_meta *meta;
+	struct vec *v = m->v;
+	size_t k;
+
+	meta = (struct array_meta *) (m->p + h->meta_off);
+	for (k = 0; k < v->n; k++) {
+		meta[k].kind = mpfr_custom_get_kind(&v->x[k]);
+		meta[k].exp = mpfr_regular_p(&v->x[k]) ?
+			mpfr_custom_get_exp(&v->x[k]) : 0;
+	}
+}
+
+/* __gc of the owner; the vector is still there, being its uservalue */
+static int array_gc(lua_State *L)
+{
+	struct array_map *m = lua_touserdata(L, 1);
+
+	if (m->p) {
+		if (m->writable && m->v)
+			_array_sync(m);
+		munmap(m->p, m->len);
+		m->p = NULL;
+	}
+	return 0;
+}
+
+/* the layout of n values at prec; 0 if it doesn't fit in memory */
+static size_t _array_layout(struct array_header *h, size_t n,
+	mpfr_prec_t prec)
+{
+	size_t sz = mpfr_custom_get_size(prec), off;
+
+	if (n > (((size_t) -1) / 2 - 8192) / (sz + sizeof (struct array_meta)))
+		return 0;
+	off = sizeof *h + n * sizeof (struct array_meta);
+	off = (off + 4095) & ~(size_t) 4095;
+	memset(h, 0, sizeof *h);
+	memcpy(h->magic, ARRAY_MAGIC, sizeof h->magic);
+	h->order = 0x01020304;
+	h->limb_bits = mp_bits_per_limb;
+	h->count = n;
+	h->prec = prec;
+	h->meta_off = sizeof *h;
+	h->limb_off = off;
+	return off + n * sz;
+}
+
+/* open_array(path, [mode], [opts]) : vector
+ * open_array(path, "w", n, [prec]) : vector
+ * mode is "r" (the default), "rw", or "w" to create a file of n NaNs.
+ * "r" and "rw" check the header, kinds and exponents, but trust the
+ * significands unless opts.validate is true, which reads them all.
+ */
+static int fr_open_array(lua_State *L)
+{
+	const char *path, *mode;
+	struct array_header h, *fh;
+	struct array_meta *meta;
+	struct array_map *m;
+	struct vec *v;
+	struct stat st;
+	mpfr_prec_t prec = 0;
+	lua_Integer n = 0;
+	size_t len = 0, sz, k;
+	int fd, flags, validate = 0;
+	char *p;
+
+	path = luaL_checkstring(L, 1);
+	mode = luaL_optstring(L, 2, "r");
+	if (strcmp(mode, "r") == 0)
+		flags = O_RDONLY;
+	else if (strcmp(mode, "rw") == 0)
+		flags = O_RDWR;
+	else if (strcmp(mode, "w") == 0)
+		flags = O_RDWR | O_CREAT | O_TRUNC;
+	else
+		return luaL_argerror(L, 2, "mode must be \"r\", \"rw\" or \"w\"");
+	if (*mode == 'w') {
+		n = luaL_checkinteger(L, 3);
+		luaL_argcheck(L, n >= 0, 3, "size must be non-negative");
+		prec = lua_isnoneornil(L, 4) ? mpfr_get_default_prec() :
+			_check_prec(L, 4);
+		len = _array_layout(&h, n, prec);
+		if (!len)
+			return luaL_error(L, "array too large");
+	} else if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_getfield(L, 3, "validate");
+		validate = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+	/* the owner first, so that a failure below unmaps */
+	m = lua_newuserdata(L, sizeof (*m));
+	m->p = NULL;
+	m->writable = flags != O_RDONLY;
+	m->v = NULL;
+	luaL_setmetatable(L, MAPPING);
+	fd = open(path, flags, 0666);
+	if (fd < 0)
+		return luaL_error(L, "%s: %s", path, strerror(errno));
+	if (*mode == 'w' ? ftruncate(fd, len) < 0 : fstat(fd, &st) < 0) {
+		close(fd);
+		return luaL_error(L, "%s: %s", path, strerror(errno));
+	}
+	if (*mode != 'w')
+		len = st.st_size;
+	if (len < sizeof h) {
+		close(fd);
+		return luaL_error(L, "%s: not an array file", path);
+	}
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		m->writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return luaL_error(L, "%s: %s", path, strerror(errno));
+	m->p = p;
+	m->len = len;
+	fh = (struct array_header *) p;
+	if (*mode == 'w') {
+		memcpy(fh, &h, sizeof h);	/* the file is zeros: NaNs */
+	} else {
+		n = fh->count;
+		prec = fh->prec;
+		if (memcmp(fh->magic, ARRAY_MAGIC, sizeof fh->magic) != 0 ||
+				fh->order != 0x01020304 ||
+				fh->limb_bits != (uint32_t) mp_bits_per_limb ||
+				!(MPFR_PREC_MIN <= prec && prec <= MPFR_PREC_MAX) ||
+				n < 0 || _array_layout(&h, n, prec) != len ||
+				fh->meta_off != h.meta_off ||
+				fh->limb_off != h.limb_off)
+			return luaL_error(L, "%s: not an array file", path);
+	}
+	if ((size_t) n > (((size_t) -1) - sizeof (*v)) / sizeof (v->x[0]))
+		return luaL_error(L, "array too large");
+	v = lua_newuserdata(L, sizeof (*v) + n * sizeof (v->x[0]));
+	v->n = n;
+	v->prec = prec;
+	sz = mpfr_custom_get_size(prec);
+	meta = (struct array_meta *) (p + fh->meta_off);
+	for (k = 0; k < v->n; k++) {
+		if (meta[k].kind < -MPFR_REGULAR_KIND ||
+				meta[k].kind > MPFR_REGULAR_KIND ||
+				((meta[k].kind == MPFR_REGULAR_KIND ||
+				meta[k].kind == -MPFR_REGULAR_KIND) &&
+				(meta[k].exp < mpfr_get_emin() ||
+				meta[k].exp > mpfr_get_emax() || (validate &&
+				!_limbs_ok((mp_limb_t *) (p + fh->limb_off +
+					k * sz), prec)))))
+			return luaL_error(L, "%s: bad element %I", path,
+				(lua_Integer) k + 1);
+		mpfr_custom_init_set(&v->x[k], meta[k].kind, meta[k].exp,
+			prec, p + fh->limb_off + k * sz);
+	}
+	lua_pushvalue(L, UV_VECTOR);
+	lua_setmetatable(L, -2);
+	/* each keeps the other alive; the owner's __gc can see v */
+	lua_pushvalue(L, -2);
+	lua_setuservalue(L, -2);
+	lua_pushvalue(L, -1);
+	lua_setuservalue(L, -3);
+	m->v = v;
+	return 1;
+}
+
+/* sync_array(v) : v, writing v's exponents and signs to its file */
+static int fr_sync_array(lua_State *L)
+{
+	struct array_map *m;
+
+	_check_vec(L, 1);
+	lua_getuservalue(L, 1);
+	m = luaL_testudata(L, -1, MAPPING);
+	luaL_argcheck(L, m && m->p, 1, "not a mapped array");
+	luaL_argcheck(L, m->writable, 1, "array opened read-only");
+	_array_sync(m);
+	if (msync(m->p, m->len, MS_SYNC) < 0)
+		return luaL_error(L, "%s", strerror(errno));
+	lua_settop(L, 1);
+	return 1;
+}
+
+
+/*
+ * Intervals.  Both endpoints live in one userdata at one precision; the
+ * lower one is always rounded down and the upper one up, so the interval
+ * encloses every exact result.  An interval that leaves the domain of a
+ * function, or has a NaN endpoint, becomes [NaN, NaN].
+ */
+struct ival {
+	__mpfr_struct lo, hi;	/* limbs follow */
+};
+
+/* an operand: an interval, or a point held in t if it was a number */
+struct ival_arg {
+	mpfr_ptr lo, hi;
+	__mpfr_struct t;
+	mp_limb_t limbs[128 / CHAR_BIT / sizeof (mp_limb_t)];
+};
+
+static struct ival *_check_ival(lua_State *L, int i)
+{
+	struct ival *v;
+
+	v = _test_type(L, i, UV_INTERVAL);
+	if (!v)
+		_type_error(L, i, INTERVAL);
+	return v;
+}
+
+static struct ival *_ival_push(lua_State *L, mpfr_prec_t prec)
+{
+	struct ival *v;
+	size_t sz;
+
+	sz = mpfr_custom_get_size(prec);
+	v = lua_newuserdata(L, sizeof (*v) + 2 * sz);
+	_fr_init(&v->lo, prec, (char *) (v + 1));
+	_fr_init(&v->hi, prec, (char *) (v + 1) + sz);
+	lua_pushvalue(L, UV_INTERVAL);
+	lua_setmetatable(L, -2);
+	return v;
+}
+
+static void _ival_arg(lua_State *L, int i, struct ival_arg *a)
+{
+	struct ival *v;
+	union value x;
+
+	if ((v = _test_type(L, i, UV_INTERVAL)) != NULL) {
+		a->lo = &v->lo;
+		a->hi = &v->hi;
+		return;
+	}
+	/* a decimal string is no exact point; set reads it outwards */
+	if (lua_type(L, i) == LUA_TSTRING)
+		luaL_argerror(L, i, "string operand, use set to read it");
+	a->lo = a->hi = &a->t;
+	switch (_check_value(L, i, &x)) {
+	case V_LONG:
+		_fr_init(&a->t, sizeof (long) * CHAR_BIT, a->limbs);
+		mpfr_set_si(&a->t, x.i, MPFR_RNDN);
+		break;
+	case V_DOUBLE:
+		_fr_init(&a->t, DBL_MANT_DIG, a->limbs);
+		mpfr_set_d(&a->t, x.d, MPFR_RNDN);
+		break;
+	case V_MPFR:
+		a->lo = a->hi = x.fr;
+		break;
+	}
+}
+
+static int _ival_nan(struct ival_arg *a)
+{
+	return mpfr_nan_p(a->lo) || mpfr_nan_p(a->hi);
+}
+
+/* an interval with a NaN endpoint is NaN */
+static void _ival_fix(struct ival *z)
+{
+	if (mpfr_nan_p(&z->lo) || mpfr_nan_p(&z->hi)) {
+		mpfr_set_nan(&z->lo);
+		mpfr_set_nan(&z->hi);
+	}
+}
+
+/* interval([prec]) : mpfr_interval */
+static int ival_new(lua_State *L)
+{
+	mpfr_prec_t prec;
+
+	if (lua_isnoneornil(L, 1))
+		prec = mpfr_get_default_prec();
+	else
+		prec = _check_prec(L, 1);
+	_ival_push(L, prec);
+	return 1;
+}
+
+/*
+ * endpoint z of set(): from a string, or the lo/hi end of an operand.
+ * With z NULL, only check operand i, so that set() raises any error
+ * before self changes.
+ */
+static void _ival_set_end(lua_State *L, mpfr_ptr z, int i, mpfr_rnd_t r)
+{
+	struct ival_arg a;
+	const char *s;
+	char *end;
+
+	if (lua_type(L, i) == LUA_TSTRING) {
+		s = lua_tostring(L, i);
+		if (!z) {
+			/* where the number ends does not depend on prec */
+			_fr_init(&a.t, MPFR_PREC_MIN, a.limbs);
+			z = &a.t;
+		}
+		mpfr_strtofr(z, s, &end, 10, r);
+		if (end == s || *end)
+			luaL_argerror(L, i, "not a number");
+		return;
+	}
+	_ival_arg(L, i, &a);
+	if (z)
+		mpfr_set(z, r == MPFR_RNDD ? a.lo : a.hi, r);
+}
+
+/* set(self, x, [y]) : self
+ * self = [x, y], or x if y is absent; strings are read in decimal, and
+ * each endpoint is rounded outwards
+ */
+static int ival_set(lua_State *L)
+{
+	struct ival *z;
+	int hi;
+
+	z = _check_ival(L, 1);
+	hi = lua_isnoneornil(L, 3) ? 2 : 3;
+	_ival_set_end(L, NULL, 2, MPFR_RNDD);
+	_ival_set_end(L, NULL, hi, MPFR_RNDU);
+	_ival_set_end(L, &z->lo, 2, MPFR_RNDD);
+	_ival_set_end(L, &z->hi, hi, MPFR_RNDU);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* get(self) : lo, hi */
+static int ival_get(lua_State *L)
+{
+	struct ival *z;
+
+	z = _check_ival(L, 1);
+	mpfr_set(_fr_push(L, mpfr_get_prec(&z->lo)), &z->lo, MPFR_RNDD);
+	mpfr_set(_fr_push(L, mpfr_get_prec(&z->hi)), &z->hi, MPFR_RNDU);
+	return 2;
+}
+
+static int ival_get_prec(lua_State *L)
+{
+	lua_pushinteger(L, mpfr_get_prec(&_check_ival(L, 1)->lo));
+	return 1;
+}
+
+/* contains(self, x) : whether x lies in self; x may be an interval */
+static int ival_contains(lua_State *L)
+{
+	struct ival *z;
+	struct ival_arg a;
+
+	z = _check_ival(L, 1);
+	_ival_arg(L, 2, &a);
+	lua_pushboolean(L, mpfr_lessequal_p(&z->lo, a.lo) &&
+		mpfr_lessequal_p(a.hi, &z->hi));
+	return 1;
+}
+
+static int ival_tostring(lua_State *L)
+{
+	struct ival *z;
+	char *s;
+	int n;
+
+	z = _check_ival(L, 1);
+	/* enough digits to tell neighbouring endpoints apart */
+	n = 1 + (int) (mpfr_get_prec(&z->lo) * 0.30103) + 1;
+	if (mpfr_asprintf(&s, "[%.*RDe, %.*RUe]", n, &z->lo, n, &z->hi) < 0)
+		return luaL_error(L, "not enough memory");
+	lua_pushstring(L, s);
+	mpfr_free_str(s);
+	return 1;
+}
+
+/* add(self, x, y) : self */
+static int ival_add(lua_State *L)
+{
+	struct ival *z;
+	struct ival_arg a, b;
+
+	z = _check_ival(L, 1);
+	_ival_arg(L, 2, &a);
+	_ival_arg(L, 3, &b);
+	/* the upper end reads only upper ends, so aliasing is harmless */
+	mpfr_add(&z->hi, a.hi, b.hi, MPFR_RNDU);
+	mpfr_add(&z->lo, a.lo, b.lo, MPFR_RNDD);
+	_ival_fix(z);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* sub(self, x, y) : self */
+static int ival_sub(lua_State *L)
+{
+	struct ival *z;
+	struct ival_arg a, b;
+	mpfr_t lo;
+
+	z = _check_ival(L, 1);
+	_ival_arg(L, 2, &a);
+	_ival_arg(L, 3, &b);
+	_pool_get(L, lo, mpfr_get_prec(&z->lo));
+	mpfr_sub(lo, a.lo, b.hi, MPFR_RNDD);
+	mpfr_sub(&z->hi, a.hi, b.lo, MPFR_RNDU);
+	mpfr_set(&z->lo, lo, MPFR_RNDD);
+	_pool_put(lo);
+	_ival_fix(z);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* x * y rounded by r, where 0 times infinity is 0 */
+static int _ival_mul1(mpfr_ptr z, mpfr_srcptr x, mpfr_srcptr y, mpfr_rnd_t r)
+{
+	if ((mpfr_zero_p(x) && mpfr_inf_p(y)) ||
+			(mpfr_inf_p(x) && mpfr_zero_p(y))) {
+		mpfr_set_zero(z, 1);
+		return 0;
+	}
+	return mpfr_mul(z, x, y, r);
+}
+
+/* z = the bound of fn over the four pairs of ends, min if r is RNDD */
+static void _ival_ends(mpfr_ptr z, mpfr_ptr t, struct ival_arg *a,
+	struct ival_arg *b, int (*fn)(mpfr_ptr, mpfr_srcptr, mpfr_srcptr,
+	mpfr_rnd_t), mpfr_rnd_t r)
+{
+	mpfr_srcptr x[4] = {a->lo, a->lo, a->hi, a->hi};
+	mpfr_srcptr y[4] = {b->lo, b->hi, b->lo, b->hi};
+	int k;
+
+	(*fn)(z, x[0], y[0], r);
+	for (k = 1; k < 4; k++) {
+		(*fn)(t, x[k], y[k], r);
+		if (r == MPFR_RNDD ? mpfr_less_p(t, z) : mpfr_greater_p(t, z))
+			mpfr_set(z, t, r);
+	}
+}
+
+/* mul(self, x, y) : self */
+static int ival_mul(lua_State *L)
+{
+	struct ival *z;
+	struct ival_arg a, b;
+	mpfr_t lo, hi, t;
+	mpfr_prec_t prec;
+
+	z = _check_ival(L, 1);
+	_ival_arg(L, 2, &a);
+	_ival_arg(L, 3, &b);
+	if (_ival_nan(&a) || _ival_nan(&b)) {
+		mpfr_set_nan(&z->lo);
+		mpfr_set_nan(&z->hi);
+	} else {
+		prec = mpfr_get_prec(&z->lo);
+		_pool_get(L, lo, prec);
+		_pool_get(L, hi, prec);
+		_pool_get(L, t, prec);
+		_ival_ends(lo, t, &a, &b, _ival_mul1, MPFR_RNDD);
+		_ival_ends(hi, t, &a, &b, _ival_mul1, MPFR_RNDU);
+		mpfr_set(&z->lo, lo, MPFR_RNDD);
+		mpfr_set(&z->hi, hi, MPFR_RNDU);
+		_pool_put(t);
+		_pool_put(hi);
+		_pool_put(lo);
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* div(self, x, y) : self, the whole line if y contains 0 */
+static int ival_div(lua_State *L)
+{
+	struct ival *z;
+	struct ival_arg a, b;
+	mpfr_t lo, hi, t;
+	mpfr_prec_t prec;
+
+	z = _check_ival(L, 1);
+	_ival_arg(L, 2, &a);
+	_ival_arg(L, 3, &b);
+	if (_ival_nan(&a) || _ival_nan(&b)) {
+		mpfr_set_nan(&z->lo);
+		mpfr_set_nan(&z->hi);
+	} else if (mpfr_sgn(b.lo) <= 0 && mpfr_sgn(b.hi) >= 0) {
+		mpfr_set_inf(&z->lo, -1);
+		mpfr_set_inf(&z->hi, 1);
+	} else {
+		prec = mpfr_get_prec(&z->lo);
+		_pool_get(L, lo, prec);
+		_pool_get(L, hi, prec);
+		_pool_get(L, t, prec);
+		_ival_ends(lo, t, &a, &b, mpfr_div, MPFR_RNDD);
+		_ival_ends(hi, t, &a, &b, mpfr_div, MPFR_RNDU);
+		mpfr_set(&z->lo, lo, MPFR_RNDD);
+		mpfr_set(&z->hi, hi, MPFR_RNDU);
+		_pool_put(t);
+		_pool_put(hi);
+		_pool_put(lo);
+		_ival_fix(z);
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* how a function of one argument maps the ends of an interval */
+#define IV_INC	0	/* increasing */
+#define IV_DEC	1	/* decreasing */
+#define IV_EVEN	2	/* decreasing below 0, increasing above */
+
+struct ival_fn1_reg {
+	const char *name;
+	int (*fn)(mpfr_ptr, mpfr_srcptr, mpfr_rnd_t);
+	int kind;
+};
+
+static const struct ival_fn1_reg _ival_fn1_reg[] = {
+	{"sqr", mpfr_sqr, IV_EVEN},
+	{"sqrt", mpfr_sqrt, IV_INC},
+	{"rec_sqrt", mpfr_rec_sqrt, IV_DEC},
+	{"cbrt", mpfr_cbrt, IV_INC},
+	{"abs", mpfr_abs, IV_EVEN},
+	{"neg", mpfr_neg, IV_DEC},
+	{"log", mpfr_log, IV_INC},
+	{"log2", mpfr_log2, IV_INC},
+	{"log10", mpfr_log10, IV_INC},
+	{"log1p", mpfr_log1p, IV_INC},
+	{"exp", mpfr_exp, IV_INC},
+	{"exp2", mpfr_exp2, IV_INC},
+	{"exp10", mpfr_exp10, IV_INC},
+	{"expm1", mpfr_expm1, IV_INC},
+	{"acos", mpfr_acos, IV_DEC},
+	{"asin", mpfr_asin, IV_INC},
+	{"atan", mpfr_atan, IV_INC},
+	{"cosh", mpfr_cosh, IV_EVEN},
+	{"sinh", mpfr_sinh, IV_INC},
+	{"tanh", mpfr_tanh, IV_INC},
+	{"acosh", mpfr_acosh, IV_INC},
+	{"asinh", mpfr_asinh, IV_INC},
+	{"atanh", mpfr_atanh, IV_INC},
+	{"erf", mpfr_erf, IV_INC},
+	{"erfc", mpfr_erfc, IV_DEC},
+	{"rint", mpfr_rint, IV_INC},
+	{"rint_ceil", mpfr_rint_ceil, IV_INC},
+	{"rint_floor", mpfr_rint_floor, IV_INC},
+	{"rint_round", mpfr_rint_round, IV_INC},
+	{"rint_trunc", mpfr_rint_trunc, IV_INC},
+	{0, 0, 0}
+};
+
+/* fn(self, x) : self, upvalues fn and its kind */
+static int ival_fn1(lua_State *L)
+{
+	int (*fn)(mpfr_ptr, mpfr_srcptr, mpfr_rnd_t);
+	struct ival *z;
+	struct ival_arg a;
+	mpfr_t lo, t;
+	int kind;
+
+	fn = lua_touserdata(L, UV_FN(1));
+	kind = lua_tointeger(L, UV_FN(2));
+	z = _check_ival(L, 1);
+	_ival_arg(L, 2, &a);
+	if (kind == IV_EVEN && mpfr_sgn(a.lo) >= 0)
+		kind = IV_INC;
+	else if (kind == IV_EVEN && mpfr_sgn(a.hi) <= 0)
+		kind = IV_DEC;
+	_pool_get(L, lo, mpfr_get_prec(&z->lo));
+	switch (kind) {
+	case IV_INC:
+		(*fn)(lo, a.lo, MPFR_RNDD);
+		(*fn)(&z->hi, a.hi, MPFR_RNDU);
+		break;
+	case IV_DEC:
+		(*fn)(lo, a.hi, MPFR_RNDD);
+		(*fn)(&z->hi, a.lo, MPFR_RNDU);
+		break;
+	default:
+		/* the minimum is at 0, the maximum at the farther end */
+		_pool_get(L, t, mpfr_get_prec(&z->lo));
+		mpfr_set_zero(t, 1);
+		(*fn)(lo, t, MPFR_RNDD);
+		(*fn)(t, a.lo, MPFR_RNDU);
+		(*fn)(&z->hi, a.hi, MPFR_RNDU);
+		mpfr_max(&z->hi, &z->hi, t, MPFR_RNDU);
+		_pool_put(t);
+		break;
+	}
+	mpfr_set(&z->lo, lo, MPFR_RNDD);
+	_pool_put(lo);
+	_ival_fix(z);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* whether [x.lo, x.hi] may contain a point c pi/2 + 2 k pi, c and k
+ * integers; in doubt, it does
+ */
+static int _ival_has(lua_State *L, struct ival_arg *x, int c)
+{
+	mpfr_t pd, pu, s, t;
+	mpfr_exp_t e;
+	int has;
+
+	if (!mpfr_number_p(x->lo) || !mpfr_number_p(x->hi))
+		return 1;
+	e = 0;
+	if (!mpfr_zero_p(x->lo) && mpfr_get_exp(x->lo) > e)
+		e = mpfr_get_exp(x->lo);
+	if (!mpfr_zero_p(x->hi) && mpfr_get_exp(x->hi) > e)
+		e = mpfr_get_exp(x->hi);
+	e += mpfr_get_prec(x->lo) + mpfr_get_prec(x->hi) + 32;
+	_pool_get(L, pd, e);
+	_pool_get(L, pu, e);
+	_pool_get(L, s, e);
+	_pool_get(L, t, e);
+	mpfr_const_pi(pd, MPFR_RNDD);
+	mpfr_const_pi(pu, MPFR_RNDU);
+	/* k >= s = (2 lo/pi - c) / 4 and k <= t = (2 hi/pi - c) / 4 */
+	mpfr_div(s, x->lo, mpfr_sgn(x->lo) >= 0 ? pu : pd, MPFR_RNDD);
+	mpfr_mul_2ui(s, s, 1, MPFR_RNDD);
+	mpfr_sub_si(s, s, c, MPFR_RNDD);
+	mpfr_div_2ui(s, s, 2, MPFR_RNDD);
+	mpfr_ceil(s, s);
+	mpfr_div(t, x->hi, mpfr_sgn(x->hi) >= 0 ? pd : pu, MPFR_RNDU);
+	mpfr_mul_2ui(t, t, 1, MPFR_RNDU);
+	mpfr_sub_si(t, t, c, MPFR_RNDU);
+	mpfr_div_2ui(t, t, 2, MPFR_RNDU);
+	mpfr_floor(t, t);
+	has = mpfr_lessequal_p(s, t);
+	_pool_put(t);
+	_pool_put(s);
+	_pool_put(pu);
+	_pool_put(pd);
+	return has;
+}
+
+/* sin and cos: the ends' values, widened to 1 or -1 by an extremum at
+ * c pi/2 (max) or (c + 2) pi/2 (min)
+ */
+static int _ival_trig(lua_State *L, int (*fn)(mpfr_ptr, mpfr_srcptr,
+	mpfr_rnd_t), int c)
+{
+	struct ival *z;
+	struct ival_arg a;
+	mpfr_t lo, hi, t;
+	mpfr_prec_t prec;
+	int max, min;
+
+	z = _check_ival(L, 1);
+	_ival_arg(L, 2, &a);
+	if (_ival_nan(&a)) {
+		mpfr_set_nan(&z->lo);
+		mpfr_set_nan(&z->hi);
+		lua_settop(L, 1);
+		return 1;
+	}
+	max = _ival_has(L, &a, c);
+	min = _ival_has(L, &a, c + 2);
+	prec = mpfr_get_prec(&z->lo);
+	_pool_get(L, lo, prec);
+	_pool_get(L, hi, prec);
+	_pool_get(L, t, prec);
+	if (min) {
+		mpfr_set_si(lo, -1, MPFR_RNDD);
+	} else {
+		(*fn)(lo, a.lo, MPFR_RNDD);
+		(*fn)(t, a.hi, MPFR_RNDD);
+		mpfr_min(lo, lo, t, MPFR_RNDD);
+	}
+	if (max) {
+		mpfr_set_si(hi, 1, MPFR_RNDU);
+	} else {
+		(*fn)(hi, a.lo, MPFR_RNDU);
+		(*fn)(t, a.hi, MPFR_RNDU);
+		mpfr_max(hi, hi, t, MPFR_RNDU);
+	}
+	mpfr_set(&z->lo, lo, MPFR_RNDD);
+	mpfr_set(&z->hi, hi, MPFR_RNDU);
+	_pool_put(t);
+	_pool_put(hi);
+	_pool_put(lo);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* sin(self, x) : self */
+static int ival_sin(lua_State *L)
+{
+	return _ival_trig(L, mpfr_sin, 1);
+}
+
+/* cos(self, x) : self */
+static int ival_cos(lua_State *L)
+{
+	return _ival_trig(L, mpfr_cos, 0);
+}
+
+/*
+ * Gamma has its minimum over x > 0 at x0 = 1.4616..., where it is
+ * 0.8856...; the decimals below are truncated, so the first is a lower
+ * bound of x0 and of the minimum once rounded down.
+ */
+#define GAMMA_X0	"1.461632144968362341262659542325721328468196204006446351295988408598786"
+#define GAMMA_X0_UP	"1.461632144968362341262659542325721328468196204006446351295988408598787"
+#define GAMMA_MIN	"0.885603194410888700278815900582588733207951533669903448871200165875"
+
+/* gamma(self, x) : self, the whole line unless x > 0 */
+static int ival_gamma(lua_State *L)
+{
+	struct ival *z;
+	struct ival_arg a;
+	mpfr_t lo, t;
+	mpfr_prec_t prec;
+
+	z = _check_ival(L, 1);
+	_ival_arg(L, 2, &a);
+	if (_ival_nan(&a)) {
+		mpfr_set_nan(&z->lo);
+		mpfr_set_nan(&z->hi);
+	} else if (mpfr_sgn(a.lo) <= 0) {
+		mpfr_set_inf(&z->lo, -1);
+		mpfr_set_inf(&z->hi, 1);
+	} else {
+		prec = mpfr_get_prec(&z->lo);
+		_pool_get(L, lo, prec);
+		_pool_get(L, t, prec < 256 ? 256 : prec);
+		mpfr_strtofr(t, GAMMA_X0, NULL, 10, MPFR_RNDD);
+		if (mpfr_lessequal_p(a.hi, t)) {
+			/* decreasing */
+			mpfr_gamma(lo, a.hi, MPFR_RNDD);
+			mpfr_gamma(&z->hi, a.lo, MPFR_RNDU);
+		} else {
+			mpfr_strtofr(t, GAMMA_X0_UP, NULL, 10, MPFR_RNDU);
+			if (mpfr_greaterequal_p(a.lo, t)) {
+				mpfr_gamma(lo, a.lo, MPFR_RNDD);
+			} else {
+				mpfr_strtofr(lo, GAMMA_MIN, NULL, 10,
+					MPFR_RNDD);
+			}
+			/* gamma is convex there, so the max is at an end */
+			mpfr_gamma(t, a.lo, MPFR_RNDU);
+			mpfr_gamma(&z->hi, a.hi, MPFR_RNDU);
+			mpfr_max(&z->hi, &z->hi, t, MPFR_RNDU);
+		}
+		mpfr_set(&z->lo, lo, MPFR_RNDD);
+		_pool_put(t);
+		_pool_put(lo);
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+
+/*
+ * Metamethods make a new interval at the largest precision of the
+ * interval operands, as those of mpfr_t do.
+ */
+static int ival_arith2(lua_State *L)
+{
+	struct ival *x;
+	mpfr_prec_t prec = 0;
+	int i;
+
+	lua_settop(L, 2);
+	for (i = 1; i <= 2; i++) {
+		x = _test_type(L, i, UV_INTERVAL);
+		if (x && mpfr_get_prec(&x->lo) > prec)
+			prec = mpfr_get_prec(&x->lo);
+	}
+	_ival_push(L, prec);
+	lua_insert(L, 1);
+	return ((lua_CFunction) lua_touserdata(L, UV_FN(1)))(L);
+}
+
+static int ival_arith_unm(lua_State *L)
+{
+	struct ival *x, *z;
+
+	x = _check_ival(L, 1);
+	z = _ival_push(L, mpfr_get_prec(&x->lo));
+	mpfr_neg(&z->lo, &x->hi, MPFR_RNDD);
+	mpfr_neg(&z->hi, &x->lo, MPFR_RNDU);
+	return 1;
+}
+
+static const luaL_Reg _ival_reg[] =
+{
+	{"__tostring", ival_tostring},
+	{"__unm", ival_arith_unm},
+	{"set", ival_set},
+	{"get", ival_get},
+	{"get_prec", ival_get_prec},
+	{"contains", ival_contains},
+	{"add", ival_add},
+	{"sub", ival_sub},
+	{"mul", ival_mul},
+	{"div", ival_div},
+	{"sin", ival_sin},
+	{"cos", ival_cos},
+	{"gamma", ival_gamma},
+	{0, 0},
+};
+
+static const struct {
+	const char *meta;
+	lua_CFunction fn;
+} _ival_meta_reg[] = {
+	{"__add", ival_add},
+	{"__sub", ival_sub},
+	{"__mul", ival_mul},
+	{"__div", ival_div},
+	{0, 0}
+};
+
+static void _open_interval(lua_State *L)
 {
-	for (; r->name; r++) {
+	const struct ival_fn1_reg *r;
+	int i;
+
+	luaL_getmetatable(L, INTERVAL);
+	_push_upvals(L);
+	luaL_setfuncs(L, _ival_reg, NUPVAL);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	for (r = _ival_fn1_reg; r->name; r++) {
+		_push_upvals(L);
 		lua_pushlightuserdata(L, r->fn);
-		lua_pushcclosure(L, fr_fn1, 1);
+		lua_pushinteger(L, r->kind);
+		lua_pushcclosure(L, ival_fn1, NUPVAL + 2);
 		lua_setfield(L, -2, r->name);
 	}
+	for (i = 0; _ival_meta_reg[i].meta; i++) {
+		_push_upvals(L);
+		lua_pushlightuserdata(L, _ival_meta_reg[i].fn);
+		lua_pushcclosure(L, ival_arith2, NUPVAL + 1);
+		lua_setfield(L, -2, _ival_meta_reg[i].meta);
+	}
+	lua_pop(L, 1);
 }
 
 
-/* fr|ui -> fr */
-static int fr_fn1u(lua_State *L)
+/*
+ * Complex numbers, as a pair of parts at one precision in one userdata,
+ * and vectors of them.  Both share the kernels below, which take the
+ * parts of the result and of the operands, and scratch values at a few
+ * guard bits over the result's precision.  add, sub, mul and conj round
+ * each part correctly; the others compute at the guard precision and
+ * round, so each part is within about an ulp, barring cancellation in
+ * the final sums.  log|a| in log is correctly rounded only for |a| in
+ * [1/2, 2), where it is computed apart since log cancels there.
+ */
+#define CPLX_GUARD	32
+
+#if MPFR_VERSION < MPFR_VERSION_NUM(4,0,0)
+/* a b + c d and a b - c d, with exact products */
+static int _fmma(mpfr_ptr z, mpfr_srcptr a, mpfr_srcptr b, mpfr_srcptr c,
+	mpfr_srcptr d, int neg, mpfr_rnd_t r)
 {
-	mpfr_ptr z;
-	mpfr_rnd_t r;
+	mpfr_t u, v;
+	int t;
+
+	mpfr_init2(u, mpfr_get_prec(a) + mpfr_get_prec(b));
+	mpfr_init2(v, mpfr_get_prec(c) + mpfr_get_prec(d));
+	mpfr_mul(u, a, b, MPFR_RNDN);
+	mpfr_mul(v, c, d, MPFR_RNDN);
+	t = neg ? mpfr_sub(z, u, v, r) : mpfr_add(z, u, v, r);
+	mpfr_clear(v);
+	mpfr_clear(u);
+	return t;
+}
+#define mpfr_fmma(z, a, b, c, d, r)	_fmma(z, a, b, c, d, 0, r)
+#define mpfr_fmms(z, a, b, c, d, r)	_fmma(z, a, b, c, d, 1, r)
+#endif
 
-	z = luaL_checkudata(L, 1, MPFR);
-	r = _opt_rnd(L, 3);
-	if (lua_isinteger(L, 2)) {
-		lua_Integer i;
-		int (*fn)(mpfr_ptr, unsigned long, mpfr_rnd_t);
+struct cplx {
+	__mpfr_struct x[2];	/* real, imaginary; limbs follow */
+};
 
-		i = lua_tointeger(L, 2);
-		luaL_argcheck(L, 0 <= i && i <= ULONG_MAX, 2,
-			"out of range of unsigned long");
-		fn = lua_touserdata(L, lua_upvalueindex(2));
-		(*fn)(z, i, r);
+struct cvec {
+	size_t n;
+	mpfr_prec_t prec;
+	__mpfr_struct x[];	/* 2 n parts, then their limbs */
+};
+
+/*
+ * a kernel sets z to fn(a, b); z may be a or b, and t is four scratch
+ * values if the kernel asked for them
+ */
+typedef void (*cplx_kernel)(mpfr_ptr z, mpfr_srcptr a, mpfr_srcptr b,
+	mpfr_ptr t, mpfr_rnd_t r);
+
+static void _c_add(mpfr_ptr z, mpfr_srcptr a, mpfr_srcptr b, mpfr_ptr t,
+	mpfr_rnd_t r)
+{
+	mpfr_add(&z[0], &a[0], &b[0], r);
+	mpfr_add(&z[1], &a[1], &b[1], r);
+}
+
+static void _c_sub(mpfr_ptr z, mpfr_srcptr a, mpfr_srcptr b, mpfr_ptr t,
+	mpfr_rnd_t r)
+{
+	mpfr_sub(&z[0], &a[0], &b[0], r);
+	mpfr_sub(&z[1], &a[1], &b[1], r);
+}
+
+static void _c_conj(mpfr_ptr z, mpfr_srcptr a, mpfr_srcptr b, mpfr_ptr t,
+	mpfr_rnd_t r)
+{
+	mpfr_set(&z[0], &a[0], r);
+	mpfr_neg(&z[1], &a[1], r);
+}
+
+static void _c_neg(mpfr_ptr z, mpfr_srcptr a, mpfr_srcptr b, mpfr_ptr t,
+	mpfr_rnd_t r)
+{
+	mpfr_neg(&z[0], &a[0], r);
+	mpfr_neg(&z[1], &a[1], r);
+}
+
+/* t[0] is at the precision of z here, so the real part rounds once */
+static void _c_mul(mpfr_ptr z, mpfr_srcptr a, mpfr_srcptr b, mpfr_ptr t,
+	mpfr_rnd_t r)
+{
+	mpfr_fmms(&t[0], &a[0], &b[0], &a[1], &b[1], r);
+	mpfr_fmma(&z[1], &a[0], &b[1], &a[1], &b[0], r);
+	mpfr_set(&z[0], &t[0], r);
+}
+
+static void _c_div(mpfr_ptr z, mpfr_srcptr a, mpfr_srcptr b, mpfr_ptr t,
+	mpfr_rnd_t r)
+{
+	mpfr_fmma(&t[0], &a[0], &b[0], &a[1], &b[1], MPFR_RNDN);
+	mpfr_fmms(&t[1], &a[1], &b[0], &a[0], &b[1], MPFR_RNDN);
+	mpfr_fmma(&t[2], &b[0], &b[0], &b[1], &b[1], MPFR_RNDN);
+	mpfr_div(&z[0], &t[0], &t[2], r);
+	mpfr_div(&z[1], &t[1], &t[2], r);
+}
+
+static void _c_exp(mpfr_ptr z, mpfr_srcptr a, mpfr_srcptr b, mpfr_ptr t,
+	mpfr_rnd_t r)
+{
+	mpfr_exp(&t[0], &a[0], MPFR_RNDN);
+	mpfr_sin_cos(&t[1], &t[2], &a[1], MPFR_RNDN);
+	mpfr_mul(&z[0], &t[0], &t[2], r);
+	mpfr_mul(&z[1], &t[0], &t[1], r);
+}
+
+/*
+ * z = log |a|, t being scratch at z's precision or more.  Near |a| = 1
+ * the log of a rounded |a| cancels, so there it is half the log of the
+ * exact re^2 + im^2, in a Ziv loop: that has an error of about 2^-w,
+ * and of one ulp relative to its exponent, which must both go.
+ */
+static void _c_logabs(mpfr_ptr z, mpfr_srcptr a, mpfr_ptr t, mpfr_rnd_t r)
+{
+	mpfr_prec_t w, prec = mpfr_get_prec(z);
+	mpfr_exp_t e;
+	mpfr_t u;
+
+	mpfr_hypot(t, &a[0], &a[1], MPFR_RNDN);
+	if (!mpfr_regular_p(t) || (mpfr_get_exp(t) != 0 &&
+		mpfr_get_exp(t) != 1)) {
+		mpfr_log(z, t, r);
+		return;
+	}
+	w = prec + CPLX_GUARD;
+	mpfr_init2(u, w);
+	for (;;) {
+		if (mpfr_fmma(u, &a[0], &a[0], &a[1], &a[1], MPFR_RNDN) == 0 &&
+			mpfr_cmp_ui(u, 1) == 0) {
+			mpfr_set_zero(z, 1);
+			break;
+		}
+		mpfr_log(u, u, MPFR_RNDN);
+		mpfr_div_2ui(u, u, 1, MPFR_RNDN);
+		if (mpfr_regular_p(u)) {
+			e = mpfr_get_exp(u);
+			if (w + (e < 0 ? e : 0) > 2 &&
+				mpfr_can_round(u, w + (e < 0 ? e : 0) - 2,
+				MPFR_RNDN, MPFR_RNDZ, prec + (r == MPFR_RNDN))) {
+				mpfr_set(z, u, r);
+				break;
+			}
+		}
+		w += w / 2;
+		mpfr_set_prec(u, w);
+	}
+	mpfr_clear(u);
+}
+
+static void _c_log(mpfr_ptr z, mpfr_srcptr a, mpfr_srcptr b, mpfr_ptr t,
+	mpfr_rnd_t r)
+{
+	mpfr_srcptr re = &a[0];
+
+	if (z == a) {
+		/* exact, t being wider than z */
+		mpfr_set(&t[2], &a[0], MPFR_RNDN);
+		re = &t[2];
+	}
+	_c_logabs(&z[0], a, &t[0], r);
+	mpfr_atan2(&z[1], &a[1], re, r);
+}
+
+/* with s = sqrt((|a| + |re a|) / 2), the root is s + i im a / 2s if
+ * re a >= 0, and |im a| / 2s +- i s otherwise
+ */
+static void _c_sqrt(mpfr_ptr z, mpfr_srcptr a, mpfr_srcptr b, mpfr_ptr t,
+	mpfr_rnd_t r)
+{
+	int neg;
+
+	mpfr_hypot(&t[0], &a[0], &a[1], MPFR_RNDN);
+	if (mpfr_sgn(&a[0]) >= 0)
+		mpfr_add(&t[0], &t[0], &a[0], MPFR_RNDN);
+	else
+		mpfr_sub(&t[0], &t[0], &a[0], MPFR_RNDN);
+	mpfr_div_2ui(&t[0], &t[0], 1, MPFR_RNDN);
+	mpfr_sqrt(&t[0], &t[0], MPFR_RNDN);
+	if (mpfr_zero_p(&t[0])) {
+		mpfr_set_zero(&z[0], 1);
+		mpfr_set(&z[1], &a[1], r);
+		return;
+	}
+	mpfr_mul_2ui(&t[1], &t[0], 1, MPFR_RNDN);
+	mpfr_div(&t[1], &a[1], &t[1], MPFR_RNDN);
+	if (mpfr_sgn(&a[0]) >= 0) {
+		mpfr_set(&z[0], &t[0], r);
+		mpfr_set(&z[1], &t[1], r);
 	} else {
-		int (*fn)(mpfr_ptr, mpfr_srcptr, mpfr_rnd_t);
+		neg = mpfr_signbit(&a[1]);
+		mpfr_abs(&z[0], &t[1], r);
+		mpfr_setsign(&z[1], &t[0], neg, r);
+	}
+}
+
+static void _c_sin(mpfr_ptr z, mpfr_srcptr a, mpfr_srcptr b, mpfr_ptr t,
+	mpfr_rnd_t r)
+{
+	mpfr_sin_cos(&t[0], &t[1], &a[0], MPFR_RNDN);
+	mpfr_sinh_cosh(&t[2], &t[3], &a[1], MPFR_RNDN);
+	mpfr_mul(&z[0], &t[0], &t[3], r);
+	mpfr_mul(&z[1], &t[1], &t[2], r);
+}
+
+static void _c_cos(mpfr_ptr z, mpfr_srcptr a, mpfr_srcptr b, mpfr_ptr t,
+	mpfr_rnd_t r)
+{
+	mpfr_sin_cos(&t[0], &t[1], &a[0], MPFR_RNDN);
+	mpfr_sinh_cosh(&t[2], &t[3], &a[1], MPFR_RNDN);
+	mpfr_neg(&t[0], &t[0], MPFR_RNDN);
+	mpfr_mul(&z[0], &t[1], &t[3], r);
+	mpfr_mul(&z[1], &t[0], &t[2], r);
+}
+
+/* t[2] + i t[3] = b log a, using t[0] and t[1] */
+static void _c_blog(mpfr_ptr t, mpfr_srcptr a, mpfr_srcptr b)
+{
+	_c_logabs(&t[0], a, &t[1], MPFR_RNDN);
+	mpfr_atan2(&t[1], &a[1], &a[0], MPFR_RNDN);
+	mpfr_fmms(&t[2], &b[0], &t[0], &b[1], &t[1], MPFR_RNDN);
+	mpfr_fmma(&t[3], &b[0], &t[1], &b[1], &t[0], MPFR_RNDN);
+}
 
-		fn = lua_touserdata(L, lua_upvalueindex(1));
-		(*fn)(z, luaL_checkudata(L, 2, MPFR), r);
+/*
+ * a^b = exp(b log a), and 0^b is 0 or 1 where it is defined.  The
+ * relative error of the result is the absolute error of b log a: when
+ * that is large, it is computed again with as many more bits as its
+ * exponent.
+ */
+static void _c_pow(mpfr_ptr z, mpfr_srcptr a, mpfr_srcptr b, mpfr_ptr t,
+	mpfr_rnd_t r)
+{
+	__mpfr_struct u[4];
+	mpfr_exp_t e = 0;
+	int i;
+
+	if (mpfr_zero_p(&a[0]) && mpfr_zero_p(&a[1])) {
+		if (mpfr_zero_p(&b[0]) && mpfr_zero_p(&b[1]))
+			mpfr_set_ui(&z[0], 1, r);
+		else if (mpfr_sgn(&b[0]) > 0 && mpfr_zero_p(&b[1]))
+			mpfr_set_zero(&z[0], 1);
+		else
+			mpfr_set_nan(&z[0]);
+		mpfr_set_zero(&z[1], 1);
+		if (mpfr_nan_p(&z[0]))
+			mpfr_set_nan(&z[1]);
+		return;
 	}
-	lua_settop(L, 1);
-	return 1;
+	_c_blog(t, a, b);
+	for (i = 2; i < 4; i++)
+		if (mpfr_regular_p(&t[i]) && mpfr_get_exp(&t[i]) > e)
+			e = mpfr_get_exp(&t[i]);
+	if (e > 0) {
+		for (i = 0; i < 4; i++)
+			mpfr_init2(&u[i], mpfr_get_prec(&t[i]) + e);
+		_c_blog(u, a, b);
+		t = u;
+	}
+	mpfr_exp(&t[0], &t[2], MPFR_RNDN);
+	mpfr_sin_cos(&t[1], &t[2], &t[3], MPFR_RNDN);
+	mpfr_mul(&z[0], &t[0], &t[2], r);
+	mpfr_mul(&z[1], &t[0], &t[1], r);
+	if (t == u)
+		for (i = 0; i < 4; i++)
+			mpfr_clear(&u[i]);
 }
 
-struct fn1u_reg {
+#define CK_EXACT	1	/* t[0] at the result's precision is enough */
+#define CK_SCRATCH	2	/* four values at guard precision */
+
+struct cplx_reg {
 	const char *name;
-	int (*fr)(mpfr_ptr, mpfr_srcptr, mpfr_rnd_t);
-	int (*ui)(mpfr_ptr, unsigned long, mpfr_rnd_t);
+	cplx_kernel fn;
+	int nargs;
+	int scratch;
 };
 
-#define FN2(name) {#name, mpfr_##name, mpfr_##name##_ui}
-static const struct fn1u_reg _fn1u_reg[] = {
-	FN2(sqrt),
-	FN2(zeta),
-	{0, 0}
+static const struct cplx_reg _cplx_reg_fn[] = {
+	{"add", _c_add, 2, 0},
+	{"sub", _c_sub, 2, 0},
+	{"mul", _c_mul, 2, CK_EXACT},
+	{"div", _c_div, 2, CK_SCRATCH},
+	{"pow", _c_pow, 2, CK_SCRATCH},
+	{"conj", _c_conj, 1, 0},
+	{"neg", _c_neg, 1, 0},
+	{"exp", _c_exp, 1, CK_SCRATCH},
+	{"log", _c_log, 1, CK_SCRATCH},
+	{"sqrt", _c_sqrt, 1, CK_SCRATCH},
+	{"sin", _c_sin, 1, CK_SCRATCH},
+	{"cos", _c_cos, 1, CK_SCRATCH},
+	{0, 0, 0, 0}
 };
 
-static void _reg_fn1u(lua_State *L, const struct fn1u_reg *r)
+/*
+ * An operand: a complex or a complex vector (parts at x, x + 1), or a
+ * real, whose imaginary part is the zero here.  Element k is at
+ * x + k * stride.
+ */
+struct cplx_arg {
+	mpfr_ptr x;
+	size_t stride;
+	__mpfr_struct t[2];
+	mp_limb_t limbs[2][128 / CHAR_BIT / sizeof (mp_limb_t)];
+};
+
+static struct cplx *_check_cplx(lua_State *L, int i)
 {
-	for (; r->name; r++) {
-		lua_pushlightuserdata(L, r->fr);
-		lua_pushlightuserdata(L, r->ui);
-		lua_pushcclosure(L, fr_fn1u, 2);
-		lua_setfield(L, -2, r->name);
+	struct cplx *c;
+
+	c = _test_type(L, i, UV_COMPLEX);
+	if (!c)
+		_type_error(L, i, COMPLEX);
+	return c;
+}
+
+static struct cvec *_check_cvec(lua_State *L, int i)
+{
+	struct cvec *v;
+
+	v = _test_type(L, i, UV_CVECTOR);
+	if (!v)
+		_type_error(L, i, CVECTOR);
+	return v;
+}
+
+static struct cplx *_cplx_push(lua_State *L, mpfr_prec_t prec)
+{
+	struct cplx *c;
+	size_t sz;
+
+	sz = mpfr_custom_get_size(prec);
+	c = lua_newuserdata(L, sizeof (*c) + 2 * sz);
+	_fr_init(&c->x[0], prec, (char *) (c + 1));
+	_fr_init(&c->x[1], prec, (char *) (c + 1) + sz);
+	lua_pushvalue(L, UV_COMPLEX);
+	lua_setmetatable(L, -2);
+	return c;
+}
+
+static struct cvec *_cvec_push(lua_State *L, size_t n, mpfr_prec_t prec)
+{
+	struct cvec *v;
+	size_t sz, k;
+	char *limbs;
+
+	sz = mpfr_custom_get_size(prec);
+	if (n > (((size_t) -1) - sizeof (*v)) / (2 * (sizeof (v->x[0]) + sz)))
+		luaL_error(L, "vector too large");
+	v = lua_newuserdata(L, sizeof (*v) + 2 * n * (sizeof (v->x[0]) + sz));
+	v->n = n;
+	v->prec = prec;
+	limbs = (char *) (v->x + 2 * n);
+	for (k = 0; k < 2 * n; k++)
+		_fr_init(&v->x[k], prec, limbs + k * sz);
+	lua_pushvalue(L, UV_CVECTOR);
+	lua_setmetatable(L, -2);
+	return v;
+}
+
+/* operand i of an operation on n elements, or on a scalar if v is 0 */
+static void _cplx_arg(lua_State *L, int i, struct cplx_arg *a, int v,
+	size_t n)
+{
+	struct cplx *c;
+	struct cvec *x;
+	union value y;
+
+	a->stride = 0;
+	if ((c = _test_type(L, i, UV_COMPLEX)) != NULL) {
+		a->x = c->x;
+		return;
+	}
+	if (v && (x = _test_type(L, i, UV_CVECTOR)) != NULL) {
+		luaL_argcheck(L, x->n == n, i, "vector sizes differ");
+		a->x = x->x;
+		a->stride = 2;
+		return;
+	}
+	a->x = a->t;
+	_fr_init(&a->t[1], MPFR_PREC_MIN, a->limbs[1]);
+	mpfr_set_zero(&a->t[1], 1);
+	switch (_check_value(L, i, &y)) {
+	case V_LONG:
+		_fr_init(&a->t[0], sizeof (long) * CHAR_BIT, a->limbs[0]);
+		mpfr_set_si(&a->t[0], y.i, MPFR_RNDN);
+		break;
+	case V_DOUBLE:
+		_fr_init(&a->t[0], DBL_MANT_DIG, a->limbs[0]);
+		mpfr_set_d(&a->t[0], y.d, MPFR_RNDN);
+		break;
+	case V_MPFR:
+		/* the parts must be adjacent: share the limbs of the real,
+		 * which no kernel writes since the result is not an mpfr_t */
+		a->t[0] = *y.fr;
+		break;
+	}
+}
+
+static void _cplx_scratch(lua_State *L, mpfr_ptr t, int kind,
+	mpfr_prec_t prec)
+{
+	if (kind == CK_EXACT) {
+		_pool_get(L, &t[0], prec);
+	} else if (kind == CK_SCRATCH) {
+		_pool_get(L, &t[0], prec + CPLX_GUARD);
+		_pool_get(L, &t[1], prec + CPLX_GUARD);
+		_pool_get(L, &t[2], prec + CPLX_GUARD);
+		_pool_get(L, &t[3], prec + CPLX_GUARD);
+	}
+}
+
+static void _cplx_scratch_done(mpfr_ptr t, int kind)
+{
+	int i;
+
+	for (i = kind == CK_SCRATCH ? 3 : kind == CK_EXACT ? 0 : -1; i >= 0; i--)
+		_pool_put(&t[i]);
+}
+
+/* fn(self, a, [b], [rnd]) : self, upvalues the kernel, nargs, scratch */
+static int cplx_fn(lua_State *L)
+{
+	cplx_kernel fn;
+	struct cplx *z;
+	struct cplx_arg a, b;
+	__mpfr_struct t[4];
+	mpfr_rnd_t r;
+	int nargs, kind;
+
+	fn = lua_touserdata(L, UV_FN(1));
+	nargs = lua_tointeger(L, UV_FN(2));
+	kind = lua_tointeger(L, UV_FN(3));
+	z = _check_cplx(L, 1);
+	_cplx_arg(L, 2, &a, 0, 0);
+	if (nargs == 2)
+		_cplx_arg(L, 3, &b, 0, 0);
+	r = _opt_rnd(L, 2 + nargs);
+	_cplx_scratch(L, t, kind, mpfr_get_prec(&z->x[0]));
+	(*fn)(z->x, a.x, nargs == 2 ? b.x : a.x, t, r);
+	_cplx_scratch_done(t, kind);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* fn elementwise over a complex vector, upvalues as in cplx_fn; the
+ * scratch is drawn once for the whole vector
+ */
+static int cvec_fn(lua_State *L)
+{
+	cplx_kernel fn;
+	struct cvec *z;
+	struct cplx_arg a, b;
+	__mpfr_struct t[4];
+	mpfr_rnd_t r;
+	int nargs, kind;
+	size_t k;
+
+	fn = lua_touserdata(L, UV_FN(1));
+	nargs = lua_tointeger(L, UV_FN(2));
+	kind = lua_tointeger(L, UV_FN(3));
+	z = _check_cvec(L, 1);
+	_cplx_arg(L, 2, &a, 1, z->n);
+	if (nargs == 2)
+		_cplx_arg(L, 3, &b, 1, z->n);
+	else
+		b = a;
+	r = _opt_rnd(L, 2 + nargs);
+	_cplx_scratch(L, t, kind, z->prec);
+	for (k = 0; k < z->n; k++)
+		(*fn)(&z->x[2 * k], a.x + k * a.stride, b.x + k * b.stride,
+			t, r);
+	_cplx_scratch_done(t, kind);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* complex([prec]) : mpfr_complex */
+static int cplx_new(lua_State *L)
+{
+	mpfr_prec_t prec;
+
+	if (lua_isnoneornil(L, 1))
+		prec = mpfr_get_default_prec();
+	else
+		prec = _check_prec(L, 1);
+	_cplx_push(L, prec);
+	return 1;
+}
+
+/* cvector(n, [prec]) : mpfr_cvector */
+static int cvec_new(lua_State *L)
+{
+	lua_Integer n;
+	mpfr_prec_t prec;
+
+	n = luaL_checkinteger(L, 1);
+	luaL_argcheck(L, n >= 0, 1, "size must be non-negative");
+	if (lua_isnoneornil(L, 2))
+		prec = mpfr_get_default_prec();
+	else
+		prec = _check_prec(L, 2);
+	_cvec_push(L, n, prec);
+	return 1;
+}
+
+/* z = x, or x + i y if y is not nil; arguments from index i */
+static void _cplx_set(lua_State *L, mpfr_ptr z, int i)
+{
+	struct cplx_arg a, b;
+	mpfr_rnd_t r;
+	int im;
+
+	im = !lua_isnoneornil(L, i + 1);
+	r = _opt_rnd(L, i + 2);
+	_cplx_arg(L, i, &a, 0, 0);
+	if (im) {
+		luaL_argcheck(L, a.x == a.t, i, "real expected");
+		_cplx_arg(L, i + 1, &b, 0, 0);
+		luaL_argcheck(L, b.x == b.t, i + 1, "real expected");
+	}
+	mpfr_set(&z[0], &a.x[0], r);
+	mpfr_set(&z[1], im ? &b.x[0] : &a.x[1], r);
+}
+
+/* set(self, x, [y], [rnd]) : self */
+static int cplx_set(lua_State *L)
+{
+	_cplx_set(L, _check_cplx(L, 1)->x, 2);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* get(self) : re, im */
+static int cplx_get(lua_State *L)
+{
+	struct cplx *c;
+
+	c = _check_cplx(L, 1);
+	mpfr_set(_fr_push(L, mpfr_get_prec(&c->x[0])), &c->x[0], MPFR_RNDN);
+	mpfr_set(_fr_push(L, mpfr_get_prec(&c->x[1])), &c->x[1], MPFR_RNDN);
+	return 2;
+}
+
+/* get_abs(self, [rnd]) : |self| as a new mpfr_t */
+static int cplx_get_abs(lua_State *L)
+{
+	struct cplx *c;
+
+	c = _check_cplx(L, 1);
+	mpfr_hypot(_fr_push(L, mpfr_get_prec(&c->x[0])), &c->x[0], &c->x[1],
+		_opt_rnd(L, 2));
+	return 1;
+}
+
+/* get_arg(self, [rnd]) : the argument of self as a new mpfr_t */
+static int cplx_get_arg(lua_State *L)
+{
+	struct cplx *c;
+
+	c = _check_cplx(L, 1);
+	mpfr_atan2(_fr_push(L, mpfr_get_prec(&c->x[0])), &c->x[1], &c->x[0],
+		_opt_rnd(L, 2));
+	return 1;
+}
+
+static int cplx_get_prec(lua_State *L)
+{
+	lua_pushinteger(L, mpfr_get_prec(&_check_cplx(L, 1)->x[0]));
+	return 1;
+}
+
+static int cplx_tostring(lua_State *L)
+{
+	struct cplx *c;
+	char *s;
+	int n;
+
+	c = _check_cplx(L, 1);
+	n = 1 + (int) (mpfr_get_prec(&c->x[0]) * 0.30103) + 1;
+	if (mpfr_asprintf(&s, "(%.*Re, %.*Re)", n, &c->x[0], n, &c->x[1]) < 0)
+		return luaL_error(L, "not enough memory");
+	lua_pushstring(L, s);
+	mpfr_free_str(s);
+	return 1;
+}
+
+static int cplx_eq(lua_State *L)
+{
+	struct cplx *x, *y;
+
+	/* Lua also calls __eq for another userdata on either side */
+	x = _test_type(L, 1, UV_COMPLEX);
+	y = _test_type(L, 2, UV_COMPLEX);
+	lua_pushboolean(L, x && y && mpfr_equal_p(&x->x[0], &y->x[0]) &&
+		mpfr_equal_p(&x->x[1], &y->x[1]));
+	return 1;
+}
+
+/* __add and the like, upvalues as in cplx_fn: a new complex at the
+ * largest precision of the complex operands
+ */
+static int cplx_arith(lua_State *L)
+{
+	struct cplx *x;
+	mpfr_prec_t prec = 0;
+	int i, nargs;
+
+	nargs = lua_tointeger(L, UV_FN(2));
+	lua_settop(L, nargs);
+	for (i = 1; i <= nargs; i++) {
+		x = _test_type(L, i, UV_COMPLEX);
+		if (x && mpfr_get_prec(&x->x[0]) > prec)
+			prec = mpfr_get_prec(&x->x[0]);
 	}
+	_cplx_push(L, prec);
+	lua_insert(L, 1);
+	return cplx_fn(L);
+}
+
+static int cvec_len(lua_State *L)
+{
+	lua_pushinteger(L, _check_cvec(L, 1)->n);
+	return 1;
+}
+
+static size_t _cvec_index(lua_State *L, struct cvec *v, int i)
+{
+	lua_Integer k;
+
+	k = luaL_checkinteger(L, i);
+	luaL_argcheck(L, 1 <= k && (size_t) k <= v->n, i,
+		"index out of range");
+	return k - 1;
+}
+
+/* get(self, i) : element i as a new complex */
+static int cvec_get(lua_State *L)
+{
+	struct cvec *v;
+	struct cplx *c;
+	size_t k;
+
+	v = _check_cvec(L, 1);
+	k = _cvec_index(L, v, 2);
+	c = _cplx_push(L, v->prec);
+	mpfr_set(&c->x[0], &v->x[2 * k], MPFR_RNDN);
+	mpfr_set(&c->x[1], &v->x[2 * k + 1], MPFR_RNDN);
+	return 1;
+}
+
+/* set(self, i, x, [y], [rnd]) : self */
+static int cvec_set(lua_State *L)
+{
+	struct cvec *v;
+	size_t k;
+
+	v = _check_cvec(L, 1);
+	k = _cvec_index(L, v, 2);
+	_cplx_set(L, &v->x[2 * k], 3);
+	lua_settop(L, 1);
+	return 1;
 }
 
+static int cvec_get_prec(lua_State *L)
+{
+	lua_pushinteger(L, _check_cvec(L, 1)->prec);
+	return 1;
+}
 
-/* fr -> fr, fr */
-static int fr_fn12(lua_State *L)
+static int cvec_tostring(lua_State *L)
 {
-	int (*fn)(mpfr_ptr, mpfr_ptr, mpfr_srcptr, mpfr_rnd_t);
-	mpfr_ptr x, y, z;
-	mpfr_rnd_t r;
+	struct cvec *v;
 
-	x = luaL_checkudata(L, 1, MPFR);
-	y = luaL_checkudata(L, 2, MPFR);
-	z = luaL_checkudata(L, 3, MPFR);
-	r = _opt_rnd(L, 4);
-	fn = lua_touserdata(L, lua_upvalueindex(1));
-	(*fn)(x, y, z, r);
-	lua_settop(L, 2);
-	return 2;
+	v = _check_cvec(L, 1);
+	lua_pushfstring(L, "%s(%I, %I)", CVECTOR,
+		(lua_Integer) v->n, (lua_Integer) v->prec);
+	return 1;
 }
 
-struct fn12_reg {
-	const char *name;
-	int (*fn)(mpfr_ptr, mpfr_ptr, mpfr_srcptr, mpfr_rnd_t);
+static const luaL_Reg _cplx_reg[] =
+{
+	{"__tostring", cplx_tostring},
+	{"__eq", cplx_eq},
+	{"set", cplx_set},
+	{"get", cplx_get},
+	{"get_abs", cplx_get_abs},
+	{"get_arg", cplx_get_arg},
+	{"get_prec", cplx_get_prec},
+	{0, 0},
 };
 
-static const struct fn12_reg _fn12_reg[] = {
-	FN(modf),
-	FN(sin_cos),
-	FN(sinh_cosh),
+static const luaL_Reg _cvec_reg[] =
+{
+	{"__len", cvec_len},
+	{"__tostring", cvec_tostring},
+	{"get", cvec_get},
+	{"set", cvec_set},
+	{"get_prec", cvec_get_prec},
+	{0, 0},
+};
+
+/* metamethods sharing the upvalues of a _cplx_reg_fn entry */
+static const struct {
+	const char *meta;
+	const char *name;
+} _cplx_meta_reg[] = {
+	{"__add", "add"},
+	{"__sub", "sub"},
+	{"__mul", "mul"},
+	{"__div", "div"},
+	{"__pow", "pow"},
+	{"__unm", "neg"},
 	{0, 0}
 };
 
-static void _reg_fn12(lua_State *L, const struct fn12_reg *r)
+static void _push_cplx_fn(lua_State *L, const struct cplx_reg *r,
+	lua_CFunction f)
 {
-	for (; r->name; r++) {
-		lua_pushlightuserdata(L, r->fn);
-		lua_pushcclosure(L, fr_fn12, 1);
+	_push_upvals(L);
+	lua_pushlightuserdata(L, r->fn);
+	lua_pushinteger(L, r->nargs);
+	lua_pushinteger(L, r->scratch);
+	lua_pushcclosure(L, f, NUPVAL + 3);
+}
+
+static void _open_complex(lua_State *L)
+{
+	const struct cplx_reg *r;
+	int i;
+
+	luaL_getmetatable(L, COMPLEX);
+	_push_upvals(L);
+	luaL_setfuncs(L, _cplx_reg, NUPVAL);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	for (r = _cplx_reg_fn; r->name; r++) {
+		_push_cplx_fn(L, r, cplx_fn);
+		lua_setfield(L, -2, r->name);
+	}
+	for (i = 0; _cplx_meta_reg[i].meta; i++) {
+		for (r = _cplx_reg_fn; strcmp(r->name, _cplx_meta_reg[i].name);
+				r++)
+			;
+		_push_cplx_fn(L, r, cplx_arith);
+		lua_setfield(L, -2, _cplx_meta_reg[i].meta);
+	}
+	lua_pop(L, 1);
+
+	luaL_getmetatable(L, CVECTOR);
+	_push_upvals(L);
+	luaL_setfuncs(L, _cvec_reg, NUPVAL);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	for (r = _cplx_reg_fn; r->name; r++) {
+		_push_cplx_fn(L, r, cvec_fn);
 		lua_setfield(L, -2, r->name);
 	}
+	lua_pop(L, 1);
 }
 
 
-static int fr_fac(lua_State *L)
-{
-	mpfr_ptr z;
-	lua_Integer i;
-	mpfr_rnd_t r;
+/*
+ * Compiled expressions.  compile() parses a formula once into code for a
+ * small register machine whose operations are the functions of the
+ * tables above; calling the result evaluates it without allocating.
+ *
+ * Register 0 is the destination, registers 1..nvars the variables, and
+ * the rest hold constants and intermediate results.  Variables point
+ * straight at the arguments when those are mpfr_t, so nothing is copied.
+ */
+enum { OP_FN0, OP_FN1, OP_FN2, OP_FN2SI, OP_SIFN2 };
+
+union fnptr {
+	int (*f0)(mpfr_ptr, mpfr_rnd_t);
+	int (*f1)(mpfr_ptr, mpfr_srcptr, mpfr_rnd_t);
+	int (*f2)(mpfr_ptr, mpfr_srcptr, mpfr_srcptr, mpfr_rnd_t);
+	int (*f2si)(mpfr_ptr, mpfr_srcptr, long, mpfr_rnd_t);
+	int (*sif2)(mpfr_ptr, long, mpfr_srcptr, mpfr_rnd_t);
+};
 
-	z = luaL_checkudata(L, 1, MPFR);
-	i = lua_tointeger(L, 2);
-	luaL_argcheck(L, 0 <= i && i <= ULONG_MAX, 2,
-		"out of range of unsigned long");
-	r = _opt_rnd(L, 3);
-	mpfr_fac_ui(z, i, r);
-	lua_settop(L, 1);
-	return 1;
-}
+struct insn {
+	int op;
+	int dst, a, b;
+	long imm;
+	union fnptr fn;
+	int cond;	/* COND_* */
+};
 
+/* a numeric literal, read again whenever its register is (re)set */
+struct econst {
+	int reg;
+	int neg;	/* negated by a unary minus */
+	size_t off;	/* position in the source */
+};
 
-static int fr_sgn(lua_State *L)
+struct expr {
+	int nvars, nregs, ninsn, ncst;
+	mpfr_prec_t prec;
+	struct insn *code;
+	struct econst *cst;
+	mpfr_ptr *reg;
+	__mpfr_struct *store;	/* registers' own values */
+	mpfr_ptr *vbase;	/* vector arguments being iterated */
+	size_t *vstride;
+	char *src;
+	/* followed by the arrays above, the limbs and the source */
+};
+
+static struct expr *_check_expr(lua_State *L, int i)
 {
-	mpfr_ptr z;
+	struct expr *e;
 
-	z = luaL_checkudata(L, 1, MPFR);
-	lua_pushinteger(L, mpfr_sgn(z));
-	return 1;
+	e = _test_type(L, i, UV_EXPR);
+	if (!e)
+		_type_error(L, i, EXPR);
+	return e;
 }
 
+/* returns the ternary value */
+static int _insn_run(struct insn *c, mpfr_ptr *reg, mpfr_rnd_t r)
+{
+	switch (c->op) {
+	case OP_FN0:
+		return (*c->fn.f0)(reg[c->dst], r);
+	case OP_FN1:
+		return (*c->fn.f1)(reg[c->dst], reg[c->a], r);
+	case OP_FN2:
+		return (*c->fn.f2)(reg[c->dst], reg[c->a], reg[c->b], r);
+	case OP_FN2SI:
+		return (*c->fn.f2si)(reg[c->dst], reg[c->a], c->imm, r);
+	case OP_SIFN2:
+		return (*c->fn.sif2)(reg[c->dst], c->imm, reg[c->a], r);
+	}
+	return 0;
+}
 
-/* fr -> bool */
-static int fr_fn1p(lua_State *L)
+static void _expr_run(struct expr *e, mpfr_rnd_t r)
 {
-	int (*fn)(mpfr_srcptr);
+	struct insn *c, *end;
 
-	fn = lua_touserdata(L, lua_upvalueindex(1));
-	lua_pushboolean(L, (*fn)(luaL_checkudata(L, 1, MPFR)));
-	return 1;
+	for (c = e->code, end = c + e->ninsn; c < end; c++)
+		_insn_run(c, e->reg, r);
 }
 
-struct fn1p_reg {
-	const char *name;
-	int (*fn)(mpfr_srcptr);
+/*
+ * How an operation passes on the relative errors of its operands: a bound
+ * on its condition number |x f'(x) / f(x)|, taken from the exponents of
+ * the operands a, b and of the result y.
+ */
+enum {
+	COND_NONE,	/* not tracked: needs cond_bits */
+	COND_ONE,	/* at most 1 */
+	COND_SQR,	/* 2 */
+	COND_ADD,	/* |a| / |y| */
+	COND_EXP,	/* |a| */
+	COND_EXP10,	/* |a| log(10) */
+	COND_EXPM1,	/* |a| + 1 */
+	COND_LOG,	/* 1 / |log a| */
+	COND_LOG1P,	/* |a| / ((1 + a) |y|) */
+	COND_SIN,	/* |a| / |y| */
+	COND_TAN,	/* |a| (|y| + 1 / |y|) */
+	COND_SEC,	/* |a| |y| */
+	COND_ASIN,	/* |a| / (sqrt(1 - a^2) |y|) */
+	COND_ACOSH,	/* coth(y) / y */
+	COND_ATANH,	/* sinh(2y) / 2y */
+	COND_POW,	/* |b| and |log y| */
+	COND_ATAN2	/* below 1 / (2 |y|) */
 };
 
-static const struct fn1p_reg _fn1p_reg[] = {
-	FN(nan_p),
-	FN(inf_p),
-	FN(number_p),
-	FN(zero_p),
-	FN(regular_p),
-	FN(integer_p),
-	{0, 0}
+static const struct {
+	int op;
+	void *fn;
+	int cond;
+} _cond_reg[] = {
+	{OP_FN1, (void *) mpfr_set, COND_ONE},
+	{OP_FN1, (void *) mpfr_neg, COND_ONE},
+	{OP_FN1, (void *) mpfr_abs, COND_ONE},
+	{OP_FN1, (void *) mpfr_sqr, COND_SQR},
+	{OP_FN1, (void *) mpfr_sqrt, COND_ONE},
+	{OP_FN1, (void *) mpfr_rec_sqrt, COND_ONE},
+	{OP_FN1, (void *) mpfr_cbrt, COND_ONE},
+	{OP_FN1, (void *) mpfr_log, COND_LOG},
+	{OP_FN1, (void *) mpfr_log2, COND_LOG},
+	{OP_FN1, (void *) mpfr_log10, COND_LOG},
+	{OP_FN1, (void *) mpfr_log1p, COND_LOG1P},
+	{OP_FN1, (void *) mpfr_exp, COND_EXP},
+	{OP_FN1, (void *) mpfr_exp2, COND_EXP},
+	{OP_FN1, (void *) mpfr_exp10, COND_EXP10},
+	{OP_FN1, (void *) mpfr_expm1, COND_EXPM1},
+	{OP_FN1, (void *) mpfr_cos, COND_SIN},
+	{OP_FN1, (void *) mpfr_sin, COND_SIN},
+	{OP_FN1, (void *) mpfr_tan, COND_TAN},
+	{OP_FN1, (void *) mpfr_sec, COND_SEC},
+	{OP_FN1, (void *) mpfr_csc, COND_SEC},
+	{OP_FN1, (void *) mpfr_cot, COND_TAN},
+	{OP_FN1, (void *) mpfr_acos, COND_ASIN},
+	{OP_FN1, (void *) mpfr_asin, COND_ASIN},
+	{OP_FN1, (void *) mpfr_atan, COND_ONE},
+	{OP_FN1, (void *) mpfr_cosh, COND_EXP},
+	{OP_FN1, (void *) mpfr_sinh, COND_EXPM1},
+	{OP_FN1, (void *) mpfr_tanh, COND_ONE},
+	{OP_FN1, (void *) mpfr_sech, COND_EXP},
+	{OP_FN1, (void *) mpfr_csch, COND_EXPM1},
+	{OP_FN1, (void *) mpfr_coth, COND_ONE},
+	{OP_FN1, (void *) mpfr_acosh, COND_ACOSH},
+	{OP_FN1, (void *) mpfr_asinh, COND_ONE},
+	{OP_FN1, (void *) mpfr_atanh, COND_ATANH},
+	{OP_FN1, (void *) mpfr_erf, COND_ONE},
+	{OP_FN2, (void *) mpfr_add, COND_ADD},
+	{OP_FN2, (void *) mpfr_sub, COND_ADD},
+	{OP_FN2, (void *) mpfr_mul, COND_ONE},
+	{OP_FN2, (void *) mpfr_div, COND_ONE},
+	{OP_FN2, (void *) mpfr_pow, COND_POW},
+	{OP_FN2, (void *) mpfr_atan2, COND_ATAN2},
+	{OP_FN2, (void *) mpfr_agm, COND_ONE},
+	{OP_FN2, (void *) mpfr_hypot, COND_ONE},
+	{OP_FN2, (void *) mpfr_min, COND_ONE},
+	{OP_FN2, (void *) mpfr_max, COND_ONE},
+	{OP_FN2SI, (void *) mpfr_add_si, COND_ADD},
+	{OP_FN2SI, (void *) mpfr_sub_si, COND_ADD},
+	{OP_FN2SI, (void *) mpfr_mul_si, COND_ONE},
+	{OP_FN2SI, (void *) mpfr_div_si, COND_ONE},
+	{OP_FN2SI, (void *) mpfr_pow_si, COND_POW},
+	{OP_SIFN2, (void *) mpfr_si_sub, COND_ADD},
+	{OP_SIFN2, (void *) mpfr_si_div, COND_ONE},
+	{0, 0, 0}
 };
 
-static void _reg_fn1p(lua_State *L, const struct fn1p_reg *r)
+static int _insn_cond(int op, union fnptr fn)
 {
-	for (; r->name; r++) {
-		lua_pushlightuserdata(L, r->fn);
-		lua_pushcclosure(L, fr_fn1p, 1);
-		lua_setfield(L, -2, r->name);
+	void *p;
+	int i;
+
+	switch (op) {
+	case OP_FN1:
+		p = (void *) fn.f1;
+		break;
+	case OP_FN2:
+		p = (void *) fn.f2;
+		break;
+	case OP_FN2SI:
+		p = (void *) fn.f2si;
+		break;
+	case OP_SIFN2:
+		p = (void *) fn.sif2;
+		break;
+	default:
+		return COND_ONE;	/* no operand */
 	}
+	for (i = 0; _cond_reg[i].fn; i++)
+		if (_cond_reg[i].op == op && _cond_reg[i].fn == p)
+			return _cond_reg[i].cond;
+	return COND_NONE;
 }
 
+/* 2^k, saturating */
+static double _pow2(mpfr_exp_t k)
+{
+	return ldexp(1, k < -2000 ? -2000 : k > 2000 ? 2000 : k);
+}
 
+/* e^|y| with |y| < 2^ey, as a power of 2 */
+static double _exp_bound(mpfr_exp_t ey)
+{
+	return ey > 20 ? HUGE_VAL : _pow2(3 * _pow2(ey) / 2 + 1);
+}
 
-/* fr,fr|fr,si|fr,d|si,fr|d,fr -> fr */
-static int fr_fn2(lua_State *L)
+/*
+ * the condition number of c for operand x (a if !b) as a factor, from the
+ * exponent ey of the result y
+ */
+static double _insn_kappa(struct insn *c, mpfr_ptr *reg, int b,
+	mpfr_exp_t ey, mpfr_exp_t cond)
 {
-	union {
-		int (*fr_fr)(mpfr_ptr, mpfr_srcptr, mpfr_srcptr, mpfr_rnd_t);
-		int (*fr_si)(mpfr_ptr, mpfr_srcptr, long, mpfr_rnd_t);
-		int (*fr_d)(mpfr_ptr, mpfr_srcptr, double, mpfr_rnd_t);
-		int (*si_fr)(mpfr_ptr, long, mpfr_srcptr, mpfr_rnd_t);
-		int (*d_fr)(mpfr_ptr, double, mpfr_srcptr, mpfr_rnd_t);
-	} fn;
-	mpfr_ptr z;
-	mpfr_rnd_t r;
-	int xtype;
-	union value x, y;
+	mpfr_srcptr x = reg[b ? c->b : c->a];
+	mpfr_exp_t ex = mpfr_regular_p(x) ? mpfr_get_exp(x) : 0;
+	mpfr_exp_t k;
+	mp_limb_t tl[64 / GMP_NUMB_BITS + 1];
+	mpfr_t t;
+
+	switch (c->cond) {
+	case COND_ONE:
+		return 1;
+	case COND_SQR:
+		return 2;
+	case COND_ADD:
+	case COND_SIN:
+		return _pow2(ex - ey + 1);
+	case COND_EXP:
+		return _pow2(ex);
+	case COND_EXP10:
+		return _pow2(ex + 2);
+	case COND_EXPM1:
+		return _pow2(ex > 0 ? ex + 1 : 1);
+	case COND_LOG:
+		return _pow2(2 - ey);
+	case COND_LOG1P:
+		/* 1 / (1 + a) = e^|y| for a < 0 */
+		return mpfr_sgn(x) > 0 ? 1 : _exp_bound(ey);
+	case COND_TAN:
+		return _pow2(ex + (ey > 1 - ey ? ey : 1 - ey) + 1);
+	case COND_SEC:
+		return _pow2(ex + ey);
+	case COND_ASIN:
+		/* sqrt(1 - a^2) >= sqrt(1 - |a|), rounded down */
+		_fr_init(t, 64, tl);
+		if (mpfr_sgn(x) < 0)
+			mpfr_add_ui(t, x, 1, MPFR_RNDD);
+		else
+			mpfr_ui_sub(t, 1, x, MPFR_RNDD);
+		if (!mpfr_regular_p(t))
+			return HUGE_VAL;
+		k = 1 - mpfr_get_exp(t);
+		return _pow2(ex + 1 - ey + k / 2 + (k % 2 > 0));
+	case COND_ACOSH:
+		/* coth(y) / y */
+		return _pow2(1 - ey) + _pow2(2 - 2 * ey);
+	case COND_ATANH:
+		/* sinh(2y) / 2y <= e^|2y| */
+		return _exp_bound(ey + 1);
+	case COND_POW:
+		/* |b| for a, |log y| for b */
+		if (!b && c->op == OP_FN2)
+			return mpfr_regular_p(reg[c->b]) ?
+				_pow2(mpfr_get_exp(reg[c->b])) : 1;
+		if (!b)
+			return fabs((double) c->imm);
+		return (ey < 0 ? -(double) ey : (double) ey) + 1;
+	case COND_ATAN2:
+		return _pow2(-ey);
+	}
+	return _pow2(cond);
+}
 
-	z = luaL_checkudata(L, 1, MPFR);
-	xtype = _check_value(L, 2, &x);
-	r = _opt_rnd(L, 4);
+/* _expr_run_lost results besides the bits lost */
+#define LOST_CANCEL	(-1)	/* a sum cancelled, or no bound */
+#define LOST_UNTRACKED	(-2)	/* COND_NONE on an inexact operand */
+#define LOST_EXACT	(-3)	/* no rounding error at all */
 
-	if (xtype == V_MPFR) {
-		switch(_check_value(L, 3, &y)) {
-		case V_LONG:
-			fn.fr_si = lua_touserdata(L, lua_upvalueindex(2));
-			(*fn.fr_si)(z, x.fr, y.i, r);
-			break;
-		case V_DOUBLE:
-			fn.fr_d = lua_touserdata(L, lua_upvalueindex(3));
-			(*fn.fr_d)(z, x.fr, y.d, r);
-			break;
-		case V_MPFR:
-			fn.fr_fr = lua_touserdata(L, lua_upvalueindex(1));
-			(*fn.fr_fr)(z, x.fr, y.fr, r);
-			break;
-		}
-	} else {
-		y.fr = luaL_checkudata(L, 3, MPFR);
-		switch (xtype) {
-		case V_LONG:
-			fn.si_fr = lua_touserdata(L, lua_upvalueindex(4));
-			if (fn.si_fr) {
-				(*fn.si_fr)(z, x.i, y.fr, r);
-			} else {
-				fn.fr_si = lua_touserdata(L,
-					lua_upvalueindex(2));
-				(*fn.fr_si)(z, y.fr, x.i, r);
-			}
-			break;
-		case V_DOUBLE:
-			fn.d_fr = lua_touserdata(L, lua_upvalueindex(5));
-			if (fn.d_fr) {
-				(*fn.d_fr)(z, x.d, y.fr, r);
-			} else {
-				fn.fr_d = lua_touserdata(L,
-					lua_upvalueindex(3));
-				(*fn.fr_d)(z, y.fr, x.d, r);
-			}
-			break;
+/*
+ * _expr_run, returning the bits of relative accuracy lost or one of the
+ * LOST_* above; cond < 0 makes an operation not tracked an error.
+ *
+ * ce[k] bounds the relative error of register k in units of 2^-w, w the
+ * working precision: to first order, an operation adds its own rounding,
+ * if inexact, to the errors of its operands scaled by its condition
+ * number.  One more bit covers the higher order terms.
+ */
+static mpfr_exp_t _expr_run_lost(struct expr *e, double *ce,
+	mpfr_exp_t cond, mpfr_rnd_t r)
+{
+	mpfr_ptr *reg = e->reg;
+	struct insn *c, *end;
+	mpfr_exp_t ey, lost = 0;
+	double ca, cb, cy;
+	int k, t;
+
+	for (k = 0; k < e->nregs; k++)
+		ce[k] = 0;
+	for (k = 0; k < e->ncst; k++)
+		ce[e->cst[k].reg] = 1;
+	for (c = e->code, end = c + e->ninsn; c < end; c++) {
+		t = _insn_run(c, reg, r);
+		if (lost < 0)
+			continue;
+		ca = c->op == OP_FN0 ? 0 : ce[c->a];
+		cb = c->op == OP_FN2 ? ce[c->b] : 0;
+		cy = !t ? 0 : r == MPFR_RNDN ? 1 : 2;
+		if (!mpfr_number_p(reg[c->dst])) {
+			/* does not depend on the precision */
+			cy = 0;
+		} else if (!ca && !cb) {
+			/* rounded at most once */
+		} else if (mpfr_zero_p(reg[c->dst])) {
+			/* exact if an operand is a zero (thus exact), else
+			 * a cancellation or an underflow */
+			if (!mpfr_zero_p(reg[c->a]) &&
+					!(c->op == OP_FN2 && mpfr_zero_p(reg[c->b])) &&
+					!(c->op != OP_FN1 && c->op != OP_FN2 &&
+						!c->imm))
+				lost = LOST_CANCEL;
+			cy = 0;
+		} else if (c->cond == COND_NONE && cond < 0) {
+			lost = LOST_UNTRACKED;
+		} else {
+			ey = mpfr_get_exp(reg[c->dst]);
+			if (ca)
+				cy += ca * _insn_kappa(c, reg, 0, ey, cond);
+			if (cb)
+				cy += cb * _insn_kappa(c, reg, 1, ey, cond);
 		}
+		if (!(cy < HUGE_VAL))
+			lost = LOST_CANCEL;
+		ce[c->dst] = cy;
 	}
-	lua_settop(L, 1);
+	if (lost < 0)
+		return lost;
+	if (!ce[0])
+		return LOST_EXACT;
+	frexp(ce[0], &k);
+	return k < 0 ? 0 : k + 1;
+}
 
-	return 1;
+/* set the constant registers from the source */
+static void _expr_consts(struct expr *e)
+{
+	struct econst *c;
+	mpfr_ptr z;
+
+	for (c = e->cst; c < e->cst + e->ncst; c++) {
+		z = e->reg[c->reg];
+		mpfr_strtofr(z, e->src + c->off, NULL, 10, MPFR_RNDN);
+		if (c->neg)
+			mpfr_neg(z, z, MPFR_RNDN);
+	}
 }
 
+enum { TK_EOF = 256, TK_NUM, TK_NAME };
 
-struct fn2_reg {
-	const char *name;
-	int (*fr_fr)(mpfr_ptr, mpfr_srcptr, mpfr_srcptr, mpfr_rnd_t);
-	int (*fr_si)(mpfr_ptr, mpfr_srcptr, long, mpfr_rnd_t);
-	int (*fr_d)(mpfr_ptr, mpfr_srcptr, double, mpfr_rnd_t);
-	int (*si_fr)(mpfr_ptr, long, mpfr_srcptr, mpfr_rnd_t);
-	int (*d_fr)(mpfr_ptr, double, mpfr_srcptr, mpfr_rnd_t);
+/* an operand while parsing: a register, or an integer literal */
+struct operand {
+	int reg;	/* -1 for a literal still in imm */
+	int cst;	/* index in cst if reg is a literal's register */
+	long imm;
+	size_t off;
+	int neg;
 };
 
-#define FN3(name) {#name, mpfr_##name, mpfr_##name##_si, mpfr_##name##_d}
-#define FN5(name) {#name, mpfr_##name, mpfr_##name##_si, mpfr_##name##_d, \
-	mpfr_si_##name, mpfr_d_##name}
-
-static const struct fn2_reg _fn2_reg[] = {
-	FN3(add),
-	FN5(sub),
-	FN3(mul),
-	FN5(div),
-	{0, 0}
+struct parser {
+	lua_State *L;
+	const char *src, *p;
+	int tok;
+	const char *tstart;
+	size_t tlen;
+	int tisint;
+	long tint;
+	int nvars;
+	const char **vname;
+	size_t *vlen;
+	struct insn *code;
+	int ninsn;
+	struct econst *cst;
+	int ncst;
+	int nregs;
 };
 
-static void _reg_fn2(lua_State *L, const struct fn2_reg *r)
+static void _perror(struct parser *P, const char *msg)
 {
-	for (; r->name; r++) {
-		lua_pushlightuserdata(L, r->fr_fr);
-		lua_pushlightuserdata(L, r->fr_si);
-		lua_pushlightuserdata(L, r->fr_d);
-		if (r->si_fr) {
-			lua_pushlightuserdata(L, r->si_fr);
-			lua_pushlightuserdata(L, r->d_fr);
-			lua_pushcclosure(L, fr_fn2, 5);
-		} else {
-			lua_pushcclosure(L, fr_fn2, 3);
+	luaL_error(P->L, "compile: %s at position %d", msg,
+		(int) (P->tstart - P->src) + 1);
+}
+
+static void _next(struct parser *P)
+{
+	const char *p = P->p;
+
+	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+		p++;
+	P->tstart = p;
+	if (!*p) {
+		P->tok = TK_EOF;
+	} else if (isdigit((unsigned char) *p) ||
+			(*p == '.' && isdigit((unsigned char) p[1]))) {
+		P->tok = TK_NUM;
+		P->tisint = 1;
+		P->tint = 0;
+		for (; isdigit((unsigned char) *p); p++) {
+			int d = *p - '0';
+
+			if (P->tint > (LONG_MAX - d) / 10)
+				P->tisint = 0;
+			else
+				P->tint = P->tint * 10 + d;
 		}
-		lua_setfield(L, -2, r->name);
+		if (*p == '.') {
+			P->tisint = 0;
+			for (p++; isdigit((unsigned char) *p); p++)
+				;
+		}
+		if (*p == 'e' || *p == 'E') {
+			P->tisint = 0;
+			p++;
+			if (*p == '+' || *p == '-')
+				p++;
+			if (!isdigit((unsigned char) *p)) {
+				P->p = p;
+				_perror(P, "malformed number");
+			}
+			while (isdigit((unsigned char) *p))
+				p++;
+		}
+	} else if (isalpha((unsigned char) *p) || *p == '_') {
+		P->tok = TK_NAME;
+		while (isalnum((unsigned char) *p) || *p == '_')
+			p++;
+	} else if (strchr("+-*/^(),", *p)) {
+		P->tok = *p++;
+	} else {
+		_perror(P, "unexpected character");
 	}
+	P->tlen = p - P->tstart;
+	P->p = p;
 }
 
+static int _emit(struct parser *P, int op, union fnptr fn, int a, int b,
+	long imm)
+{
+	struct insn *c = &P->code[P->ninsn++];
+
+	c->op = op;
+	c->fn = fn;
+	c->a = a;
+	c->b = b;
+	c->imm = imm;
+	c->cond = _insn_cond(op, fn);
+	return c->dst = P->nregs++;
+}
 
-static int fr_pow(lua_State *L)
+/* register holding x, giving a literal one if needed */
+static int _opreg(struct parser *P, struct operand *x)
 {
-	mpfr_ptr x, y, z;
-	mpfr_rnd_t r;
-	lua_Integer i1, i2;
-	int isint1, isint2;
+	struct econst *c;
+
+	if (x->reg < 0) {
+		c = &P->cst[P->ncst];
+		c->reg = P->nregs++;
+		c->off = x->off;
+		c->neg = x->neg;
+		x->cst = P->ncst++;
+		x->reg = c->reg;
+	}
+	return x->reg;
+}
 
-	z = luaL_checkudata(L, 1, MPFR);
-	i1 = lua_tointegerx(L, 2, &isint1);
-	i2 = lua_tointegerx(L, 3, &isint2);
-	r = _opt_rnd(L, 4);
-	if (isint1) {
-		luaL_argcheck(L, 0 <= i1 && i1 <= ULONG_MAX, 2,
-			"out of range of unsigned long");
-		if (isint2) {
-			luaL_argcheck(L, 0 <= i2 && i2 <= ULONG_MAX, 2,
-				"out of range of unsigned long");
-			mpfr_ui_pow_ui(z, i1, i2, r);
-		} else {
-			y = luaL_checkudata(L, 3, MPFR);
-			mpfr_ui_pow(z, i1, y, r);
-		}
+static void _result(struct operand *x, int reg)
+{
+	x->reg = reg;
+	x->cst = -1;
+}
+
+static void _binop(struct parser *P, const char *name, struct operand *x,
+	struct operand *y)
+{
+	const struct fn2_reg *f;
+	union fnptr fn = {0};
+	int reg;
+
+	for (f = _fn2_reg; strcmp(f->name, name); f++)
+		;
+	if (y->reg < 0) {
+		fn.f2si = f->fr_si;
+		reg = _emit(P, OP_FN2SI, fn, _opreg(P, x), 0, y->imm);
+	} else if (x->reg < 0 && f->si_fr) {
+		fn.sif2 = f->si_fr;
+		reg = _emit(P, OP_SIFN2, fn, y->reg, 0, x->imm);
+	} else if (x->reg < 0) {
+		/* add and mul: no si_fr, but they commute */
+		fn.f2si = f->fr_si;
+		reg = _emit(P, OP_FN2SI, fn, y->reg, 0, x->imm);
 	} else {
-		x = luaL_checkudata(L, 2, MPFR);
-		if (isint2) {
-			if (i2 < 0) {
-				luaL_argcheck(L, i2 >= LONG_MIN, 2,
-					"out of range of long");
-				mpfr_pow_si(z, x, i2, r);
-			} else {
-				luaL_argcheck(L, i2 <= ULONG_MAX, 2,
-					"out of range of unsigned long");
-				mpfr_pow_ui(z, x, i2, r);
-			}
-		} else {
-			y = luaL_checkudata(L, 3, MPFR);
-			mpfr_pow(z, x, y, r);
-		}
+		fn.f2 = f->fr_fr;
+		reg = _emit(P, OP_FN2, fn, x->reg, y->reg, 0);
 	}
-	lua_settop(L, 1);
-	return 1;
+	_result(x, reg);
 }
 
-static int fr_root(lua_State *L)
+static void _pow(struct parser *P, struct operand *x, struct operand *y)
 {
-	mpfr_ptr x, z;
-	mpfr_rnd_t r;
-	lua_Integer k;
+	union fnptr fn = {0};
+	int reg;
 
-	z = luaL_checkudata(L, 1, MPFR);
-	x = luaL_checkudata(L, 2, MPFR);
-	k = luaL_checkinteger(L, 3);
-	luaL_argcheck(L, 0 <= k && k <= ULONG_MAX, 3,
-		"out of range of unsigned long");
-	r = _opt_rnd(L, 4);
+	if (y->reg < 0) {
+		fn.f2si = mpfr_pow_si;
+		reg = _emit(P, OP_FN2SI, fn, _opreg(P, x), 0, y->imm);
+	} else {
+		fn.f2 = mpfr_pow;
+		reg = _emit(P, OP_FN2, fn, _opreg(P, x), y->reg, 0);
+	}
+	_result(x, reg);
+}
 
-	mpfr_rootn_ui(z, x, k, r);
+static void _expr(struct parser *P, struct operand *x);
+static void _unary(struct parser *P, struct operand *x);
 
-	lua_settop(L, 1);
-	return 1;
+static int _name_is(struct parser *P, const char *name)
+{
+	return strlen(name) == P->tlen && !memcmp(name, P->tstart, P->tlen);
+}
+
+static void _call(struct parser *P, struct operand *x)
+{
+	struct operand arg[2];
+	const char *name;
+	size_t len;
+	int n = 0, i;
+	union fnptr fn = {0};
+
+	name = P->tstart;
+	len = P->tlen;
+	_next(P);	/* ( */
+	_next(P);
+	if (P->tok != ')') {
+		for (;;) {
+			if (n == 2)
+				_perror(P, "too many arguments");
+			_expr(P, &arg[n++]);
+			if (P->tok != ',')
+				break;
+			_next(P);
+		}
+	}
+	if (P->tok != ')')
+		_perror(P, "')' expected");
+	P->tlen = len;
+	P->tstart = name;
+	for (i = 0; n == 0 && _fn0_reg[i].name; i++) {
+		if (_name_is(P, _fn0_reg[i].name)) {
+			fn.f0 = _fn0_reg[i].fn;
+			_result(x, _emit(P, OP_FN0, fn, 0, 0, 0));
+			goto done;
+		}
+	}
+	for (i = 0; n == 1 && _fn1_reg[i].name; i++) {
+		if (_name_is(P, _fn1_reg[i].name)) {
+			fn.f1 = _fn1_reg[i].fn;
+			goto fn1;
+		}
+	}
+	for (i = 0; n == 1 && _fn1u_reg[i].name; i++) {
+		if (_name_is(P, _fn1u_reg[i].name)) {
+			fn.f1 = _fn1u_reg[i].fr;
+			goto fn1;
+		}
+	}
+	for (i = 0; n == 2 && _fn2f_reg[i].name; i++) {
+		if (_name_is(P, _fn2f_reg[i].name)) {
+			fn.f2 = _fn2f_reg[i].fn;
+			_result(x, _emit(P, OP_FN2, fn, _opreg(P, &arg[0]),
+				_opreg(P, &arg[1]), 0));
+			goto done;
+		}
+	}
+	if (n == 2 && _name_is(P, "pow")) {
+		*x = arg[0];
+		_pow(P, x, &arg[1]);
+		goto done;
+	}
+	_perror(P, "unknown function or wrong number of arguments");
+fn1:
+	_result(x, _emit(P, OP_FN1, fn, _opreg(P, &arg[0]), 0, 0));
+done:
+	_next(P);
 }
 
+static void _primary(struct parser *P, struct operand *x)
+{
+	int i;
+
+	switch (P->tok) {
+	case TK_NUM:
+		x->reg = -1;
+		x->cst = -1;
+		x->imm = P->tint;
+		x->off = P->tstart - P->src;
+		x->neg = 0;
+		if (!P->tisint)
+			_opreg(P, x);
+		_next(P);
+		break;
+	case TK_NAME:
+		if (P->p[strspn(P->p, " \t\r\n")] == '(') {
+			_call(P, x);
+			break;
+		}
+		for (i = 0; i < P->nvars; i++) {
+			if (P->vlen[i] == P->tlen &&
+					!memcmp(P->vname[i], P->tstart, P->tlen))
+				break;
+		}
+		if (i == P->nvars)
+			_perror(P, "unknown variable");
+		_result(x, 1 + i);
+		_next(P);
+		break;
+	case '(':
+		_next(P);
+		_expr(P, x);
+		if (P->tok != ')')
+			_perror(P, "')' expected");
+		_next(P);
+		break;
+	default:
+		_perror(P, "unexpected symbol");
+	}
+}
 
-/* fr,fr -> fr */
-static int fr_fn2f(lua_State *L)
+/* primary ['^' unary], so that -x^2 is -(x^2) and 2^-n works */
+static void _power(struct parser *P, struct operand *x)
 {
-	int (*fn)(mpfr_ptr, mpfr_srcptr, mpfr_srcptr, mpfr_rnd_t);
+	struct operand y;
 
-	fn = lua_touserdata(L, lua_upvalueindex(1));
-	(*fn)(luaL_checkudata(L, 1, MPFR), luaL_checkudata(L, 2, MPFR),
-		luaL_checkudata(L, 3, MPFR), _opt_rnd(L, 4));
-	lua_settop(L, 1);
-	return 1;
+	_primary(P, x);
+	if (P->tok == '^') {
+		_next(P);
+		_unary(P, &y);
+		_pow(P, x, &y);
+	}
 }
 
-struct fn2f_reg {
-	const char *name;
-	int (*fn)(mpfr_ptr, mpfr_srcptr, mpfr_srcptr, mpfr_rnd_t);
-};
+static void _unary(struct parser *P, struct operand *x)
+{
+	union fnptr fn = {0};
 
-static const struct fn2f_reg _fn2f_reg[] = {
-	FN(fmod),
-	FN(remainder),
-	FN(atan2),
-	FN(agm),
-	FN(hypot),
-	FN(min),
-	FN(max),
-	{0, 0}
-};
+	if (P->tok != '-') {
+		_power(P, x);
+		return;
+	}
+	_next(P);
+	_unary(P, x);
+	if (x->reg < 0 && x->imm != LONG_MIN) {
+		x->imm = -x->imm;
+		x->neg = !x->neg;
+	} else if (x->cst >= 0) {
+		P->cst[x->cst].neg = !P->cst[x->cst].neg;
+	} else {
+		fn.f1 = mpfr_neg;
+		_result(x, _emit(P, OP_FN1, fn, _opreg(P, x), 0, 0));
+	}
+}
 
-static void _reg_fn2f(lua_State *L, const struct fn2f_reg *r)
+static void _term(struct parser *P, struct operand *x)
 {
-	for (; r->name; r++) {
-		lua_pushlightuserdata(L, r->fn);
-		lua_pushcclosure(L, fr_fn2f, 1);
-		lua_setfield(L, -2, r->name);
+	struct operand y;
+	int op;
+
+	_unary(P, x);
+	while (P->tok == '*' || P->tok == '/') {
+		op = P->tok;
+		_next(P);
+		_unary(P, &y);
+		_binop(P, op == '*' ? "mul" : "div", x, &y);
 	}
 }
 
-
-/* si,fr -> fr */
-static int fr_fn2n(lua_State *L)
+static void _expr(struct parser *P, struct operand *x)
 {
-	int (*fn)(mpfr_ptr, long, mpfr_srcptr, mpfr_rnd_t);
-	mpfr_ptr x, z;
-	lua_Integer n;
-	mpfr_rnd_t r;
-
-	z = luaL_checkudata(L, 1, MPFR);
-	n = luaL_checkinteger(L, 2);
-	luaL_argcheck(L, LONG_MIN <= n && n <= LONG_MAX, 2,
-		"out of range of long");
-	x = luaL_checkudata(L, 3, MPFR);
-	r = _opt_rnd(L, 4);
-	fn = lua_touserdata(L, lua_upvalueindex(1));
+	struct operand y;
+	int op;
+
+	_term(P, x);
+	while (P->tok == '+' || P->tok == '-') {
+		op = P->tok;
+		_next(P);
+		_term(P, &y);
+		_binop(P, op == '+' ? "add" : "sub", x, &y);
+	}
+}
 
-	(*fn)(z, n, x, r);
-	lua_settop(L, 1);
+/* compile(src, [{vars...}], [prec]) : mpfr_expr */
+static int expr_compile(lua_State *L)
+{
+	struct parser P;
+	struct operand x;
+	struct expr *e;
+	mpfr_prec_t prec;
+	size_t len, limbsz, sz;
+	char *limbs;
+	union fnptr fn = {0};
+	int i;
+
+	P.L = L;
+	P.src = P.p = luaL_checklstring(L, 1, &len);
+	P.nvars = 0;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		P.nvars = lua_rawlen(L, 2);
+	}
+	prec = lua_isnoneornil(L, 3) ? mpfr_get_default_prec() :
+		_check_prec(L, 3);
+	P.vname = lua_newuserdata(L, P.nvars * sizeof (*P.vname));
+	P.vlen = lua_newuserdata(L, P.nvars * sizeof (*P.vlen));
+	for (i = 0; i < P.nvars; i++) {
+		lua_rawgeti(L, 2, i + 1);
+		if (lua_type(L, -1) != LUA_TSTRING)
+			luaL_argerror(L, 2, "variable names must be strings");
+		P.vname[i] = lua_tolstring(L, -1, &P.vlen[i]);
+		lua_pop(L, 1);	/* still referenced by the table */
+	}
+	/* there is at most one instruction or literal per character */
+	P.code = lua_newuserdata(L, (len + 2) * sizeof (*P.code));
+	P.cst = lua_newuserdata(L, (len + 2) * sizeof (*P.cst));
+	P.ninsn = P.ncst = 0;
+	P.nregs = 1 + P.nvars;
+
+	_next(&P);
+	_expr(&P, &x);
+	if (P.tok != TK_EOF)
+		_perror(&P, "unexpected symbol");
+	/* the last instruction writes to the destination */
+	if (x.reg <= P.nvars || !P.ninsn || P.code[P.ninsn - 1].dst != x.reg) {
+		fn.f1 = mpfr_set;
+		_emit(&P, OP_FN1, fn, _opreg(&P, &x), 0, 0);
+	}
+	P.code[P.ninsn - 1].dst = 0;
+
+	limbsz = mpfr_custom_get_size(prec);
+	sz = sizeof (*e) + P.ninsn * sizeof (*e->code) +
+		P.ncst * sizeof (*e->cst) +
+		P.nregs * (sizeof (*e->reg) + sizeof (*e->store) + limbsz) +
+		P.nvars * (sizeof (*e->vbase) + sizeof (*e->vstride)) +
+		len + 1;
+	e = lua_newuserdata(L, sz);
+	e->nvars = P.nvars;
+	e->nregs = P.nregs;
+	e->ninsn = P.ninsn;
+	e->ncst = P.ncst;
+	e->prec = prec;
+	/* every piece is a multiple of the limb size, hence aligned */
+	e->code = (struct insn *) (e + 1);
+	e->cst = (struct econst *) (e->code + e->ninsn);
+	e->reg = (mpfr_ptr *) (e->cst + e->ncst);
+	e->store = (__mpfr_struct *) (e->reg + e->nregs);
+	e->vbase = (mpfr_ptr *) (e->store + e->nregs);
+	e->vstride = (size_t *) (e->vbase + e->nvars);
+	limbs = (char *) (e->vstride + e->nvars);
+	e->src = limbs + e->nregs * limbsz;
+	memcpy(e->code, P.code, e->ninsn * sizeof (*e->code));
+	memcpy(e->cst, P.cst, e->ncst * sizeof (*e->cst));
+	memcpy(e->src, P.src, len + 1);
+	for (i = 0; i < e->nregs; i++) {
+		_fr_init(&e->store[i], prec, limbs + i * limbsz);
+		e->reg[i] = &e->store[i];
+	}
+	_expr_consts(e);
+	lua_pushvalue(L, UV_EXPR);
+	lua_setmetatable(L, -2);
 	return 1;
 }
 
-struct fn2n_reg {
-	const char *name;
-	int (*fn)(mpfr_ptr, long, mpfr_srcptr, mpfr_rnd_t);
-};
-
-static const struct fn2n_reg _fn2n_reg[] = {
-	FN(jn),
-	FN(yn),
-	{0, 0}
-};
-
-static void _reg_fn2n(lua_State *L, const struct fn2n_reg *r)
+/* point variable i at the argument at index arg */
+static void _expr_bind(lua_State *L, struct expr *e, int i, int arg,
+	mpfr_rnd_t r)
 {
-	for (; r->name; r++) {
-		lua_pushlightuserdata(L, r->fn);
-		lua_pushcclosure(L, fr_fn2n, 1);
-		lua_setfield(L, -2, r->name);
+	union value x;
+	mpfr_ptr z;
+
+	z = &e->store[1 + i];
+	switch (_check_value(L, arg, &x)) {
+	case V_LONG:
+		mpfr_set_si(z, x.i, r);
+		break;
+	case V_DOUBLE:
+		mpfr_set_d(z, x.d, r);
+		break;
+	case V_MPFR:
+		z = x.fr;
+		break;
 	}
+	e->reg[1 + i] = z;
 }
 
-
-static int fr_cmp(lua_State *L)
+/* as _expr_bind, for an argument that may also be a vector */
+static void _expr_bind_vec(lua_State *L, struct expr *e, int i, int arg,
+	size_t n, mpfr_rnd_t r)
 {
-	mpfr_ptr x;
-	union value y;
-	int result = 0;
+	union value x;
+	mpfr_ptr z;
 
-	x = luaL_checkudata(L, 1, MPFR);
-	switch (_check_value(L, 2, &y)) {
+	z = &e->store[1 + i];
+	switch (_vec_value(L, arg, n, &x, &e->vstride[i])) {
 	case V_LONG:
-		result = mpfr_cmp_si(x, y.i);
+		mpfr_set_si(z, x.i, r);
 		break;
 	case V_DOUBLE:
-		result = mpfr_cmp_d(x, y.d);
+		mpfr_set_d(z, x.d, r);
 		break;
 	case V_MPFR:
-		result = mpfr_cmp(x, y.fr);
+		z = x.fr;
 		break;
 	}
-	lua_pushinteger(L, result);
-	return 1;
+	e->vbase[i] = z;
 }
 
-static int fr_cmpabs(lua_State *L)
+/* self(dst, vars..., [rnd]) : dst
+ * dst and the variables may be vectors, evaluated element by element
+ */
+static int expr_call(lua_State *L)
 {
-	mpfr_ptr x, y;
-
-	x = luaL_checkudata(L, 1, MPFR);
-	y = luaL_checkudata(L, 2, MPFR);
-	lua_pushinteger(L, mpfr_cmpabs(x, y));
+	struct expr *e;
+	struct vec *v;
+	mpfr_rnd_t r;
+	size_t k;
+	int i;
+
+	e = _check_expr(L, 1);
+	r = _opt_rnd(L, 3 + e->nvars);
+	v = _test_type(L, 2, UV_VECTOR);
+	if (!v) {
+		e->reg[0] = _check_fr(L, 2);
+		for (i = 0; i < e->nvars; i++)
+			_expr_bind(L, e, i, 3 + i, r);
+		_expr_run(e, r);
+	} else {
+		for (i = 0; i < e->nvars; i++)
+			_expr_bind_vec(L, e, i, 3 + i, v->n, r);
+		for (k = 0; k < v->n; k++) {
+			e->reg[0] = &v->x[k];
+			for (i = 0; i < e->nvars; i++)
+				e->reg[1 + i] = e->vbase[i] +
+					k * e->vstride[i];
+			_expr_run(e, r);
+		}
+	}
+	lua_settop(L, 2);
 	return 1;
 }
 
-
-/* fr,fr -> bool */
-static int fr_fn2p(lua_State *L)
+static int expr_get_prec(lua_State *L)
 {
-	int (*fn)(mpfr_srcptr, mpfr_srcptr);
-
-	fn = lua_touserdata(L, lua_upvalueindex(1));
-	lua_pushboolean(L, (*fn)(luaL_checkudata(L, 1, MPFR),
-		luaL_checkudata(L, 2, MPFR)));
+	lua_pushinteger(L, _check_expr(L, 1)->prec);
 	return 1;
 }
 
-struct fn2p_reg {
-	const char *name;
-	int (*fn)(mpfr_srcptr, mpfr_srcptr);
-};
-
-static const struct fn2p_reg _fn2p_reg[] = {
-	FN(greater_p),
-	FN(greaterequal_p),
-	FN(less_p),
-	FN(lessequal_p),
-	FN(equal_p),
-	FN(lessgreater_p),
-	FN(unordered_p),
-	{0, 0}
+/*
+ * Ziv's strategy: evaluate at a working precision a little above the
+ * target, and if the result, with its error bound, cannot be rounded
+ * correctly, try again with more guard bits.  The first pass is nearly
+ * always enough, so it must cost no more than one evaluation.
+ */
+struct ziv {
+	mpfr_prec_t target, w, max;
+	lua_Number growth;
+	lua_Integer guard, err;
+	lua_Integer cond;	/* cond_bits, or -1 */
 };
 
-static void _reg_fn2p(lua_State *L, const struct fn2p_reg *r)
+static void _ziv_opts(lua_State *L, int i, struct ziv *z)
 {
-	for (; r->name; r++) {
-		lua_pushlightuserdata(L, r->fn);
-		lua_pushcclosure(L, fr_fn2p, 1);
-		lua_setfield(L, -2, r->name);
+	lua_Integer max;
+
+	z->guard = 16;
+	z->growth = 2;
+	z->cond = -1;
+	max = 8 * (lua_Integer) z->target + 1024;
+	if (!lua_isnoneornil(L, i)) {
+		luaL_checktype(L, i, LUA_TTABLE);
+		z->guard = _opt_field(L, i, "guard_bits", z->guard, 1);
+		z->err = _opt_field(L, i, "err_bits", z->err, 0);
+		z->cond = _opt_field(L, i, "cond_bits", z->cond, 0);
+		max = _opt_field(L, i, "max_prec", max, z->target);
+		if (lua_getfield(L, i, "growth") != LUA_TNIL) {
+			z->growth = lua_tonumber(L, -1);
+			luaL_argcheck(L, z->growth > 1, i,
+				"growth must be a number > 1");
+		}
+		lua_pop(L, 1);
 	}
+	z->max = max > MPFR_PREC_MAX ? MPFR_PREC_MAX : max;
+	z->w = z->target + z->err + z->guard;
+	if (z->w > z->max)
+		z->w = z->max;
 }
 
-
-static int fr_fma(lua_State *L)
+/*
+ * whether y, good to w - err - lost bits, rounds correctly to the target,
+ * lost being as _expr_run_lost returns.  NaN and infinities do not depend
+ * on the precision, and a zero with a bound is exact.
+ */
+static int _ziv_done(struct ziv *z, mpfr_ptr y, mpfr_exp_t lost,
+	mpfr_rnd_t r)
 {
-	mpfr_fma(luaL_checkudata(L, 1, MPFR),
-		luaL_checkudata(L, 2, MPFR),
-		luaL_checkudata(L, 3, MPFR),
-		luaL_checkudata(L, 4, MPFR),
-		_opt_rnd(L, 5));
-	lua_settop(L, 1);
-	return 1;
-}
+	mpfr_prec_t good;
 
-static int fr_fms(lua_State *L)
-{
-	mpfr_fms(luaL_checkudata(L, 1, MPFR),
-		luaL_checkudata(L, 2, MPFR),
-		luaL_checkudata(L, 3, MPFR),
-		luaL_checkudata(L, 4, MPFR),
-		_opt_rnd(L, 5));
-	lua_settop(L, 1);
-	return 1;
+	if (mpfr_nan_p(y) || mpfr_inf_p(y) || lost == LOST_EXACT)
+		return 1;
+	if (lost < 0 || z->err + lost >= z->w)
+		return 0;
+	if (mpfr_zero_p(y))
+		return 1;
+	good = z->w - z->err - lost;
+	if (mpfr_can_round(y, good, MPFR_RNDN, MPFR_RNDZ,
+		z->target + (r == MPFR_RNDN)))
+		return 1;
+	/* an exact result never passes the test above; rounding to nearest
+	 * still gets it right if it fits the target, the error being below
+	 * a quarter of its ulp */
+	return r == MPFR_RNDN && good >= z->target + 2 &&
+		mpfr_min_prec(y) <= z->target;
 }
 
-
-static int fr_prec_round(lua_State *L)
+static void _ziv_next(struct ziv *z)
 {
-	mpfr_prec_round(luaL_checkudata(L, 1, MPFR),
-		_check_prec(L, 2), _opt_rnd(L, 3));
-	lua_settop(L, 1);
-	return 1;
-}
+	lua_Number g = z->guard * z->growth;
 
-static int fr_can_round(lua_State *L)
-{
-	lua_pushboolean(L, mpfr_can_round(
-		luaL_checkudata(L, 1, MPFR),	/* z */
-		luaL_checkinteger(L, 2),	/* err */
-		luaL_checkinteger(L, 3),	/* r1 */
-		luaL_checkinteger(L, 4),	/* r2 */
-		_check_prec(L, 5)));		/* prec */
-	return 1;
+	z->guard = g < z->guard + 1 ? z->guard + 1 : g;
+	if (z->guard > z->max - z->target - z->err)
+		z->w = z->max;
+	else
+		z->w = z->target + z->err + z->guard;
 }
 
-
-static int fr_set_prec(lua_State *L)
+/*
+ * Evaluate the expression at index i into y, at y's precision, with the
+ * variables at indices arg, arg + 1, ...  The registers come from a
+ * scratch kept as the expression's uservalue and grown as needed.  The
+ * variables must have been checked.  Returns the bits lost as
+ * _expr_run_lost does, with cond bounding the functions not tracked.
+ */
+static mpfr_exp_t _expr_eval(lua_State *L, int i, mpfr_ptr y, int arg,
+	mpfr_exp_t cond)
 {
-	mpfr_set_prec(luaL_checkudata(L, 1, MPFR), _check_prec(L, 2));
-	return 0;
+	struct expr *e = lua_touserdata(L, i);
+	__mpfr_struct *reg;
+	double *ce;
+	mpfr_prec_t w, prec;
+	size_t limbsz, sz;
+	union value x;
+	mpfr_exp_t lost;
+	char *limbs;
+	int k;
+
+	w = mpfr_get_prec(y);
+	prec = w < 64 ? 64 : w;	/* integer variables are exact */
+	limbsz = mpfr_custom_get_size(prec);
+	sz = e->nregs * (sizeof (*reg) + sizeof (*ce) + limbsz);
+	lua_getuservalue(L, i);
+	reg = lua_touserdata(L, -1);
+	if (lua_rawlen(L, -1) < sz) {
+		reg = lua_newuserdata(L, sz);
+		lua_setuservalue(L, i);
+	}
+	lua_pop(L, 1);
+	ce = (double *) (reg + e->nregs);
+	limbs = (char *) (ce + e->nregs);
+	/* nothing below raises an error while e->reg points at scratch */
+	e->reg[0] = y;
+	for (k = 1; k < e->nregs; k++) {
+		_fr_init(&reg[k], k <= e->nvars ? prec : w,
+			limbs + k * limbsz);
+		e->reg[k] = &reg[k];
+	}
+	for (k = 0; k < e->nvars; k++) {
+		switch (_check_value(L, arg + k, &x)) {
+		case V_LONG:
+			mpfr_set_si(&reg[1 + k], x.i, MPFR_RNDN);
+			break;
+		case V_DOUBLE:
+			mpfr_set_d(&reg[1 + k], x.d, MPFR_RNDN);
+			break;
+		case V_MPFR:
+			e->reg[1 + k] = x.fr;
+			break;
+		}
+	}
+	_expr_consts(e);
+	lost = _expr_run_lost(e, ce, cond, MPFR_RNDN);
+	for (k = 0; k < e->nregs; k++)
+		e->reg[k] = &e->store[k];
+	return lost;
 }
 
-static int fr_get_prec(lua_State *L)
+/* y = f(args...) at y's precision; f is at index i, y at index i + 1 and
+ * the n arguments follow.  Returns the bits lost, which only a compiled
+ * expression can tell, as _expr_eval does.
+ */
+static mpfr_exp_t _eval_at(lua_State *L, int i, mpfr_ptr y, int n,
+	mpfr_exp_t cond)
 {
-	mpfr_ptr z;
+	int k;
 
-	z = luaL_checkudata(L, 1, MPFR);
-	lua_pushinteger(L, mpfr_get_prec(z));
-	return 1;
+	if (lua_type(L, i) != LUA_TFUNCTION)
+		return _expr_eval(L, i, y, i + 2, cond);
+	for (k = 0; k < n + 2; k++)
+		lua_pushvalue(L, i + k);
+	lua_call(L, 1 + n, 0);
+	return 0;
 }
 
-static int fr_min_prec(lua_State *L)
+/* the f argument of eval_correct and newton, taking n variables */
+static struct expr *_check_fn(lua_State *L, int i, int n)
 {
-	lua_pushinteger(L, mpfr_min_prec(luaL_checkudata(L, 1, MPFR)));
-	return 1;
+	struct expr *e;
+
+	e = _test_type(L, i, UV_EXPR);
+	if (!e)
+		luaL_checktype(L, i, LUA_TFUNCTION);
+	else if (e->nvars != n)
+		luaL_argerror(L, i, lua_pushfstring(L,
+			"expression must take %d variables", n));
+	return e;
 }
 
-static int fr_copysign(lua_State *L)
+/* eval_correct(f, args, prec, [rnd], [opts]) : z, iterations, bits
+ * f is a compiled expression taking the values in args, or a function
+ * called as f(y, args...) that sets y to within 2^err_bits ulps.
+ * Returns nil and a message if max_prec is reached first.
+ *
+ * The error of an expression is bounded through the condition number of
+ * each operation, err_bits adding to it.  That of the special functions,
+ * rint, frac, fmod and remainder is not tracked: given an inexact
+ * argument, they need opts.cond_bits, a bound on log2 of theirs.
+ */
+static int fr_eval_correct(lua_State *L)
 {
-	mpfr_ptr x, y, z;
+	struct expr *e;
+	struct ziv z;
+	union value x;
+	mpfr_ptr y, dst;
+	mpfr_exp_t lost;
 	mpfr_rnd_t r;
+	int nargs, iter, i;
 
-	luaL_checkudata(L, 1, MPFR),
-	luaL_checkudata(L, 2, MPFR),
-	luaL_checkudata(L, 3, MPFR),
-	_opt_rnd(L, 4),
-
-	mpfr_copysign(z, x, y, r);
-	lua_settop(L, 1);
-	return 1;
+	nargs = 0;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		nargs = lua_rawlen(L, 2);
+	}
+	e = _check_fn(L, 1, nargs);
+	z.target = _check_prec(L, 3);
+	r = _opt_rnd(L, 4);
+	z.err = e ? 0 : 2;
+	_ziv_opts(L, 5, &z);
+	lua_settop(L, 5);
+	dst = _fr_push(L, z.target);	/* 6 */
+	luaL_checkstack(L, nargs + 2 + nargs + 2, "too many arguments");
+	lua_pushvalue(L, 1);	/* 7 */
+	y = _fr_push(L, z.w);	/* 8 */
+	for (i = 0; i < nargs; i++) {
+		lua_rawgeti(L, 2, i + 1);
+		if (e)
+			_check_value(L, -1, &x);
+	}
+	for (iter = 1; ; iter++) {
+		lost = _eval_at(L, 7, y, nargs, z.cond);
+		if (lost == LOST_UNTRACKED)
+			return luaL_error(L, "eval_correct: cannot bound the "
+				"error of %s without cond_bits", e->src);
+		if (_ziv_done(&z, y, lost, r))
+			break;
+		if (z.w >= z.max) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "cannot round correctly within "
+				"max_prec (%d bits)", (int) z.max);
+			return 2;
+		}
+		_ziv_next(&z);
+		_fr_resize(L, 8, y, z.w);
+	}
+	_ternary = mpfr_set(dst, y, r);
+	lua_pushvalue(L, 6);
+	lua_pushinteger(L, iter);
+	lua_pushinteger(L, z.w);
+	return 3;
 }
 
-
-static int fr_free_cache(lua_State *L)
+/* one Newton step x -= f(x) / f'(x) at precision w, see fr_newton */
+static void _newton_step(lua_State *L, mpfr_prec_t w, mpfr_prec_t dw)
 {
-	mpfr_free_cache();
-	return 0;
+	mpfr_ptr fx, dfx, x;
+
+	fx = lua_touserdata(L, 8);
+	dfx = lua_touserdata(L, 11);
+	x = lua_touserdata(L, 9);
+	_fr_resize(L, 8, fx, w);
+	_eval_at(L, 7, fx, 1, 0);
+	/* the derivative only scales a correction of about w/2 bits */
+	_fr_resize(L, 11, dfx, dw < w ? dw : w);
+	_eval_at(L, 10, dfx, 1, 0);
+	mpfr_div(fx, fx, dfx, MPFR_RNDN);
+	if (!mpfr_number_p(fx))
+		luaL_error(L, "newton: step is not a number");
+	mpfr_sub(x, x, fx, MPFR_RNDN);
 }
 
-static int fr_set_default_prec(lua_State *L)
+/* move x (at index 9) to precision w, keeping its value */
+static mpfr_ptr _newton_grow(lua_State *L, mpfr_prec_t w)
 {
-	mpfr_set_default_prec(_check_prec(L, 1));
-	return 0;
+	mpfr_ptr t = lua_touserdata(L, 13);
+
+	_fr_resize(L, 13, t, w);
+	mpfr_set(t, lua_touserdata(L, 9), MPFR_RNDN);
+	lua_pushvalue(L, 9);
+	lua_copy(L, 13, 9);
+	lua_copy(L, 13, 12);
+	lua_replace(L, 13);
+	return t;
 }
 
-static int fr_get_default_prec(lua_State *L)
+/* newton(f, df, x0, prec, [rnd], [opts]) : x, iterations
+ * f and df are compiled expressions of one variable, or functions called
+ * as f(y, x) that set y.  The first steps run at a low precision until
+ * they converge, then each step doubles it up to prec.  The result is
+ * good to about prec bits but is not correctly rounded.
+ */
+static int fr_newton(lua_State *L)
 {
-	lua_pushinteger(L, mpfr_get_default_prec());
-	return 1;
+	mpfr_prec_t target, start, p[64];
+	lua_Integer guard, maxiter;
+	union value v;
+	mpfr_ptr x, dx, dst;
+	mpfr_rnd_t r;
+	int n, iter, t;
+
+	_check_fn(L, 1, 1);
+	_check_fn(L, 2, 1);
+	t = _check_value(L, 3, &v);
+	target = _check_prec(L, 4);
+	r = _opt_rnd(L, 5);
+	guard = 16;
+	start = 64;
+	maxiter = 100;
+	if (!lua_isnoneornil(L, 6)) {
+		luaL_checktype(L, 6, LUA_TTABLE);
+		guard = _opt_field(L, 6, "guard_bits", guard, 1);
+		start = _opt_field(L, 6, "start_prec", start, MPFR_PREC_MIN);
+		maxiter = _opt_field(L, 6, "max_iter", maxiter, 1);
+	}
+	luaL_argcheck(L, target <= MPFR_PREC_MAX - guard, 4,
+		"precision too large");
+	/* levels from the top down; each halving must make progress */
+	if (start < 4 * guard)
+		start = 4 * guard;
+	p[n = 0] = target + guard;
+	while (p[n] > start && n < 63) {
+		p[n + 1] = p[n] / 2 + guard;
+		n++;
+	}
+	lua_settop(L, 6);
+	lua_pushvalue(L, 1);	/* 7: f */
+	_fr_push(L, p[n]);	/* 8: f(x) */
+	x = _fr_push(L, p[n]);	/* 9: x */
+	lua_pushvalue(L, 2);	/* 10: df */
+	_fr_push(L, p[n]);	/* 11: df(x) */
+	lua_pushvalue(L, 9);	/* 12: x */
+	_fr_push(L, p[n]);	/* 13: spare for x */
+	switch (t) {
+	case V_LONG:
+		mpfr_set_si(x, v.i, MPFR_RNDN);
+		break;
+	case V_DOUBLE:
+		mpfr_set_d(x, v.d, MPFR_RNDN);
+		break;
+	case V_MPFR:
+		mpfr_set(x, v.fr, MPFR_RNDN);
+		break;
+	}
+	dx = lua_touserdata(L, 8);
+	for (iter = 1; ; iter++) {
+		_newton_step(L, p[n], p[n] / 2 + guard);
+		if (mpfr_zero_p(dx) || mpfr_zero_p(x) || mpfr_get_exp(x) -
+			mpfr_get_exp(dx) >= p[n] / 2)
+			break;
+		if (iter >= maxiter)
+			luaL_error(L, "newton: no convergence at %d bits",
+				(int) p[n]);
+	}
+	while (n-- > 0) {
+		x = _newton_grow(L, p[n]);
+		_newton_step(L, p[n], p[n] / 2 + guard);
+		iter++;
+	}
+	dst = _fr_push(L, target);
+	_ternary = mpfr_set(dst, x, r);
+	lua_pushinteger(L, iter);
+	return 2;
 }
 
-static int fr_set_default_rounding_mode(lua_State *L)
+static const luaL_Reg _expr_reg[] =
 {
-	mpfr_set_default_rounding_mode(luaL_checkinteger(L, 1));
-	return 0;
-}
+	{"__call", expr_call},
+	{"get_prec", expr_get_prec},
+	{0, 0},
+};
 
-static int fr_get_default_rounding_mode(lua_State *L)
+static void _open_expr(lua_State *L)
 {
-	lua_pushinteger(L, mpfr_get_default_rounding_mode());
-	return 1;
+	luaL_getmetatable(L, EXPR);
+	_push_upvals(L);
+	luaL_setfuncs(L, _expr_reg, NUPVAL);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
 }
 
+
 static const luaL_Reg _reg[] = 
 {
 	{"__tostring", fr_tostring},
-	{"__gc", fr_gc},
+	{"__unm", fr_arith_unm},
+	{"__mod", fr_arith_mod},
+	{"__pow", fr_arith_pow},
+	{"__eq", fr_arith_eq},
+	{"__lt", fr_arith_lt},
+	{"__le", fr_arith_le},
 	{"new", fr_new},
+	{"vector", vec_new},
+	{"interval", ival_new},
+	{"complex", cplx_new},
+	{"cvector", cvec_new},
+	{"parallel_map", vec_parallel_map},
+	{"parse_many", fr_parse_many},
+	{"sum", fr_sum},
+	{"series_sum", fr_series_sum},
+	{"constant_cache", fr_constant_cache},
+	{"dump", fr_dump},
+	{"load", fr_load},
+	{"dump_many", fr_dump_many},
+	{"load_many", fr_load_many},
+	{"open_array", fr_open_array},
+	{"sync_array", fr_sync_array},
+	{"compile", expr_compile},
+	{"eval_correct", fr_eval_correct},
+	{"newton", fr_newton},
+	{"dot", fr_dot},
 	{"tostring", fr_tostring},
+	{"tohex", fr_tohex},
+	{"tobin", fr_tobin},
 	{"tonumber", fr_tonumber},
+	{"write_digits", fr_write_digits},
 	{"set", fr_set},
 	{"set_nan", fr_set_nan},
 	{"set_inf", fr_set_inf},
@@ -961,10 +7577,18 @@ static const luaL_Reg _reg[] =
 	{"min_prec", fr_min_prec},
 	{"copysign", fr_copysign},
 	{"free_cache", fr_free_cache},
+	{"pool_config", fr_pool_config},
+	{"pool_stats", fr_pool_stats},
+	{"memo_config", fr_memo_config},
+	{"memo_stats", fr_memo_stats},
+	{"conv_config", fr_conv_config},
 	{"set_default_prec", fr_set_default_prec},
 	{"get_default_prec", fr_get_default_prec},
 	{"set_default_rounding_mode", fr_set_default_rounding_mode},
 	{"get_default_rounding_mode", fr_get_default_rounding_mode},
+	{"last_ternary", fr_last_ternary},
+	{"flags", fr_flags},
+	{"clear_flags", fr_clear_flags},
 	{0, 0},
 };
 
@@ -980,24 +7604,150 @@ static void _reg_rnd(lua_State *L)
 	}
 }
 
+static void _reg_flags(lua_State *L)
+{
+	static const struct {
+		const char *name;
+		unsigned flag;
+	} flags[] = {
+		{"FLAGS_UNDERFLOW", MPFR_FLAGS_UNDERFLOW},
+		{"FLAGS_OVERFLOW", MPFR_FLAGS_OVERFLOW},
+		{"FLAGS_NAN", MPFR_FLAGS_NAN},
+		{"FLAGS_INEXACT", MPFR_FLAGS_INEXACT},
+		{"FLAGS_ERANGE", MPFR_FLAGS_ERANGE},
+#ifdef MPFR_FLAGS_DIVBY0
+		{"FLAGS_DIVBY0", MPFR_FLAGS_DIVBY0},
+#endif
+		{"FLAGS_ALL", MPFR_FLAGS_ALL},
+	};
+	int n = sizeof flags / sizeof flags[0];
+
+	while (n--) {
+		lua_pushinteger(L, flags[n].flag);
+		lua_setfield(L, -2, flags[n].name);
+	}
+}
+
+/*
+ * The C interface of lua_mpfr.h.  Callers are foreign C functions
+ * without the upvalues, so the metatables are looked up by name.
+ */
+static mpfr_ptr _api_test(lua_State *L, int i)
+{
+	return luaL_testudata(L, i, MPFR);
+}
+
+static mpfr_ptr _api_check(lua_State *L, int i)
+{
+	return luaL_checkudata(L, i, MPFR);
+}
+
+static void _api_prec(lua_State *L, mpfr_prec_t prec)
+{
+	if (prec < MPFR_PREC_MIN || prec > MPFR_PREC_MAX)
+		luaL_error(L, "precision out of range");
+}
+
+static mpfr_ptr _api_push(lua_State *L, mpfr_prec_t prec)
+{
+	mpfr_ptr z;
+
+	_api_prec(L, prec);
+	z = _fr_new(L, prec);
+	luaL_setmetatable(L, MPFR);
+	return z;
+}
+
+static mpfr_ptr _api_testvector(lua_State *L, int i, size_t *n)
+{
+	struct vec *v;
+
+	v = luaL_testudata(L, i, VECTOR);
+	if (!v)
+		return NULL;
+	*n = v->n;
+	return v->x;
+}
+
+static mpfr_ptr _api_checkvector(lua_State *L, int i, size_t *n)
+{
+	struct vec *v;
+
+	v = luaL_checkudata(L, i, VECTOR);
+	*n = v->n;
+	return v->x;
+}
+
+static mpfr_ptr _api_pushvector(lua_State *L, size_t n, mpfr_prec_t prec)
+{
+	struct vec *v;
+
+	_api_prec(L, prec);
+	v = _vec_new(L, n, prec);
+	luaL_setmetatable(L, VECTOR);
+	return v->x;
+}
+
+static const struct lmpfr_api _api = {
+	LMPFR_API_VERSION,
+	_api_test,
+	_api_check,
+	_api_push,
+	_api_testvector,
+	_api_checkvector,
+	_api_pushvector,
+};
+
 LUALIB_API int luaopen_mpfr(lua_State *L)
 {
+	_default_rnd = mpfr_get_default_rounding_mode();
+	luaL_newmetatable(L, VECTOR);
+	lua_pop(L, 1);
+	luaL_newmetatable(L, EXPR);
+	lua_pop(L, 1);
+	luaL_newmetatable(L, INTERVAL);
+	lua_pop(L, 1);
+	luaL_newmetatable(L, COMPLEX);
+	lua_pop(L, 1);
+	luaL_newmetatable(L, CVECTOR);
+	lua_pop(L, 1);
+	luaL_newmetatable(L, MAPPING);
+	lua_pushcfunction(L, array_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+	/* made after package's table of loaded libraries, so finalized
+	 * before this library is unloaded */
+	lua_newuserdata(L, 1);
+	lua_newtable(L);
+	lua_pushcfunction(L, _workers_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+	lua_setfield(L, LUA_REGISTRYINDEX, WORKERS_KEY);
 	luaL_newmetatable(L, MPFR);
-	luaL_setfuncs(L, _reg, 0);
+	_push_upvals(L);
+	luaL_setfuncs(L, _reg, NUPVAL);
 	lua_pushliteral(L, VERSION);
 	lua_setfield(L, -2, "version");
 	lua_pushvalue(L, -1);
 	lua_setfield(L, -2, "__index");
 	_reg_fn0(L, _fn0_reg);
-	_reg_fn1(L, _fn1_reg);
+	_reg_fn1(L, _fn1_reg, fr_fn1);
 	_reg_fn12(L, _fn12_reg);
 	_reg_fn1u(L, _fn1u_reg);
 	_reg_fn1p(L, _fn1p_reg);
-	_reg_fn2(L, _fn2_reg);
+	_reg_fn2(L, _fn2_reg, fr_fn2);
+	_reg_meta2(L, _fn2_reg);
 	_reg_fn2f(L, _fn2f_reg);
 	_reg_fn2n(L, _fn2n_reg);
 	_reg_fn2p(L, _fn2p_reg);
 	_reg_rnd(L);
+	_reg_flags(L);
+	_open_vector(L);
+	_open_expr(L);
+	_open_interval(L);
+	_open_complex(L);
+	lua_pushlightuserdata(L, (void *) &_api);
+	lua_setfield(L, LUA_REGISTRYINDEX, LMPFR_API);
 
 	return 1;
 }
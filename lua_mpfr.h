@@ -0,0 +1,76 @@
+/*
+ * C interface of the mpfr module, for other native modules.
+ *
+ * luaopen_mpfr stores a table of functions in the registry under
+ * LMPFR_API; a module calls lmpfr_import once (in its luaopen) and can
+ * then check and push the values of this module, working on their
+ * limbs in place:
+ *
+ *	lmpfr_import(L);
+ *	...
+ *	mpfr_ptr x = lmpfr_check(L, 1);
+ *	mpfr_ptr y = lmpfr_push(L, mpfr_get_prec(x));
+ *	mpfr_sqrt(y, x, MPFR_RNDN);
+ *
+ * The values use MPFR's custom interface: never call mpfr_set_prec,
+ * mpfr_clear, or a growing mpfr_prec_round on them; push a new value
+ * for another precision.  A pointer stays valid while the Lua value is
+ * reachable.
+ */
+
+#ifndef LUA_MPFR_H
+#define LUA_MPFR_H
+
+#include <stddef.h>
+
+#include <mpfr.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#define LMPFR_API	"mpfr_api"
+#define LMPFR_API_VERSION	1
+
+struct lmpfr_api {
+	int version;	/* LMPFR_API_VERSION */
+	/* mpfr_t at index i, or NULL / an argument error */
+	mpfr_ptr (*test)(lua_State *L, int i);
+	mpfr_ptr (*check)(lua_State *L, int i);
+	/* push a new NaN of precision prec */
+	mpfr_ptr (*push)(lua_State *L, mpfr_prec_t prec);
+	/* elements of the mpfr_vector at index i, all of the same
+	 * precision, stored contiguously; their number goes to *n */
+	mpfr_ptr (*testvector)(lua_State *L, int i, size_t *n);
+	mpfr_ptr (*checkvector)(lua_State *L, int i, size_t *n);
+	/* push a new vector of n NaNs of precision prec */
+	mpfr_ptr (*pushvector)(lua_State *L, size_t n, mpfr_prec_t prec);
+};
+
+#ifndef LMPFR_CORE
+
+static const struct lmpfr_api *lmpfr_api_;
+
+/* require "mpfr" and fetch its table; raises an error on mismatch */
+static void lmpfr_import(lua_State *L)
+{
+	lua_getglobal(L, "require");
+	lua_pushliteral(L, "mpfr");
+	lua_call(L, 1, 0);
+	lua_getfield(L, LUA_REGISTRYINDEX, LMPFR_API);
+	lmpfr_api_ = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (!lmpfr_api_ || lmpfr_api_->version != LMPFR_API_VERSION)
+		luaL_error(L, "incompatible mpfr module");
+}
+
+#define lmpfr_test(L, i)	(lmpfr_api_->test((L), (i)))
+#define lmpfr_check(L, i)	(lmpfr_api_->check((L), (i)))
+#define lmpfr_push(L, prec)	(lmpfr_api_->push((L), (prec)))
+#define lmpfr_testvector(L, i, n)	(lmpfr_api_->testvector((L), (i), (n)))
+#define lmpfr_checkvector(L, i, n)	(lmpfr_api_->checkvector((L), (i), (n)))
+#define lmpfr_pushvector(L, n, prec)	\
+	(lmpfr_api_->pushvector((L), (n), (prec)))
+
+#endif
+
+#endif
@@ -16,3 +16,32 @@ for i = 1, 100 do
 end
 
 print("sum is", s)
+
+-- the same series by binary splitting: term n is 1 * prod(1 / j, j = 1..n)
+print("sum is", mpfr.series_sum(mpfr.new(), {p = {1}, q = {1, 0}, a = {1}}, 101))
+
+-- sqrt(2) to 10000 bits, starting from a double
+local f, df = mpfr.compile("x*x - 2", {"x"}), mpfr.compile("2*x", {"x"})
+local x, n = mpfr.newton(f, df, 1.5, 10000)
+print(n .. " steps", x:sub(x, mpfr.new(10000):sqrt(2)))
+
+-- log(1 + 1e-20) correctly rounded: log magnifies the error of the sum
+local y = mpfr.eval_correct(mpfr.compile("log(x+y)", {"x", "y"}), {1, 1e-20}, 53)
+local u = mpfr.new(53):set(1e-20)
+assert(y == u:log1p(u))
+print("log(1 + 1e-20) =", y)
+
+-- an enclosure of sin(0.1) + 1/3 at 64 bits
+local I = mpfr.interval(64)
+print(I:set("0.1"):sin(I) + mpfr.interval(64):set(1):div(1, 3))
+
+-- exp(i pi) + 1, and a batch of squares
+local z = mpfr.complex(128)
+print(z:exp(z:set(0, mpfr.new(128):const_pi())) + 1)
+local v = mpfr.cvector(3, 128)
+for i = 1, #v do v:set(i, i, -i) end
+print(v:mul(v, v):get(3))
+
+-- exact round trip through hex, with no decimal conversion
+local h = mpfr.new(200):const_pi():tohex()
+print(h, mpfr.new(200):set(h, "hex") == mpfr.new(200):const_pi())